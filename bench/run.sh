@@ -0,0 +1,145 @@
+#!/bin/sh
+#
+# Copyright (C) 2016 Marius L. Jøhndal
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+# Times complete castget runs against a local fixture server.
+#
+# Usage: run.sh [CASTGET]
+#
+# The fixture is configured with these environment variables:
+#
+#   BENCH_FEEDS       number of feeds (10)
+#   BENCH_ITEMS       items per feed (10)
+#   BENCH_SIZE        bytes per enclosure (1048576)
+#   BENCH_LATENCY     milliseconds before each response (0)
+#   BENCH_BANDWIDTH   bytes per second per connection, 0 for no limit (0)
+#   BENCH_ERROR_RATE  fraction of requests that fail with 503 (0)
+#   BENCH_NO_RANGE    set to ignore Range requests
+#   BENCH_ARGS        extra arguments for castget
+#
+# Three runs are timed: a cold run that downloads everything, a warm run
+# in which nothing has changed, and a catch-up run from an empty channel
+# directory.
+
+CASTGET=${1:-castget}
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+FEEDS=${BENCH_FEEDS:-10}
+ITEMS=${BENCH_ITEMS:-10}
+SIZE=${BENCH_SIZE:-1048576}
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/castget-bench.XXXXXX") || exit 1
+SERVER_PID=
+
+cleanup() {
+  if [ -n "$SERVER_PID" ]; then
+    kill "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+  fi
+
+  rm -rf "$WORK_DIR"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now() {
+  python3 -c 'import time; print("%.6f" % time.time())'
+}
+
+# Prints a line of results for a run.
+report() {
+  python3 - "$@" <<'PYTHON'
+import sys
+name, start, end, feeds, size = sys.argv[1], float(sys.argv[2]), float(sys.argv[3]), int(sys.argv[4]), int(sys.argv[5])
+wall = end - start
+print("%-10s %10.3f %10.1f %10.2f" % (name, wall, feeds / wall if wall else 0.0,
+                                        size / 1048576.0 / wall if wall else 0.0))
+PYTHON
+}
+
+# Prints the number of bytes in the spool directories.
+spool_size() {
+  find "$WORK_DIR/spool" -type f -exec cat {} + | wc -c | tr -d ' '
+}
+
+python3 "$BENCH_DIR/server.py" \
+  --port-file "$WORK_DIR/port" \
+  --feeds "$FEEDS" \
+  --items "$ITEMS" \
+  --size "$SIZE" \
+  --latency "${BENCH_LATENCY:-0}" \
+  --bandwidth "${BENCH_BANDWIDTH:-0}" \
+  --error-rate "${BENCH_ERROR_RATE:-0}" \
+  ${BENCH_NO_RANGE:+--no-range} &
+SERVER_PID=$!
+
+i=0
+while [ ! -f "$WORK_DIR/port" ]; do
+  i=$((i + 1))
+
+  if [ $i -gt 100 ] || ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo "Fixture server did not start." >&2
+    exit 1
+  fi
+
+  sleep 0.1
+done
+
+PORT=$(cat "$WORK_DIR/port")
+
+# Generate a configuration with one channel per feed.
+RCFILE="$WORK_DIR/castgetrc"
+: > "$RCFILE"
+
+n=0
+while [ $n -lt "$FEEDS" ]; do
+  mkdir -p "$WORK_DIR/spool/$n"
+  cat >> "$RCFILE" <<RC
+[feed$n]
+url=http://127.0.0.1:$PORT/feed/$n.xml
+spool=$WORK_DIR/spool/$n
+
+RC
+  n=$((n + 1))
+done
+
+mkdir -p "$WORK_DIR/channels"
+
+run() {
+  "$CASTGET" -q -C "$RCFILE" -D "$WORK_DIR/channels" $BENCH_ARGS "$@"
+}
+
+echo "castget benchmark: $FEEDS feeds, $ITEMS items per feed, $SIZE bytes per enclosure"
+printf "%-10s %10s %10s %10s\n" "run" "wall (s)" "feeds/s" "MB/s"
+
+start=$(now)
+run
+end=$(now)
+report cold "$start" "$end" "$FEEDS" "$(spool_size)"
+
+start=$(now)
+run
+end=$(now)
+report warm "$start" "$end" "$FEEDS" 0
+
+rm -rf "$WORK_DIR/channels"
+mkdir -p "$WORK_DIR/channels"
+
+start=$(now)
+run -c
+end=$(now)
+report catchup "$start" "$end" "$FEEDS" 0
@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2016 Marius L. Jøhndal
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+"""HTTP server for benchmarking castget on loopback.
+
+Serves synthetic RSS feeds at /feed/<n>.xml, each with a number of items
+whose enclosures are served at /enclosure/<n>/<m>.mp3. Enclosure contents
+are generated on the fly, so no files are needed. Latency, bandwidth and
+error rates can be set to mimic slow or unreliable origins.
+"""
+
+import argparse
+import os
+import random
+import re
+import sys
+import threading
+import time
+from email.utils import formatdate
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+CHUNK_SIZE = 16384
+
+
+class Fixture:
+    def __init__(self, args):
+        self.args = args
+        self.random = random.Random(args.seed)
+        self.lock = threading.Lock()
+        self.pattern = bytes(range(256)) * (CHUNK_SIZE // 256)
+
+    def fail(self):
+        with self.lock:
+            return self.random.random() < self.args.error_rate
+
+    def feed(self, n):
+        base = "http://%s:%d" % (self.args.host, self.args.port)
+        items = []
+
+        for m in range(self.args.items):
+            items.append(
+                "<item><title>Episode %d</title>"
+                "<pubDate>%s</pubDate>"
+                "<enclosure url=\"%s/enclosure/%d/%d.mp3\" length=\"%d\" type=\"audio/mpeg\"/>"
+                "</item>" % (m, formatdate(1451606400 + m * 86400, usegmt=True),
+                             base, n, m, self.args.size))
+
+        return ("<?xml version=\"1.0\"?>"
+                "<rss version=\"2.0\"><channel>"
+                "<title>Feed %d</title><link>%s</link><description>Benchmark feed</description>"
+                "%s</channel></rss>" % (n, base, "".join(items))).encode("utf-8")
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        if self.server.fixture.args.verbose:
+            BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def do_HEAD(self):
+        self.respond(head=True)
+
+    def do_GET(self):
+        self.respond(head=False)
+
+    def respond(self, head):
+        fixture = self.server.fixture
+        args = fixture.args
+
+        if args.latency:
+            time.sleep(args.latency / 1000.0)
+
+        if fixture.fail():
+            self.send_error(503)
+            return
+
+        m = re.match(r"^/feed/(\d+)\.xml$", self.path)
+
+        if m and int(m.group(1)) < args.feeds:
+            body = fixture.feed(int(m.group(1)))
+            self.send_response(200)
+            self.send_header("Content-Type", "application/rss+xml")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+
+            if not head:
+                self.send_body_bytes(body)
+            return
+
+        m = re.match(r"^/enclosure/(\d+)/(\d+)\.mp3$", self.path)
+
+        if m and int(m.group(1)) < args.feeds and int(m.group(2)) < args.items:
+            self.send_enclosure(head)
+            return
+
+        self.send_error(404)
+
+    def send_enclosure(self, head):
+        args = self.server.fixture.args
+        start, end = 0, args.size - 1
+        status = 200
+        ranged = self.headers.get("Range")
+
+        if ranged and not args.no_range:
+            m = re.match(r"^bytes=(\d*)-(\d*)$", ranged)
+
+            if not m or (m.group(1) == "" and m.group(2) == ""):
+                self.send_error(416)
+                return
+
+            if m.group(1) == "":
+                start = max(args.size - int(m.group(2)), 0)
+            else:
+                start = int(m.group(1))
+
+                if m.group(2) != "":
+                    end = min(int(m.group(2)), end)
+
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % args.size)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+            status = 206
+
+        self.send_response(status)
+        self.send_header("Content-Type", "audio/mpeg")
+        self.send_header("Content-Length", str(end - start + 1))
+
+        if not args.no_range:
+            self.send_header("Accept-Ranges", "bytes")
+
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, args.size))
+
+        self.end_headers()
+
+        if not head:
+            self.send_pattern(start, end + 1)
+
+    def send_body_bytes(self, body):
+        for i in range(0, len(body), CHUNK_SIZE):
+            self.throttled_write(body[i:i + CHUNK_SIZE])
+
+    def send_pattern(self, start, end):
+        pattern = self.server.fixture.pattern
+        position = start
+
+        while position < end:
+            offset = position % len(pattern)
+            n = min(len(pattern) - offset, end - position)
+            self.throttled_write(pattern[offset:offset + n])
+            position += n
+
+    def throttled_write(self, data):
+        bandwidth = self.server.fixture.args.bandwidth
+        started = time.monotonic()
+
+        try:
+            self.wfile.write(data)
+        except (BrokenPipeError, ConnectionResetError):
+            return
+
+        if bandwidth:
+            delay = len(data) / float(bandwidth) - (time.monotonic() - started)
+
+            if delay > 0:
+                time.sleep(delay)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=0,
+                        help="port to listen on, or 0 to pick a free port")
+    parser.add_argument("--port-file",
+                        help="write the port to this file once listening")
+    parser.add_argument("--feeds", type=int, default=10, help="number of feeds")
+    parser.add_argument("--items", type=int, default=10, help="items per feed")
+    parser.add_argument("--size", type=int, default=1048576,
+                        help="size of each enclosure in bytes")
+    parser.add_argument("--latency", type=float, default=0,
+                        help="delay before each response in milliseconds")
+    parser.add_argument("--bandwidth", type=int, default=0,
+                        help="bytes per second per connection, or 0 for no limit")
+    parser.add_argument("--error-rate", type=float, default=0,
+                        help="fraction of requests answered with 503")
+    parser.add_argument("--no-range", action="store_true",
+                        help="ignore Range headers")
+    parser.add_argument("--seed", type=int, default=0,
+                        help="seed for the choice of failing requests")
+    parser.add_argument("--verbose", action="store_true", help="log requests")
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer((args.host, args.port), Handler)
+    server.daemon_threads = True
+    args.port = server.server_address[1]
+    server.fixture = Fixture(args)
+
+    if args.port_file:
+        with open(args.port_file + ".tmp", "w") as f:
+            f.write("%d\n" % args.port)
+
+        os.rename(args.port_file + ".tmp", args.port_file)
+    else:
+        print(args.port)
+        sys.stdout.flush()
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
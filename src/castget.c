@@ -29,26 +29,64 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <libxml/parser.h>
 #ifdef ENABLE_ID3LIB
 #include <id3.h>
 #endif /* ENABLE_ID3LIB */
 #include "configuration.h"
 #include "channel.h"
+#include "utils.h"
+#include "postprocess.h"
+#include "id3v2.h"
+#include "playlist.h"
+#include "stats.h"
+#include "trace.h"
+#include "events.h"
+#include "libxmlutil.h"
+#include "progress.h"
+#include "rss.h"
+#include "plan.h"
+#include "diskwriter.h"
+
+/* Progress events are written at most this often. */
+#define PROGRESS_EVENT_INTERVAL G_TIME_SPAN_SECOND
+
+/* Number of feeds or enclosure sizes requested at the same time when
+   planning. */
+#define PLAN_PARALLEL_TRANSFERS 8
 
 enum op {
   OP_UPDATE,
   OP_CATCHUP,
-  OP_LIST
+  OP_LIST,
+  OP_COMPACT,
+  OP_PLAN,
+  OP_EXECUTE_PLAN,
+  OP_MIGRATE_SPOOL
 };
 
-static int _process_channel(const gchar *channel_directory, GKeyFile *kf, const char *identifier,
-                            enum op op, struct channel_configuration *defaults,
-                            enclosure_filter *filter);
+/* Criteria by which the scheduler orders enclosures across channels. */
+enum schedule_policy {
+  SCHEDULE_PRIORITY,
+  SCHEDULE_NEWEST,
+  SCHEDULE_SHORTEST
+};
+
+static int _process_channel(const gchar *channel_directory, struct configuration *cfg,
+                            const char *identifier, enum op op, enclosure_filter *filter);
+static int _plan_channels(const gchar *channel_directory, struct configuration *cfg,
+                          GPtrArray *identifiers, enclosure_filter *filter,
+                          const gchar *plan_file);
+static int _execute_plan(const gchar *channel_directory, struct configuration *cfg,
+                         const gchar *plan_file);
+static int _schedule_channels(const gchar *channel_directory, struct configuration *cfg,
+                              GPtrArray *identifiers, enclosure_filter *filter);
 static void usage(void);
 static void version(void);
-static GKeyFile *_configuration_file_open(const gchar *rcfile);
-static void _configuration_file_close(GKeyFile *kf);
+static int _compact_channel_directory(const gchar *channel_directory,
+                                      struct configuration *cfg);
 #ifdef ENABLE_ID3LIB
 static int _id3_set(const gchar *filename, int clear, const gchar *lead_artist,
                     const gchar *content_group, const gchar *title,
@@ -57,8 +95,21 @@ static int _id3_set(const gchar *filename, int clear, const gchar *lead_artist,
 static int _id3_check_and_set(const gchar *filename,
                               const struct channel_configuration *cfg);
 #endif /* ENABLE_ID3LIB */
-static int playlist_add(const gchar *playlist_file,
-                        const gchar *media_file);
+static void _postprocess_enclosure(const gchar *filename, gpointer user_data);
+static void _postprocess_enclosure_complete(const gchar *filename, gpointer user_data);
+static int _commit_playlists(void);
+static gboolean _parse_stats_option(const gchar *option_name, const gchar *value,
+                                    gpointer data, GError **error);
+static gboolean _parse_schedule_option(const gchar *option_name, const gchar *value,
+                                       gpointer data, GError **error);
+static void _record_channel_file_sizes(const gchar *channel_directory,
+                                       struct configuration *cfg);
+static gint64 _maxrss(void);
+static void _emit_event(const struct channel_configuration *c, channel_action action,
+                        channel_info *channel_info, enclosure *enclosure,
+                        const gchar *filename, const transfer_info *transfer);
+static void _emit_progress_event(gpointer user_data, const gchar *name, gint64 position,
+                                 gint64 total, double rate);
 
 static gboolean verbose = FALSE;
 static gboolean quiet = FALSE;
@@ -66,23 +117,41 @@ static gboolean first_only = FALSE;
 static gboolean resume = FALSE;
 static gboolean debug = FALSE;
 static gboolean show_progress_bar = FALSE;
+static progress_display *progress = NULL;
 static gboolean show_version = FALSE;
 static gboolean show_debug_info = FALSE;
 static gboolean new_only = FALSE;
 static gboolean list = FALSE;
 static gboolean catchup = FALSE;
+static gboolean compact = FALSE;
+static gboolean migrate_spool = FALSE;
 static gchar *rcfile = NULL;
 static gchar *channeldir = NULL;
 static gchar *filter_regex = NULL;
+static gchar *commit = NULL;
+static channel_commit_policy commit_policy = CHANNEL_COMMIT_ITEM;
+static commit_group *run_commit_group = NULL;
+static gint post_workers = 1;
+static postprocess_queue *postprocess = NULL;
+static gboolean dedupe_playlists = FALSE;
+static playlist_writer *playlists = NULL;
+static gboolean show_stats = FALSE;
+static gboolean stats_json = FALSE;
+static gchar *metrics_file = NULL;
+static gchar *trace_file = NULL;
+static gchar *events_format = NULL;
+static gchar *plan_file = NULL;
+static gchar *execute_plan_file = NULL;
+static GArray *schedule_policies = NULL;
 
 int main(int argc, char **argv)
 {
   enum op op = OP_UPDATE;
   int i, len;
   int ret = 0;
-  gchar **groups;
-  GKeyFile *kf;
-  struct channel_configuration *defaults;
+  gchar *snapshot_file;
+  gint64 start;
+  struct configuration *cfg;
   enclosure_filter *filter = NULL;
   GError *error = NULL;
   GOptionContext *context;
@@ -91,6 +160,11 @@ int main(int argc, char **argv)
   {
     {"catchup",      'c', 0, G_OPTION_ARG_NONE,     &catchup,           "catch up with channels and exit"},
     {"list",         'l', 0, G_OPTION_ARG_NONE,     &list,              "list available enclosures that have not yet been downloaded and exit"},
+    {"compact",      0,   0, G_OPTION_ARG_NONE,     &compact,           "remove channel files of channels no longer in the configuration and exit"},
+    {"plan",         0,   0, G_OPTION_ARG_FILENAME, &plan_file,         "write the enclosures that would be downloaded and their sizes to a file and exit", "FILE"},
+    {"execute-plan", 0,   0, G_OPTION_ARG_FILENAME, &execute_plan_file, "download the enclosures listed in a plan file", "FILE"},
+    {"schedule",     0,   0, G_OPTION_ARG_CALLBACK, (gpointer)_parse_schedule_option, "order downloads across channels by priority, newest or shortest", "POLICIES"},
+    {"migrate-spool", 0,  0, G_OPTION_ARG_NONE,     &migrate_spool,     "move downloaded enclosures to where the spool layout puts them and exit"},
     {"version",      'V', 0, G_OPTION_ARG_NONE,     &show_version,      "print version and exit"},
 
     {"resume",       'r', 0, G_OPTION_ARG_NONE,     &resume,            "resume aborted downloads"},
@@ -100,6 +174,13 @@ int main(int argc, char **argv)
     {"debug",        'd', 0, G_OPTION_ARG_NONE,     &show_debug_info,   "print connection debug information"},
     {"verbose",      'v', 0, G_OPTION_ARG_NONE,     &verbose,           "print detailed progress information"},
     {"progress-bar", 'p', 0, G_OPTION_ARG_NONE,     &show_progress_bar, "print progress bar"},
+    {"commit",       0,   0, G_OPTION_ARG_STRING,   &commit,            "commit channel files to disk after each item, channel or run"},
+    {"post-workers", 0,   0, G_OPTION_ARG_INT,      &post_workers,      "number of threads tagging downloaded enclosures and updating playlists"},
+    {"dedupe-playlists", 0, 0, G_OPTION_ARG_NONE,   &dedupe_playlists,  "do not add enclosures that are already in a playlist"},
+    {"stats",        0,   G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, (gpointer)_parse_stats_option, "print the time spent in each phase of the run as a table or as json", "FORMAT"},
+    {"metrics-file", 0,   0, G_OPTION_ARG_FILENAME, &metrics_file,      "write metrics for the run to a file in the Prometheus text format"},
+    {"trace",        0,   0, G_OPTION_ARG_FILENAME, &trace_file,        "write a timeline of the run to a file in the Chrome trace event format"},
+    {"events",       0,   0, G_OPTION_ARG_STRING,   &events_format,     "write a stream of events to standard output instead of messages", "FORMAT"},
 
     {"new-only",     'n', 0, G_OPTION_ARG_NONE,     &new_only,          "only process new channels"},
     {"quiet",        'q', 0, G_OPTION_ARG_NONE,     &quiet,             "only print error messages"},
@@ -125,8 +206,39 @@ int main(int argc, char **argv)
     exit(1);
   }
 
-  if ((catchup && list) || (catchup && show_version) || (list && show_version)) {
-    g_print("option parsing failed: --catchup, --list and --version options are incompatible.\n");
+  if (events_format) {
+    if (strcmp(events_format, "jsonl")) {
+      g_print("option parsing failed: --events must be jsonl.\n");
+      exit(1);
+    }
+
+    if (verbose || show_progress_bar || show_stats) {
+      g_print("option parsing failed: --events cannot be combined with --verbose, --progress-bar or --stats.\n");
+      exit(1);
+    }
+
+    /* Keep standard output for the events. */
+    quiet = TRUE;
+  }
+
+  if ((catchup && list) || (catchup && show_version) || (list && show_version) ||
+      (compact && (catchup || list || show_version)) ||
+      ((plan_file || execute_plan_file) && (catchup || list || compact || show_version)) ||
+      (plan_file && execute_plan_file) ||
+      (migrate_spool && (catchup || list || compact || plan_file || execute_plan_file ||
+                         show_version))) {
+    g_print("option parsing failed: --catchup, --list, --compact, --plan, --execute-plan, --migrate-spool and --version options are incompatible.\n");
+    exit(1);
+  }
+
+  if (schedule_policies && (catchup || list || compact || plan_file || execute_plan_file ||
+                            migrate_spool)) {
+    g_print("option parsing failed: --schedule only applies to downloads.\n");
+    exit(1);
+  }
+
+  if (execute_plan_file && argc > 1) {
+    g_print("option parsing failed: --execute-plan does not take channel identifiers.\n");
     exit(1);
   }
 
@@ -142,19 +254,77 @@ int main(int argc, char **argv)
   if (list)
     op = OP_LIST;
 
+  if (compact)
+    op = OP_COMPACT;
+
+  if (plan_file)
+    op = OP_PLAN;
+
+  if (execute_plan_file)
+    op = OP_EXECUTE_PLAN;
+
+  if (migrate_spool)
+    op = OP_MIGRATE_SPOOL;
+
   if (filter_regex) {
 #ifdef ENABLE_GREGEX
     filter = enclosure_filter_new(filter_regex, FALSE);
     g_free(filter_regex);
+
+    if (!filter)
+      exit(1);
 #else /* !ENABLE_GREGEX */
     g_print("option parsing failed: filters not supported by this build.\n");
     exit(1);
 #endif /* ENABLE_GREGEX */
   }
 
+  if (commit) {
+    if (!strcmp(commit, "item"))
+      commit_policy = CHANNEL_COMMIT_ITEM;
+    else if (!strcmp(commit, "channel"))
+      commit_policy = CHANNEL_COMMIT_CHANNEL;
+    else if (!strcmp(commit, "run"))
+      commit_policy = CHANNEL_COMMIT_RUN;
+    else {
+      g_print("option parsing failed: --commit must be one of item, channel or run.\n");
+      exit(1);
+    }
+
+    g_free(commit);
+  }
+
+  if (post_workers < 0) {
+    g_print("option parsing failed: --post-workers must not be negative.\n");
+    exit(1);
+  }
+
+  if (commit_policy == CHANNEL_COMMIT_RUN)
+    run_commit_group = commit_group_new();
+
+  if (metrics_file)
+    stats_init();
+
+  if (trace_file) {
+    if (trace_open(trace_file))
+      exit(1);
+
+    stats_init();
+  }
+
+  if (events_format) {
+    events_open(stdout);
+    g_free(events_format);
+  }
+
   if (verbose && new_only)
     g_print("Fetching new channels only...\n");
 
+  /* Count memory allocated by libxml2 when collecting statistics. This
+     must happen before libxml2 allocates anything. */
+  if (stats_enabled())
+    libxmlutil_track_memory();
+
   LIBXML_TEST_VERSION;
 
   /* Build the channel directory path and ensure that it exists. */
@@ -175,57 +345,243 @@ int main(int argc, char **argv)
     /* Supply default path name. */
     rcfile = g_build_filename(g_get_home_dir(), ".castgetrc", NULL);
 
-  kf = _configuration_file_open(rcfile);
-
-  if (kf) {
-    /* Read defaults. */
-    if (g_key_file_has_group(kf, "*")) {
-      /* Verify the keys in the global configuration. */
-      if (channel_configuration_verify_keys(kf, "*") < 0)
-        return -1;
+  /* The parsed configuration is cached in the channel directory. */
+  snapshot_file = g_build_filename(channeldir, "castgetrc.cache", NULL);
+  start = stats_now();
+  cfg = configuration_load(rcfile, snapshot_file);
+  stats_record(NULL, STATS_CONFIG_LOAD, start);
+  g_free(snapshot_file);
+
+  if (cfg) {
+    if (op == OP_UPDATE || op == OP_EXECUTE_PLAN) {
+      if (show_progress_bar)
+        progress = progress_display_new(stdout);
+      else if (events_enabled()) {
+        progress = progress_display_new(NULL);
+        progress_display_set_listener(progress, _emit_progress_event, NULL,
+                                      PROGRESS_EVENT_INTERVAL);
+      }
 
-      defaults = channel_configuration_new(kf, "*", NULL);
-    } else
-      defaults = NULL;
+      playlists = playlist_writer_new(dedupe_playlists);
+      postprocess = postprocess_queue_new(post_workers, _postprocess_enclosure,
+                                          _postprocess_enclosure_complete);
+    }
 
     /* Perform actions. */
-    if (optind < argc) {
+    if (op == OP_COMPACT) {
+      if (_compact_channel_directory(channeldir, cfg))
+        ret = 1;
+    } else if (op == OP_EXECUTE_PLAN) {
+      if (_execute_plan(channeldir, cfg, execute_plan_file))
+        ret = 1;
+    } else if (op == OP_PLAN || (op == OP_UPDATE && schedule_policies)) {
+      GPtrArray *identifiers = g_ptr_array_new();
+
+      if (optind < argc) {
+        while (optind < argc)
+          g_ptr_array_add(identifiers, argv[optind++]);
+      } else {
+        for (i = 0; i < cfg->channels->len; i++)
+          g_ptr_array_add(identifiers,
+                          ((struct channel_configuration *)g_ptr_array_index(cfg->channels, i))->identifier);
+      }
+
+      if (op == OP_PLAN) {
+        if (_plan_channels(channeldir, cfg, identifiers, filter, plan_file))
+          ret = 1;
+      } else if (_schedule_channels(channeldir, cfg, identifiers, filter))
+        ret = 1;
+
+      g_ptr_array_free(identifiers, TRUE);
+    } else if (optind < argc) {
       while (optind < argc)
-        _process_channel(channeldir, kf, argv[optind++], op, defaults,
-                         filter);
+        _process_channel(channeldir, cfg, argv[optind++], op, filter);
     } else {
-      groups = g_key_file_get_groups(kf, NULL);
+      for (i = 0; i < cfg->channels->len; i++) {
+        struct channel_configuration *c = g_ptr_array_index(cfg->channels, i);
 
-      for (i = 0; groups[i]; i++)
-        if (strcmp(groups[i], "*"))
-          _process_channel(channeldir, kf, groups[i], op, defaults,
-                           filter);
-
-      g_strfreev(groups);
+        _process_channel(channeldir, cfg, c->identifier, op, filter);
+      }
     }
 
-    /* Clean up defaults. */
-    if (defaults)
-      channel_configuration_free(defaults);
+    /* Wait for tagging and playlist updates to finish. */
+    if (postprocess)
+      postprocess_queue_free(postprocess);
+
+    if (progress)
+      progress_display_free(progress);
+
+    disk_writers_free();
+
+    /* Write playlist entries collected during the run. */
+    if (playlists) {
+      if (playlist_writer_flush(playlists, TRUE))
+        ret = 1;
+
+      playlist_writer_free(playlists);
+    }
   } else
     ret = 1;
 
+  /* Commit channel files held back until the end of the run. */
+  if (run_commit_group) {
+    if (commit_group_commit(run_commit_group))
+      ret = 1;
+
+    commit_group_free(run_commit_group);
+  }
+
+  /* Take the final memory samples before any of the statistics are
+     written out. */
+  stats_record_memory(NULL, STATS_MEMORY_MAXRSS, _maxrss());
+
+  if (metrics_file) {
+    if (cfg)
+      _record_channel_file_sizes(channeldir, cfg);
+
+    if (write_by_temporary_file(metrics_file, stats_write_metrics, NULL, NULL, debug))
+      ret = 1;
+
+    g_free(metrics_file);
+  }
+
+  if (show_stats) {
+    if (stats_json)
+      stats_print_json(stdout);
+    else
+      stats_print_table(stdout);
+  }
+
+  stats_free();
+
+  if (events_close())
+    ret = 1;
+
+  if (trace_file) {
+    if (trace_close())
+      ret = 1;
+
+    g_free(trace_file);
+  }
+
   /* Clean-up. */
   g_free(channeldir);
 
+  if (schedule_policies)
+    g_array_free(schedule_policies, TRUE);
+
   if (filter)
     enclosure_filter_free(filter);
 
   g_free(rcfile);
 
-  if (kf)
-    _configuration_file_close(kf);
+  if (cfg)
+    configuration_free(cfg);
 
   xmlCleanupParser();
 
   return ret;
 }
 
+/* Returns the peak resident set size of the process in bytes. */
+static gint64 _maxrss(void)
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (gint64)usage.ru_maxrss * 1024;
+#endif /* __APPLE__ */
+}
+
+/* Records the size of the channel file of each channel in the
+   configuration for the metrics file. */
+static void _record_channel_file_sizes(const gchar *channel_directory,
+                                       struct configuration *cfg)
+{
+  struct channel_configuration *c;
+  gchar *channel_filename, *channel_file;
+  struct stat buf;
+  int i;
+
+  for (i = 0; i < cfg->channels->len; i++) {
+    c = g_ptr_array_index(cfg->channels, i);
+
+    channel_filename = g_strjoin(".", c->identifier, "xml", NULL);
+    channel_file = g_build_filename(channel_directory, channel_filename, NULL);
+    g_free(channel_filename);
+
+    if (g_stat(channel_file, &buf) == 0)
+      stats_set_state_size(c->identifier, buf.st_size);
+
+    g_free(channel_file);
+  }
+}
+
+static gboolean _parse_stats_option(const gchar *option_name, const gchar *value,
+                                    gpointer data, GError **error)
+{
+  if (value && strcmp(value, "table") && strcmp(value, "json")) {
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                "--stats must be table or json");
+    return FALSE;
+  }
+
+  show_stats = TRUE;
+  stats_json = value && !strcmp(value, "json");
+  stats_init();
+
+  return TRUE;
+}
+
+/* Parses a comma-separated list of scheduling policies. The first
+   policy decides the order, and each of the following ones breaks ties
+   left by those before it. With config, the only policy, channels are
+   processed one at a time as usual. */
+static gboolean _parse_schedule_option(const gchar *option_name, const gchar *value,
+                                       gpointer data, GError **error)
+{
+  gchar **names;
+  enum schedule_policy policy;
+  int i;
+
+  if (schedule_policies) {
+    g_array_free(schedule_policies, TRUE);
+    schedule_policies = NULL;
+  }
+
+  if (!strcmp(value, "config"))
+    return TRUE;
+
+  schedule_policies = g_array_new(FALSE, FALSE, sizeof(enum schedule_policy));
+  names = g_strsplit(value, ",", -1);
+
+  for (i = 0; names[i]; i++) {
+    if (!strcmp(names[i], "priority"))
+      policy = SCHEDULE_PRIORITY;
+    else if (!strcmp(names[i], "newest"))
+      policy = SCHEDULE_NEWEST;
+    else if (!strcmp(names[i], "shortest"))
+      policy = SCHEDULE_SHORTEST;
+    else {
+      g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                  "--schedule must be config or a list of priority, newest and shortest");
+      g_strfreev(names);
+      return FALSE;
+    }
+
+    g_array_append_val(schedule_policies, policy);
+  }
+
+  g_strfreev(names);
+
+  return TRUE;
+}
+
 static void version(void)
 {
   g_printf("%s %s\n", PACKAGE, VERSION);
@@ -241,11 +597,29 @@ static void version(void)
   g_printf("Copyright (C) 2005-2016 Marius L. Jøhndal <mariuslj at ifi.uio.no>\n");
 }
 
+/* Returns TRUE if ID3 tags are written while downloading rather than by
+   updating the downloaded file. */
+static gboolean _id3_streamed(const struct channel_configuration *c)
+{
+  return c->id3_mode && !strcmp(c->id3_mode, "stream");
+}
+
+/* An enclosure waiting to be tagged and added to a playlist. */
+struct downloaded_enclosure {
+  const struct channel_configuration *configuration;
+  stats_channel *stats;
+  gboolean tag;
+};
+
 static void update_callback(void *user_data, channel_action action,
                             channel_info *channel_info, enclosure *enclosure,
-                            const gchar *filename)
+                            const gchar *filename, const transfer_info *transfer)
 {
   struct channel_configuration *c = (struct channel_configuration *)user_data;
+  struct downloaded_enclosure *d;
+
+  if (events_enabled())
+    _emit_event(c, action, channel_info, enclosure, filename, transfer);
 
   switch (action) {
   case CCA_RSS_DOWNLOAD_START:
@@ -290,31 +664,92 @@ static void update_callback(void *user_data, channel_action action,
     g_assert(enclosure);
     g_assert(filename);
 
-    /* Set media tags. */
-    if (enclosure->type && !strcmp(enclosure->type, "audio/mpeg")) {
+    /* A failed download leaves no file behind to tag or list. */
+    if (transfer && transfer->error[0])
+      break;
+
+    /* Tag the enclosure and update the playlist in the background. */
+    d = g_malloc(sizeof(struct downloaded_enclosure));
+    d->configuration = c;
+    d->stats = stats_channel_get(c->identifier);
+    d->tag = enclosure->type && !strcmp(enclosure->type, "audio/mpeg") &&
+      !_id3_streamed(c);
+
+    postprocess_queue_push(postprocess, filename, d);
+    break;
+
+  case CCA_ENCLOSURE_DEFERRED:
+    /* Already reported. */
+    break;
+  }
+}
+
+/* Runs on a worker thread. */
+static void _postprocess_enclosure(const gchar *filename, gpointer user_data)
+{
+  struct downloaded_enclosure *d = (struct downloaded_enclosure *)user_data;
+  gint64 start = stats_now();
+
+  /* Set media tags. */
+  if (d->tag) {
 #ifdef ENABLE_ID3LIB
-      if (_id3_check_and_set(filename, c))
-        fprintf(stderr, "Error setting ID3 tag for file %s.\n", filename);
+    if (_id3_check_and_set(filename, d->configuration))
+      fprintf(stderr, "Error setting ID3 tag for file %s.\n", filename);
 #endif /* ENABLE_ID3LIB */
-    }
+  }
+
+  stats_record(d->stats, STATS_POSTPROCESS, start);
+}
 
-    /* Update playlist. */
-    if (c->playlist) {
-      playlist_add(c->playlist, filename);
+/* Runs once per enclosure, in download order. */
+static void _postprocess_enclosure_complete(const gchar *filename, gpointer user_data)
+{
+  struct downloaded_enclosure *d = (struct downloaded_enclosure *)user_data;
+  const struct channel_configuration *c = d->configuration;
+  gint64 start;
 
-      if (verbose)
-        printf(" * Added downloaded enclosure %s to playlist %s.\n",
-               filename, c->playlist);
-    }
-    break;
+  /* Update playlist. */
+  if (c->playlist) {
+    start = stats_now();
+    playlist_writer_add(playlists, c->playlist, filename);
+
+    /* Write the entry along with the channel file, leaving it to the
+       end of the run to flush it to disk. */
+    if (commit_policy == CHANNEL_COMMIT_ITEM)
+      playlist_writer_flush(playlists, FALSE);
+
+    stats_record(d->stats, STATS_POSTPROCESS, start);
+
+    if (verbose)
+      printf(" * Added downloaded enclosure %s to playlist %s.\n",
+             filename, c->playlist);
   }
+
+  g_free(d);
+}
+
+/* Writes out the playlist entries of the enclosures downloaded so far,
+   once they have been postprocessed, so that playlists keep up with
+   channel files committed per channel. */
+static int _commit_playlists(void)
+{
+  if (!playlists)
+    return 0;
+
+  postprocess_queue_drain(postprocess);
+
+  return playlist_writer_flush(playlists, TRUE);
 }
 
 static void catchup_callback(void *user_data, channel_action action, channel_info *channel_info,
-                             enclosure *enclosure, const gchar *filename)
+                             enclosure *enclosure, const gchar *filename,
+                             const transfer_info *transfer)
 {
   struct channel_configuration *c = (struct channel_configuration *)user_data;
 
+  if (events_enabled())
+    _emit_event(c, action, channel_info, enclosure, filename, transfer);
+
   switch (action) {
   case CCA_RSS_DOWNLOAD_START:
     if (!quiet)
@@ -334,15 +769,23 @@ static void catchup_callback(void *user_data, channel_action action, channel_inf
     break;
 
   case CCA_ENCLOSURE_DOWNLOAD_END:
+  case CCA_ENCLOSURE_DEFERRED:
     break;
   }
 }
 
 static void list_callback(void *user_data, channel_action action, channel_info *channel_info,
-                          enclosure *enclosure, const gchar *filename)
+                          enclosure *enclosure, const gchar *filename,
+                          const transfer_info *transfer)
 {
   struct channel_configuration *c = (struct channel_configuration *)user_data;
 
+  /* The events take the place of the listing. */
+  if (events_enabled()) {
+    _emit_event(c, action, channel_info, enclosure, filename, transfer);
+    return;
+  }
+
   switch (action) {
   case CCA_RSS_DOWNLOAD_START:
     g_printf("Listing channel %s...\n", c->identifier);
@@ -377,45 +820,209 @@ static void list_callback(void *user_data, channel_action action, channel_info *
     break;
 
   case CCA_ENCLOSURE_DOWNLOAD_END:
+  case CCA_ENCLOSURE_DEFERRED:
     break;
   }
 }
 
-static int _process_channel(const gchar *channel_directory, GKeyFile *kf, const char *identifier,
-                            enum op op, struct channel_configuration *defaults,
-                            enclosure_filter *filter)
+static void _add_transfer_fields(GString *e, const transfer_info *transfer)
 {
-  channel *c;
-  gchar *channel_filename, *channel_file;
-  struct channel_configuration *channel_configuration;
-  enclosure_filter *per_channel_filter = NULL;
+  if (transfer->response_code)
+    event_add_int(e, "status", transfer->response_code);
+
+  event_add_int(e, "bytes", (gint64)transfer->bytes);
+  event_add_double(e, "duration", transfer->total_time);
+  event_add_double(e, "first_byte", transfer->start_transfer_time);
+  event_add_double(e, "speed", transfer->download_speed);
+
+  if (*transfer->error)
+    event_add_string(e, "error", transfer->error);
+}
+
+/* Writes a channel callback as an event. A feed that could not be
+   fetched or parsed ends without channel information. */
+static void _emit_event(const struct channel_configuration *c, channel_action action,
+                        channel_info *channel_info, enclosure *enclosure,
+                        const gchar *filename, const transfer_info *transfer)
+{
+  GString *e = NULL;
+
+  switch (action) {
+  case CCA_RSS_DOWNLOAD_START:
+    e = event_new("feed_start");
+    event_add_string(e, "channel", c->identifier);
+    event_add_string(e, "url", c->url);
+    break;
+
+  case CCA_RSS_DOWNLOAD_END:
+    e = event_new("feed_end");
+    event_add_string(e, "channel", c->identifier);
+    event_add_string(e, "url", c->url);
+    event_add_bool(e, "ok", channel_info != NULL);
 
-  /* Check channel identifier and read channel configuration. */
-  if (!g_key_file_has_group(kf, identifier)) {
-    fprintf(stderr, "Unknown channel identifier %s.\n", identifier);
+    if (channel_info)
+      event_add_string(e, "title", channel_info->title);
 
+    if (transfer)
+      _add_transfer_fields(e, transfer);
+    break;
+
+  case CCA_ENCLOSURE_DOWNLOAD_START:
+    e = event_new("enclosure_start");
+    event_add_string(e, "channel", c->identifier);
+    event_add_string(e, "url", enclosure->url);
+    event_add_string(e, "file", filename);
+    event_add_string(e, "type", enclosure->type);
+
+    if (enclosure->length > 0)
+      event_add_int(e, "length", enclosure->length);
+    break;
+
+  case CCA_ENCLOSURE_DOWNLOAD_END:
+    e = event_new("enclosure_end");
+    event_add_string(e, "channel", c->identifier);
+    event_add_string(e, "url", enclosure->url);
+    event_add_string(e, "file", filename);
+    event_add_bool(e, "ok", !transfer || !*transfer->error);
+
+    if (transfer)
+      _add_transfer_fields(e, transfer);
+    break;
+
+  case CCA_ENCLOSURE_DEFERRED:
+    e = event_new("enclosure_deferred");
+    event_add_string(e, "channel", c->identifier);
+    event_add_string(e, "url", enclosure->url);
+    event_add_string(e, "file", filename);
+
+    if (enclosure->length > 0)
+      event_add_int(e, "length", enclosure->length);
+    break;
+  }
+
+  event_emit(e, FALSE);
+}
+
+/* Called by the progress display for each active download. */
+static void _emit_progress_event(gpointer user_data, const gchar *name, gint64 position,
+                                 gint64 total, double rate)
+{
+  GString *e;
+
+  e = event_new("progress");
+  event_add_string(e, "name", name);
+  event_add_int(e, "bytes", position);
+
+  if (total)
+    event_add_int(e, "total", total);
+
+  event_add_double(e, "rate", rate);
+  event_emit(e, TRUE);
+}
+
+/* Parses a non-negative integer setting. Leaves result untouched if the
+   setting is absent. */
+static int _parse_count(const gchar *value, const gchar *key, const char *identifier,
+                        long *result)
+{
+  char *endptr;
+  long n;
+
+  if (!value)
+    return 0;
+
+  n = strtol(value, &endptr, 10);
+
+  if (endptr == value || *endptr || n < 0) {
+    fprintf(stderr, "Invalid value %s for key %s in configuration of channel %s.\n",
+            value, key, identifier);
     return -1;
   }
 
-  /* Verify the keys in the channel configuration. */
-  if (channel_configuration_verify_keys(kf, identifier) < 0)
+  *result = n;
+
+  return 0;
+}
+
+/* Parses a size setting. Leaves result untouched if the setting is
+   absent. */
+static int _parse_size(const gchar *value, const gchar *key, const char *identifier,
+                       gint64 *result)
+{
+  if (!value)
+    return 0;
+
+  if (parse_size(value, result)) {
+    fprintf(stderr, "Invalid value %s for key %s in configuration of channel %s.\n",
+            value, key, identifier);
     return -1;
+  }
+
+  return 0;
+}
+
+/* Splits a comma-separated list, dropping empty items and the white
+   space around each item. */
+static gchar **_split_list(const gchar *value)
+{
+  GPtrArray *items;
+  gchar **tokens;
+  int i;
+
+  items = g_ptr_array_new();
+  tokens = g_strsplit(value, ",", -1);
 
-  channel_configuration = channel_configuration_new(kf, identifier, defaults);
+  for (i = 0; tokens[i]; i++) {
+    g_strstrip(tokens[i]);
+
+    if (*tokens[i])
+      g_ptr_array_add(items, g_strdup(tokens[i]));
+  }
+
+  g_strfreev(tokens);
+  g_ptr_array_add(items, NULL);
+
+  return (gchar **)g_ptr_array_free(items, FALSE);
+}
+
+/* Looks up the configuration of a channel, checks it and opens the
+   channel file. Returns NULL if the channel cannot be opened or is to be
+   skipped. */
+static channel *_open_channel(const gchar *channel_directory, struct configuration *cfg,
+                              const char *identifier,
+                              struct channel_configuration **configuration)
+{
+  channel *c;
+  gchar *channel_filename, *channel_file;
+  struct channel_configuration *channel_configuration;
+  long expire_days = 0, expire_missing = 0, max_episodes = 0, max_bitrate = 0;
+  gint64 reserve = 0, max_spool = 0, max_file_size = 0;
+  gchar **mime_types = NULL;
+  stats_channel *stats;
+  gint64 start;
+
+  /* Check channel identifier and look up channel configuration. Invalid
+     configurations have already been reported. */
+  channel_configuration = configuration_lookup(cfg, identifier);
+
+  if (!channel_configuration) {
+    if (!configuration_is_invalid(cfg, identifier))
+      fprintf(stderr, "Unknown channel identifier %s.\n", identifier);
+
+    return NULL;
+  }
 
   /* Check that mandatory keys were set. */
   if (!channel_configuration->url) {
     fprintf(stderr, "No feed URL set for channel %s.\n", identifier);
 
-    channel_configuration_free(channel_configuration);
-    return -1;
+    return NULL;
   }
 
   if (!channel_configuration->spool_directory) {
     fprintf(stderr, "No spool directory set for channel %s.\n", identifier);
 
-    channel_configuration_free(channel_configuration);
-    return -1;
+    return NULL;
   }
 
   /* Construct channel file name. */
@@ -427,44 +1034,177 @@ static int _process_channel(const gchar *channel_directory, GKeyFile *kf, const
     /* If we are only fetching new channels, skip the channel if there is
        already a channel file present. */
 
-    channel_configuration_free(channel_configuration);
-    return 0;
+    g_free(channel_file);
+    return NULL;
   }
 
+  if (channel_configuration->id3_mode && !_id3_streamed(channel_configuration) &&
+      strcmp(channel_configuration->id3_mode, "update")) {
+    fprintf(stderr, "Invalid value %s for key id3mode in configuration of channel %s.\n",
+            channel_configuration->id3_mode, identifier);
+    g_free(channel_file);
+    return NULL;
+  }
+
+  if (channel_configuration->layout && strcmp(channel_configuration->layout, "flat") &&
+      strcmp(channel_configuration->layout, "hash") &&
+      strcmp(channel_configuration->layout, "date")) {
+    fprintf(stderr, "Invalid value %s for key layout in configuration of channel %s.\n",
+            channel_configuration->layout, identifier);
+    g_free(channel_file);
+    return NULL;
+  }
+
+  /* Read expiry settings. */
+  if (_parse_count(channel_configuration->expire_days, "expiredays", identifier, &expire_days) ||
+      _parse_count(channel_configuration->expire_missing, "expiremissing", identifier, &expire_missing)) {
+    g_free(channel_file);
+    return NULL;
+  }
+
+  /* Read spool settings. */
+  if (_parse_size(channel_configuration->reserve, "reserve", identifier, &reserve) ||
+      _parse_size(channel_configuration->max_spool, "maxspool", identifier, &max_spool) ||
+      _parse_count(channel_configuration->max_episodes, "maxepisodes", identifier, &max_episodes)) {
+    g_free(channel_file);
+    return NULL;
+  }
+
+  /* Read media selection settings. */
+  if (_parse_count(channel_configuration->max_bitrate, "maxbitrate", identifier, &max_bitrate) ||
+      _parse_size(channel_configuration->max_file_size, "maxfilesize", identifier, &max_file_size)) {
+    g_free(channel_file);
+    return NULL;
+  }
+
+  stats = stats_channel_get(identifier);
+
+  start = stats_now();
   c = channel_new(channel_configuration->url, channel_file,
                   channel_configuration->spool_directory, resume);
+  stats_record(stats, STATS_STATE_LOAD, start);
   g_free(channel_file);
 
   if (!c) {
     fprintf(stderr, "Error parsing channel file for channel %s.\n", identifier);
 
-    channel_configuration_free(channel_configuration);
-    return -1;
+    return NULL;
+  }
+
+  channel_set_expiry(c, expire_days * 24 * 60 * 60, (int)expire_missing);
+  channel_set_commit_policy(c, commit_policy, run_commit_group);
+  channel_set_stats(c, stats);
+  channel_set_reserve(c, reserve);
+  channel_set_quota(c, max_spool, max_episodes);
+
+  if (channel_configuration->mime_types)
+    mime_types = _split_list(channel_configuration->mime_types);
+
+  channel_set_selection(c, max_bitrate, max_file_size, mime_types);
+  g_strfreev(mime_types);
+
+  if (channel_configuration->layout && !strcmp(channel_configuration->layout, "hash"))
+    channel_set_layout(c, SPOOL_LAYOUT_HASH);
+  else if (channel_configuration->layout && !strcmp(channel_configuration->layout, "date"))
+    channel_set_layout(c, SPOOL_LAYOUT_DATE);
+
+  if (_id3_streamed(channel_configuration)) {
+    GByteArray *tag;
+
+    tag = id3v2_tag_new(channel_configuration->id3_lead_artist,
+                        channel_configuration->id3_content_group,
+                        channel_configuration->id3_title,
+                        channel_configuration->id3_album,
+                        channel_configuration->id3_content_type,
+                        channel_configuration->id3_year,
+                        channel_configuration->id3_comment);
+
+    if (tag) {
+      channel_set_id3_tag(c, tag);
+      g_byte_array_unref(tag);
+    }
   }
 
+  *configuration = channel_configuration;
+
+  return c;
+}
+
+static int _process_channel(const gchar *channel_directory, struct configuration *cfg,
+                            const char *identifier, enum op op, enclosure_filter *filter)
+{
+  channel *c;
+  struct channel_configuration *channel_configuration;
+  enclosure_filter *per_channel_filter = NULL;
+  stats_channel *stats;
+  gsize xml_base = 0;
+  gint64 maxrss_base = 0;
+  GHashTable *moves;
+  int moved;
+
+  stats = stats_channel_get(identifier);
+
+  if (stats) {
+    xml_base = libxmlutil_memory_reset_peak();
+    maxrss_base = _maxrss();
+  }
+
+  c = _open_channel(channel_directory, cfg, identifier, &channel_configuration);
+
+  if (!c)
+    return -1;
+
   /* Set up per-channel filter unless overridden on the command
      line. */
   if (!filter && channel_configuration->regex_filter) {
     per_channel_filter =
       enclosure_filter_new(channel_configuration->regex_filter, FALSE);
 
+    if (!per_channel_filter) {
+      channel_free(c);
+      return -1;
+    }
+
     filter = per_channel_filter;
   }
 
   switch (op) {
   case OP_UPDATE:
     channel_update(c, channel_configuration, update_callback, 0, 0,
-                   first_only, resume, filter, debug, show_progress_bar);
+                   first_only, resume, filter, debug, progress);
+
+    if (commit_policy == CHANNEL_COMMIT_CHANNEL)
+      _commit_playlists();
     break;
 
   case OP_CATCHUP:
     channel_update(c, channel_configuration, catchup_callback, 1, 0,
-                   first_only, 0, filter, debug, show_progress_bar);
+                   first_only, 0, filter, debug, progress);
     break;
 
   case OP_LIST:
     channel_update(c, channel_configuration, list_callback, 1, 1, first_only,
-                   0, filter, debug, show_progress_bar);
+                   0, filter, debug, progress);
+    break;
+
+  case OP_MIGRATE_SPOOL:
+    moves = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    moved = channel_migrate_spool(c, moves, debug);
+
+    if (moved > 0 && !quiet)
+      g_printf("Moved %d files in channel %s.\n", moved, identifier);
+
+    /* Point the playlist at the files where they are now. */
+    if (channel_configuration->playlist && g_hash_table_size(moves))
+      playlist_rewrite(channel_configuration->playlist, moves, debug);
+
+    g_hash_table_destroy(moves);
+    break;
+
+  case OP_COMPACT:
+  case OP_PLAN:
+  case OP_EXECUTE_PLAN:
+    g_assert_not_reached();
     break;
   }
 
@@ -473,31 +1213,494 @@ static int _process_channel(const gchar *channel_directory, GKeyFile *kf, const
     enclosure_filter_free(per_channel_filter);
 
   channel_free(c);
-  channel_configuration_free(channel_configuration);
+
+  if (stats) {
+    stats_record_memory(stats, STATS_MEMORY_XML_PEAK,
+                        (gint64)libxmlutil_memory_peak() - (gint64)xml_base);
+    stats_record_memory(stats, STATS_MEMORY_XML_RETAINED,
+                        (gint64)libxmlutil_memory_in_use() - (gint64)xml_base);
+    stats_record_memory(stats, STATS_MEMORY_MAXRSS_GROWTH, _maxrss() - maxrss_base);
+  }
 
   return 0;
 }
 
-static GKeyFile *_configuration_file_open(const gchar *rcfile)
+struct planned_channel {
+  struct channel_configuration *configuration;
+  channel *channel;
+  gchar *feed_file;
+  GPtrArray *enclosures;
+  gchar *title;
+};
+
+/* Finds the enclosures that an update of the channels would download and
+   writes them to a plan file. All feeds are fetched at the same time, and
+   the sizes of enclosures that the feeds do not give are then requested
+   from the servers, again all at the same time. Nothing is downloaded
+   and the channel files are left alone. */
+static int _plan_channels(const gchar *channel_directory, struct configuration *cfg,
+                          GPtrArray *identifiers, enclosure_filter *filter,
+                          const gchar *plan_file)
 {
-  GKeyFile *kf;
-  GError *error = NULL;
+  GArray *channels;
+  struct planned_channel *pc;
+  GPtrArray *urls, *sized;
+  gchar **feed_files;
+  transfer_info *transfers;
+  urlget_request *requests;
+  enclosure_filter *per_channel_filter;
+  enclosure *e;
+  plan *p;
+  gint64 start, bytes, total_bytes = 0;
+  gchar *size;
+  int i, j, k, unknown, total_unknown = 0, ret = 0;
+
+  channels = g_array_new(FALSE, TRUE, sizeof(struct planned_channel));
+
+  for (i = 0; i < identifiers->len; i++) {
+    struct planned_channel planned = { NULL, NULL, NULL, NULL, NULL };
+
+    planned.channel = _open_channel(channel_directory, cfg,
+                                    g_ptr_array_index(identifiers, i), &planned.configuration);
+
+    if (planned.channel)
+      g_array_append_val(channels, planned);
+    else
+      ret = -1;
+  }
 
-  kf = g_key_file_new();
+  /* Fetch the feeds. Feeds that are not on a web server are read where
+     they are. */
+  urls = g_ptr_array_new();
 
-  if (!g_key_file_load_from_file(kf, rcfile, G_KEY_FILE_NONE, &error)) {
-    fprintf(stderr, "Error reading configuration file %s: %s.\n", rcfile, error->message);
-    g_error_free(error);
-    g_key_file_free(kf);
-    kf = NULL;
+  for (i = 0; i < channels->len; i++) {
+    pc = &g_array_index(channels, struct planned_channel, i);
+
+    if (!strncmp("http://", pc->configuration->url, strlen("http://")))
+      g_ptr_array_add(urls, pc->configuration->url);
+  }
+
+  transfers = g_new0(transfer_info, MAX(urls->len, 1));
+  start = stats_now();
+  feed_files = rss_fetch_urls((const char **)urls->pdata, urls->len, PLAN_PARALLEL_TRANSFERS,
+                              debug, transfers);
+
+  for (i = 0, j = 0; i < channels->len; i++) {
+    pc = &g_array_index(channels, struct planned_channel, i);
+
+    if (strncmp("http://", pc->configuration->url, strlen("http://")))
+      continue;
+
+    /* The feeds are fetched together, so each is charged the time of its
+       own transfer rather than that of the whole batch. */
+    stats_record_duration(pc->channel->stats, STATS_FETCH, start,
+                          (gint64)(transfers[j].total_time * G_USEC_PER_SEC));
+    stats_record_transfer(pc->channel->stats, pc->configuration->url, &transfers[j]);
+    pc->feed_file = feed_files[j++];
+  }
+
+  g_free(feed_files);
+  g_free(transfers);
+  g_ptr_array_free(urls, TRUE);
+
+  /* Find the enclosures to download. */
+  for (i = 0; i < channels->len; i++) {
+    pc = &g_array_index(channels, struct planned_channel, i);
+    per_channel_filter = NULL;
+
+    if (!strncmp("http://", pc->configuration->url, strlen("http://")) && !pc->feed_file) {
+      stats_count(pc->channel->stats, STATS_FEED_FAILURES);
+      ret = -1;
+      continue;
+    }
+
+    if (!filter && pc->configuration->regex_filter) {
+      per_channel_filter = enclosure_filter_new(pc->configuration->regex_filter, FALSE);
+
+      if (!per_channel_filter) {
+        ret = -1;
+        continue;
+      }
+    }
+
+    pc->enclosures =
+      channel_pending_enclosures(pc->channel,
+                                 pc->feed_file ? pc->feed_file : pc->configuration->url,
+                                 first_only, filter ? filter : per_channel_filter, &pc->title);
+
+    stats_count(pc->channel->stats, pc->enclosures ? STATS_FEEDS_FETCHED : STATS_FEED_FAILURES);
+
+    if (!pc->enclosures) {
+      fprintf(stderr, "Error reading feed of channel %s.\n", pc->configuration->identifier);
+      ret = -1;
+    }
+
+    if (per_channel_filter)
+      enclosure_filter_free(per_channel_filter);
+  }
+
+  /* Ask the servers for the sizes that the feeds do not give. */
+  sized = g_ptr_array_new();
+
+  for (i = 0; i < channels->len; i++) {
+    pc = &g_array_index(channels, struct planned_channel, i);
+
+    if (pc->enclosures)
+      for (j = 0; j < pc->enclosures->len; j++) {
+        e = g_ptr_array_index(pc->enclosures, j);
+
+        if (e->length <= 0)
+          g_ptr_array_add(sized, e);
+      }
+  }
+
+  requests = g_new0(urlget_request, MAX(sized->len, 1));
+
+  for (k = 0; k < sized->len; k++)
+    requests[k].url = ((enclosure *)g_ptr_array_index(sized, k))->url;
+
+  urlget_batch(requests, sized->len, PLAN_PARALLEL_TRANSFERS, debug);
+
+  for (k = 0; k < sized->len; k++) {
+    e = g_ptr_array_index(sized, k);
+    e->length = requests[k].failed ? -1 : (long)requests[k].length;
+  }
+
+  g_free(requests);
+  g_ptr_array_free(sized, TRUE);
+
+  /* Write the plan. */
+  p = plan_new();
+
+  for (i = 0; i < channels->len; i++) {
+    pc = &g_array_index(channels, struct planned_channel, i);
+
+    if (pc->enclosures) {
+      bytes = plan_channel_bytes(plan_add_channel(p, pc->configuration->identifier,
+                                                  pc->title, pc->enclosures), &unknown);
+      total_bytes += bytes;
+      total_unknown += unknown;
+
+      if (!quiet) {
+        size = g_format_size(bytes);
+        g_printf("Channel %s: %u enclosures, %s", pc->configuration->identifier,
+                 pc->enclosures->len, size);
+        g_free(size);
+
+        if (unknown)
+          g_printf(" and %d of unknown size", unknown);
+
+        g_printf("\n");
+      }
+    }
+
+    if (pc->feed_file) {
+      unlink(pc->feed_file);
+      g_free(pc->feed_file);
+    }
+
+    g_free(pc->title);
+    channel_free(pc->channel);
+  }
+
+  if (!quiet) {
+    size = g_format_size(total_bytes);
+    g_printf("Total: %s", size);
+    g_free(size);
+
+    if (total_unknown)
+      g_printf(" and %d enclosures of unknown size", total_unknown);
+
+    g_printf("\n");
+  }
+
+  if (plan_write(p, plan_file, debug))
+    ret = -1;
+
+  plan_free(p);
+  g_array_free(channels, TRUE);
+
+  return ret;
+}
+
+/* Downloads the enclosures listed in a plan file. */
+static int _execute_plan(const gchar *channel_directory, struct configuration *cfg,
+                         const gchar *plan_file)
+{
+  plan *p;
+  plan_channel *pc;
+  channel *c;
+  channel_info info = { NULL, NULL, NULL, NULL };
+  struct channel_configuration *channel_configuration;
+  int i, ret = 0;
+
+  p = plan_read(plan_file);
+
+  if (!p)
+    return -1;
+
+  for (i = 0; i < p->channels->len; i++) {
+    pc = g_ptr_array_index(p->channels, i);
+
+    if (!pc->enclosures->len)
+      continue;
+
+    c = _open_channel(channel_directory, cfg, pc->identifier, &channel_configuration);
+
+    if (!c) {
+      ret = -1;
+      continue;
+    }
+
+    if (!quiet)
+      g_printf("Executing plan for channel %s...\n", pc->identifier);
+
+    info.title = pc->title ? pc->title : pc->identifier;
+
+    channel_download(c, channel_configuration, update_callback, &info, pc->enclosures,
+                     resume, debug, progress);
+    channel_commit(c, debug);
+    channel_free(c);
+
+    if (commit_policy == CHANNEL_COMMIT_CHANNEL)
+      _commit_playlists();
   }
 
-  return kf;
+  plan_free(p);
+
+  return ret;
 }
 
-static void _configuration_file_close(GKeyFile *kf)
+struct scheduled_channel {
+  struct channel_configuration *configuration;
+  channel *channel;
+  enclosure_filter *filter;
+  rss_file *feed;
+  long priority;
+  gboolean failed;
+};
+
+struct scheduled_enclosure {
+  int channel;
+  int position;
+  enclosure *enclosure;
+};
+
+/* Orders enclosures by the scheduling policies in turn. Enclosures of
+   unknown date or size come after the others. Remaining ties keep the
+   order of the configuration file and the feeds. */
+static gint _compare_scheduled(gconstpointer a, gconstpointer b, gpointer user_data)
 {
-  g_key_file_free(kf);
+  const struct scheduled_enclosure *x = a, *y = b;
+  GArray *channels = user_data;
+  long px, py;
+  time_t dx, dy;
+  long lx, ly;
+  int i;
+
+  for (i = 0; i < schedule_policies->len; i++) {
+    switch (g_array_index(schedule_policies, enum schedule_policy, i)) {
+    case SCHEDULE_PRIORITY:
+      px = g_array_index(channels, struct scheduled_channel, x->channel).priority;
+      py = g_array_index(channels, struct scheduled_channel, y->channel).priority;
+
+      if (px != py)
+        return px > py ? -1 : 1;
+      break;
+
+    case SCHEDULE_NEWEST:
+      dx = x->enclosure->pub_date;
+      dy = y->enclosure->pub_date;
+
+      if (dx != dy) {
+        if (dx < 0 || dy < 0)
+          return dx < 0 ? 1 : -1;
+
+        return dx > dy ? -1 : 1;
+      }
+      break;
+
+    case SCHEDULE_SHORTEST:
+      lx = x->enclosure->length;
+      ly = y->enclosure->length;
+
+      if (lx != ly) {
+        if (lx <= 0 || ly <= 0)
+          return lx <= 0 ? 1 : -1;
+
+        return lx < ly ? -1 : 1;
+      }
+      break;
+    }
+  }
+
+  if (x->channel != y->channel)
+    return x->channel < y->channel ? -1 : 1;
+
+  return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+/* Downloads new enclosures from all channels in the order given by the
+   scheduling policies instead of one channel at a time. All feeds are
+   fetched first. As with an ordinary update, nothing more is downloaded
+   from a channel once a download from it has failed. */
+static int _schedule_channels(const gchar *channel_directory, struct configuration *cfg,
+                              GPtrArray *identifiers, enclosure_filter *filter)
+{
+  GArray *channels, *queue;
+  GPtrArray *new_enclosures, *single;
+  struct scheduled_channel *sc;
+  struct scheduled_enclosure *se;
+  int i, j, ret = 0;
+
+  channels = g_array_new(FALSE, TRUE, sizeof(struct scheduled_channel));
+
+  for (i = 0; i < identifiers->len; i++) {
+    struct scheduled_channel scheduled = { NULL, NULL, NULL, NULL, 0, FALSE };
+    const gchar *identifier = g_ptr_array_index(identifiers, i);
+
+    scheduled.channel = _open_channel(channel_directory, cfg, identifier,
+                                      &scheduled.configuration);
+
+    if (!scheduled.channel) {
+      ret = -1;
+      continue;
+    }
+
+    if (_parse_count(scheduled.configuration->priority, "priority", identifier,
+                     &scheduled.priority)) {
+      channel_free(scheduled.channel);
+      ret = -1;
+      continue;
+    }
+
+    if (!filter && scheduled.configuration->regex_filter) {
+      scheduled.filter = enclosure_filter_new(scheduled.configuration->regex_filter, FALSE);
+
+      if (!scheduled.filter) {
+        channel_free(scheduled.channel);
+        ret = -1;
+        continue;
+      }
+    }
+
+    g_array_append_val(channels, scheduled);
+  }
+
+  /* Fetch the feeds and collect the enclosures to download. */
+  queue = g_array_new(FALSE, FALSE, sizeof(struct scheduled_enclosure));
+
+  for (i = 0; i < channels->len; i++) {
+    sc = &g_array_index(channels, struct scheduled_channel, i);
+    sc->feed = channel_fetch(sc->channel, sc->configuration, update_callback, debug);
+
+    if (!sc->feed)
+      continue;
+
+    new_enclosures = channel_new_enclosures(sc->channel, sc->feed, first_only,
+                                            filter ? filter : sc->filter);
+
+    for (j = 0; j < new_enclosures->len; j++) {
+      struct scheduled_enclosure scheduled = { i, j, g_ptr_array_index(new_enclosures, j) };
+
+      g_array_append_val(queue, scheduled);
+    }
+
+    g_ptr_array_free(new_enclosures, TRUE);
+  }
+
+  g_array_sort_with_data(queue, _compare_scheduled, channels);
+
+  /* Download the enclosures in order. */
+  single = g_ptr_array_sized_new(1);
+
+  for (i = 0; i < queue->len; i++) {
+    se = &g_array_index(queue, struct scheduled_enclosure, i);
+    sc = &g_array_index(channels, struct scheduled_channel, se->channel);
+
+    if (sc->failed)
+      continue;
+
+    g_ptr_array_set_size(single, 0);
+    g_ptr_array_add(single, se->enclosure);
+
+    if (channel_download(sc->channel, sc->configuration, update_callback,
+                         &sc->feed->channel_info, single, resume, debug, progress))
+      sc->failed = TRUE;
+  }
+
+  g_ptr_array_free(single, TRUE);
+  g_array_free(queue, TRUE);
+
+  /* Clean-up. */
+  for (i = 0; i < channels->len; i++) {
+    sc = &g_array_index(channels, struct scheduled_channel, i);
+
+    if (sc->feed) {
+      channel_finish_update(sc->channel, sc->feed, debug);
+      rss_close(sc->feed);
+
+      if (commit_policy == CHANNEL_COMMIT_CHANNEL)
+        _commit_playlists();
+    }
+
+    if (sc->filter)
+      enclosure_filter_free(sc->filter);
+
+    channel_free(sc->channel);
+  }
+
+  g_array_free(channels, TRUE);
+
+  return ret;
+}
+
+/* Removes channel files belonging to channels that are no longer present
+   in the configuration file. */
+static int _compact_channel_directory(const gchar *channel_directory,
+                                      struct configuration *cfg)
+{
+  GDir *dir;
+  GError *error = NULL;
+  const gchar *name;
+  gchar *identifier, *channel_file;
+  int ret = 0;
+
+  dir = g_dir_open(channel_directory, 0, &error);
+
+  if (!dir) {
+    fprintf(stderr, "Error reading channel directory %s: %s.\n", channel_directory,
+            error->message);
+    g_error_free(error);
+    return -1;
+  }
+
+  while ((name = g_dir_read_name(dir))) {
+    if (!g_str_has_suffix(name, ".xml"))
+      continue;
+
+    identifier = g_strndup(name, strlen(name) - strlen(".xml"));
+
+    if (!configuration_lookup(cfg, identifier) &&
+        !configuration_is_invalid(cfg, identifier)) {
+      channel_file = g_build_filename(channel_directory, name, NULL);
+
+      if (g_unlink(channel_file) < 0) {
+        fprintf(stderr, "Error removing channel file %s: %s.\n", channel_file,
+                strerror(errno));
+        ret = -1;
+      } else if (!quiet)
+        g_printf("Removed channel file for channel %s.\n", identifier);
+
+      g_free(channel_file);
+    }
+
+    g_free(identifier);
+  }
+
+  g_dir_close(dir);
+
+  return ret;
 }
 
 #ifdef ENABLE_ID3LIB
@@ -614,21 +1817,3 @@ static int _id3_check_and_set(const gchar *filename,
 }
 
 #endif /* ENABLE_ID3LIB */
-
-static int playlist_add(const gchar *playlist_file,
-                        const gchar *media_file)
-{
-  FILE *f;
-
-  f = fopen(playlist_file, "a");
-
-  if (!f) {
-    fprintf(stderr, "Error opening playlist file %s: %s.\n",
-            playlist_file, strerror(errno));
-    return -1;
-  }
-
-  fprintf(f, "%s\n", media_file);
-  fclose(f);
-  return 0;
-}
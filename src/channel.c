@@ -21,46 +21,265 @@
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <glib.h>
 #include <glib/gprintf.h>
-#include "libxmlutil.h"
+#include <glib/gstdio.h>
+#include <libxml/xmlreader.h>
 #include "urlget.h"
 #include "channel.h"
 #include "rss.h"
 #include "utils.h"
 #include "progress.h"
+#include "id3v2.h"
+#include "stats.h"
+#include "diskwriter.h"
 
 static int _enclosure_pattern_match(enclosure_filter *filter,
                                     const enclosure *enclosure);
 
-static void _enclosure_iterator(const void *user_data, int i, const xmlNode *node)
+static enclosure_state *_enclosure_state_new(gchar *downloadtime)
 {
-  const char *downloadtime;
+  enclosure_state *s = g_malloc(sizeof(struct _enclosure_state));
 
-  channel *c = (channel *)user_data;
+  s->downloadtime = downloadtime;
+  s->missing = 0;
+  s->file = NULL;
+  s->size = 0;
+  s->evicted = FALSE;
+  s->spool_link = NULL;
 
-  downloadtime = libxmlutil_attr_as_string(node, "downloadtime");
+  return s;
+}
 
-  if (downloadtime)
-    downloadtime = g_strdup(downloadtime);
-  else
+static partial_download *_partial_download_new(void)
+{
+  partial_download *p = g_malloc(sizeof(struct _partial_download));
+
+  p->file = NULL;
+  p->etag = NULL;
+  p->last_modified = NULL;
+  p->offset = 0;
+
+  return p;
+}
+
+static void _partial_download_free(gpointer data)
+{
+  partial_download *p = (partial_download *)data;
+
+  g_free(p->file);
+  g_free(p->etag);
+  g_free(p->last_modified);
+  g_free(p);
+}
+
+static void _enclosure_state_free(gpointer data)
+{
+  enclosure_state *s = (enclosure_state *)data;
+
+  g_free(s->downloadtime);
+  g_free(s->file);
+  g_free(s);
+}
+
+/* The enclosures in the spool, that is the downloaded enclosures with a
+   known file that have not been evicted, are kept in a queue ordered by
+   download time, oldest first, along with their total size and number.
+   The queue is built from the channel file when it is loaded and kept up
+   to date as enclosures are downloaded, evicted and expired, so the spool
+   directory itself is never scanned. */
+
+static void _spool_add(channel *c, enclosure_state *s)
+{
+  g_queue_push_tail(c->spool, s);
+  s->spool_link = g_queue_peek_tail_link(c->spool);
+  c->spool_bytes += s->size;
+  c->spool_episodes++;
+}
+
+static void _spool_remove(channel *c, enclosure_state *s)
+{
+  if (!s->spool_link)
+    return;
+
+  g_queue_delete_link(c->spool, s->spool_link);
+  s->spool_link = NULL;
+  c->spool_bytes -= s->size;
+  c->spool_episodes--;
+}
+
+struct spool_entry {
+  time_t downloadtime;
+  enclosure_state *state;
+};
+
+static gint _compare_spool_entries(gconstpointer a, gconstpointer b)
+{
+  const struct spool_entry *x = a, *y = b;
+
+  return x->downloadtime < y->downloadtime ? -1 : x->downloadtime > y->downloadtime;
+}
+
+static void _spool_build(channel *c)
+{
+  GHashTableIter iter;
+  gpointer value;
+  GArray *entries;
+  struct spool_entry entry;
+  enclosure_state *s;
+  guint i;
+
+  entries = g_array_new(FALSE, FALSE, sizeof(struct spool_entry));
+  g_hash_table_iter_init(&iter, c->downloaded_enclosures);
+
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    s = (enclosure_state *)value;
+
+    if (!s->file || s->evicted)
+      continue;
+
+    entry.downloadtime = s->downloadtime ? parse_rfc822_time(s->downloadtime) : 0;
+    entry.state = s;
+    g_array_append_val(entries, entry);
+  }
+
+  g_array_sort(entries, _compare_spool_entries);
+
+  for (i = 0; i < entries->len; i++)
+    _spool_add(c, g_array_index(entries, struct spool_entry, i).state);
+
+  g_array_free(entries, TRUE);
+}
+
+/* Returns a copy of an attribute of the current node, or NULL if the
+   attribute is not set. */
+static gchar *_reader_dup_attr(xmlTextReaderPtr reader, const char *name)
+{
+  xmlChar *s;
+  gchar *value;
+
+  s = xmlTextReaderGetAttribute(reader, (const xmlChar *)name);
+
+  if (!s)
+    return NULL;
+
+  value = g_strdup((const gchar *)s);
+  xmlFree(s);
+
+  return value;
+}
+
+static void _load_enclosure(channel *c, xmlTextReaderPtr reader)
+{
+  gchar *url, *downloadtime, *missing, *size, *evicted;
+  enclosure_state *s;
+
+  url = _reader_dup_attr(reader, "url");
+
+  if (!url)
+    return;
+
+  downloadtime = _reader_dup_attr(reader, "downloadtime");
+
+  if (!downloadtime)
     downloadtime = get_rfc822_time();
 
-  g_hash_table_insert(c->downloaded_enclosures,
-                      (gpointer)libxmlutil_attr_as_string(node, "url"),
-                      (gpointer)downloadtime);
+  s = _enclosure_state_new(downloadtime);
+
+  missing = _reader_dup_attr(reader, "missing");
+
+  if (missing) {
+    s->missing = MAX(0, atoi(missing));
+    g_free(missing);
+  }
+
+  s->file = _reader_dup_attr(reader, "file");
+  size = _reader_dup_attr(reader, "size");
+
+  if (size) {
+    s->size = MAX(0, g_ascii_strtoll(size, NULL, 10));
+    g_free(size);
+  }
+
+  evicted = _reader_dup_attr(reader, "evicted");
+
+  if (evicted) {
+    s->evicted = atoi(evicted) != 0;
+    g_free(evicted);
+  }
+
+  g_hash_table_replace(c->downloaded_enclosures, url, s);
+}
+
+static void _load_partial(channel *c, xmlTextReaderPtr reader)
+{
+  gchar *url, *offset;
+  partial_download *p;
+
+  url = _reader_dup_attr(reader, "url");
+
+  if (!url)
+    return;
+
+  p = _partial_download_new();
+  p->file = _reader_dup_attr(reader, "file");
+  p->etag = _reader_dup_attr(reader, "etag");
+  p->last_modified = _reader_dup_attr(reader, "lastmodified");
+  offset = _reader_dup_attr(reader, "offset");
+
+  if (offset) {
+    p->offset = MAX(0, g_ascii_strtoll(offset, NULL, 10));
+    g_free(offset);
+  }
+
+  g_hash_table_replace(c->partials, url, p);
+}
+
+/* Reads the channel file in a single streaming pass, inserting
+   enclosures directly into the set of downloaded enclosures. */
+static int _load_channel_file(channel *c)
+{
+  xmlTextReaderPtr reader;
+  const xmlChar *name;
+  int ret;
+
+  reader = xmlReaderForFile(c->channel_filename, NULL, 0);
+
+  if (!reader)
+    return -1;
+
+  while ((ret = xmlTextReaderRead(reader)) == 1) {
+    if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+      continue;
+
+    name = xmlTextReaderConstName(reader);
+
+    if (xmlTextReaderDepth(reader) == 0) {
+      /* Fetch channel attributes. */
+      c->rss_last_fetched = _reader_dup_attr(reader, "rsslastfetched");
+    } else if (xmlTextReaderDepth(reader) == 1 &&
+               xmlStrEqual(name, (const xmlChar *)"enclosure"))
+      _load_enclosure(c, reader);
+    else if (xmlTextReaderDepth(reader) == 1 &&
+             xmlStrEqual(name, (const xmlChar *)"partial"))
+      _load_partial(c, reader);
+  }
+
+  xmlFreeTextReader(reader);
+
+  return ret;
 }
 
 channel *channel_new(const char *url, const char *channel_file,
                      const char *spool_directory, int resume)
 {
   channel *c;
-  xmlDocPtr doc;
-  xmlNode *root_element = NULL;
-  const char *s;
 
   c = (channel *)malloc(sizeof(struct _channel));
   c->url = g_strdup(url);
@@ -68,53 +287,97 @@ channel *channel_new(const char *url, const char *channel_file,
   c->spool_directory = g_strdup(spool_directory);
   //  c->resume = resume;
   c->rss_last_fetched = NULL;
-  c->downloaded_enclosures = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+  c->expire_age = 0;
+  c->expire_missing = 0;
+  c->commit_policy = CHANNEL_COMMIT_ITEM;
+  c->commit_group = NULL;
+  c->id3_tag = NULL;
+  c->stats = NULL;
+  c->reserve = 0;
+  c->max_spool_bytes = 0;
+  c->max_spool_episodes = 0;
+  c->spool_bytes = 0;
+  c->spool_episodes = 0;
+  c->spool = g_queue_new();
+  c->downloaded_enclosures = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                   _enclosure_state_free);
+  c->partials = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      _partial_download_free);
+  c->selection = NULL;
+  c->layout = SPOOL_LAYOUT_FLAT;
 
   if (g_file_test(c->channel_filename, G_FILE_TEST_EXISTS)) {
-    doc = xmlReadFile(c->channel_filename, NULL, 0);
-
-    if (!doc) {
+    if (_load_channel_file(c)) {
       g_fprintf(stderr, "Error parsing channel file %s.\n", c->channel_filename);
+      channel_free(c);
       return NULL;
     }
+  }
 
-    root_element = xmlDocGetRootElement(doc);
+  _spool_build(c);
 
-    if (!root_element)  {
-      xmlFreeDoc(doc);
+  return c;
+}
 
-      g_fprintf(stderr, "Error parsing channel file %s.\n", c->channel_filename);
-      return NULL;
-    }
+static void _cast_channel_save_downloaded_enclosure(gpointer key, gpointer value,
+                                                    gpointer user_data)
+{
+  FILE *f = (FILE *)user_data;
+  enclosure_state *s = (enclosure_state *)value;
+  gchar *escaped_key = g_markup_escape_text(key, -1);
+  gchar *escaped_file;
 
-    /* Fetch channel attributes. */
-    s = libxmlutil_attr_as_string(root_element, "rsslastfetched");
+  g_fprintf(f, "  <enclosure url=\"%s\"", escaped_key);
 
-    if (s)
-      c->rss_last_fetched = g_strdup(s);
+  if (s->downloadtime)
+    g_fprintf(f, " downloadtime=\"%s\"", s->downloadtime);
 
-    /* Iterate encolsure elements. */
-    libxmlutil_iterate_by_tag_name(root_element, "enclosure", c, _enclosure_iterator);
+  if (s->missing)
+    g_fprintf(f, " missing=\"%d\"", s->missing);
 
-    xmlFreeDoc(doc);
+  if (s->file) {
+    escaped_file = g_markup_escape_text(s->file, -1);
+    g_fprintf(f, " file=\"%s\" size=\"%" G_GINT64_FORMAT "\"", escaped_file, s->size);
+    g_free(escaped_file);
   }
 
-  return c;
+  if (s->evicted)
+    g_fprintf(f, " evicted=\"1\"");
+
+  g_fprintf(f, "/>\n");
+
+  g_free(escaped_key);
 }
 
-static void _cast_channel_save_downloaded_enclosure(gpointer key, gpointer value,
-                                                    gpointer user_data)
+static void _cast_channel_save_partial(gpointer key, gpointer value, gpointer user_data)
 {
   FILE *f = (FILE *)user_data;
-  gchar *escaped_key = g_markup_escape_text(key, -1);
+  partial_download *p = (partial_download *)value;
+  gchar *escaped;
 
-  if (value)
-    g_fprintf(f, "  <enclosure url=\"%s\" downloadtime=\"%s\"/>\n",
-              escaped_key, (gchar *)value);
-  else
-    g_fprintf(f, "  <enclosure url=\"%s\"/>\n", escaped_key);
+  escaped = g_markup_escape_text(key, -1);
+  g_fprintf(f, "  <partial url=\"%s\" offset=\"%" G_GINT64_FORMAT "\"", escaped, p->offset);
+  g_free(escaped);
 
-  g_free(escaped_key);
+  if (p->file) {
+    escaped = g_markup_escape_text(p->file, -1);
+    g_fprintf(f, " file=\"%s\"", escaped);
+    g_free(escaped);
+  }
+
+  if (p->etag) {
+    escaped = g_markup_escape_text(p->etag, -1);
+    g_fprintf(f, " etag=\"%s\"", escaped);
+    g_free(escaped);
+  }
+
+  if (p->last_modified) {
+    escaped = g_markup_escape_text(p->last_modified, -1);
+    g_fprintf(f, " lastmodified=\"%s\"", escaped);
+    g_free(escaped);
+  }
+
+  g_fprintf(f, "/>\n");
 }
 
 static int _cast_channel_save_channel(FILE *f, gpointer user_data, int debug)
@@ -129,253 +392,1490 @@ static int _cast_channel_save_channel(FILE *f, gpointer user_data, int debug)
     g_fprintf(f, "<channel version=\"1.0\">\n");
 
   g_hash_table_foreach(c->downloaded_enclosures, _cast_channel_save_downloaded_enclosure, f);
+  g_hash_table_foreach(c->partials, _cast_channel_save_partial, f);
 
   g_fprintf(f, "</channel>\n");
 
   return 0;
 }
 
+/* Returns TRUE if a downloaded enclosure should be forgotten. Only
+   enclosures that have disappeared from the feed are ever expired, since
+   forgetting an enclosure that is still in the feed would cause it to be
+   downloaded again. */
+static gboolean _enclosure_expired(gpointer key, gpointer value, gpointer user_data)
+{
+  channel *c = (channel *)user_data;
+  enclosure_state *s = (enclosure_state *)value;
+  time_t downloadtime;
+
+  gboolean expired = FALSE;
+
+  if (!s->missing)
+    return FALSE;
+
+  if (c->expire_missing > 0 && s->missing >= c->expire_missing)
+    expired = TRUE;
+  else if (c->expire_age > 0 && s->downloadtime) {
+    downloadtime = parse_rfc822_time(s->downloadtime);
+
+    if (downloadtime != (time_t)-1 && time(NULL) - downloadtime >= c->expire_age)
+      expired = TRUE;
+  }
+
+  /* The file of an expired enclosure is left alone. With a quota, it is
+     remembered until the quota evicts it, so that it keeps counting
+     towards the quota. */
+  if (expired && s->spool_link && (c->max_spool_bytes > 0 || c->max_spool_episodes > 0))
+    return FALSE;
+
+  if (expired)
+    _spool_remove(c, s);
+
+  return expired;
+}
+
 static void _cast_channel_save(channel *c, int debug)
 {
-  write_by_temporary_file(c->channel_filename, _cast_channel_save_channel, c, NULL, debug);
+  gint64 start = stats_now();
+
+  if (c->expire_age > 0 || c->expire_missing > 0)
+    g_hash_table_foreach_remove(c->downloaded_enclosures, _enclosure_expired, c);
+
+  if (c->commit_policy == CHANNEL_COMMIT_RUN)
+    commit_group_write(c->commit_group, c->channel_filename, _cast_channel_save_channel,
+                       c, debug);
+  else
+    write_by_temporary_file(c->channel_filename, _cast_channel_save_channel, c, NULL, debug);
+
+  stats_record(c->stats, STATS_SAVE, start);
 }
 
-void channel_free(channel *c)
+/* Returns an estimate of the memory held by the set of downloaded
+   enclosures, including the hash table's own arrays. */
+static gsize _downloaded_enclosures_size(channel *c)
 {
-  g_hash_table_destroy(c->downloaded_enclosures);
-  g_free(c->spool_directory);
-  g_free(c->channel_filename);
-  g_free(c->url);
-  free(c);
+  GHashTableIter iter;
+  gpointer key, value;
+  enclosure_state *s;
+  gsize n = 0;
+
+  g_hash_table_iter_init(&iter, c->downloaded_enclosures);
+
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    s = (enclosure_state *)value;
+
+    n += strlen((gchar *)key) + 1 + sizeof(enclosure_state) +
+      (s->downloadtime ? strlen(s->downloadtime) + 1 : 0) +
+      (s->file ? strlen(s->file) + 1 : 0) +
+      (s->spool_link ? sizeof(GList) : 0) +
+      2 * sizeof(gpointer) + sizeof(guint);
+  }
+
+  return n;
 }
 
-static size_t _enclosure_urlget_cb(void *buffer, size_t size, size_t nmemb, void *user_data)
+/* Updates the count of fetches that each downloaded enclosure has been
+   missing from the feed. */
+static void _update_missing_counts(channel *c, rss_file *f)
 {
-  FILE *f = (FILE *)user_data;
+  GHashTable *present;
+  GHashTableIter iter;
+  gpointer key, value;
+  enclosure_state *s;
+  int i;
+
+  present = g_hash_table_new(g_str_hash, g_str_equal);
 
-  return fwrite(buffer, size, nmemb, f);
+  for (i = 0; i < f->num_items; i++)
+    if (f->items[i]->enclosure && f->items[i]->enclosure->url)
+      g_hash_table_insert(present, f->items[i]->enclosure->url, NULL);
+
+  /* Leave the counts alone if the feed came back empty, since that is far
+     more likely to be a transient problem with the feed than a sign that
+     everything in it has been removed. */
+  if (g_hash_table_size(present) > 0) {
+    g_hash_table_iter_init(&iter, c->downloaded_enclosures);
+
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      s = (enclosure_state *)value;
+
+      if (g_hash_table_lookup_extended(present, key, NULL, NULL))
+        s->missing = 0;
+      else
+        s->missing++;
+    }
+  }
+
+  g_hash_table_destroy(present);
 }
 
-static rss_file *_get_rss(channel *c, void *user_data, channel_callback cb, int debug)
+void channel_set_expiry(channel *c, long max_age, int max_missing)
 {
-  rss_file *f;
+  c->expire_age = max_age;
+  c->expire_missing = max_missing;
+}
 
-  if (cb)
-    cb(user_data, CCA_RSS_DOWNLOAD_START, NULL, NULL, NULL);
+/* Sets an ID3v2 tag to write at the start of MP3 enclosures in place of
+   any tag they come with. */
+void channel_set_id3_tag(channel *c, GByteArray *tag)
+{
+  if (c->id3_tag)
+    g_byte_array_unref(c->id3_tag);
 
-  if (!strncmp("http://", c->url, strlen("http://")))
-    f = rss_open_url(c->url, debug);
-  else
-    f = rss_open_file(c->url);
+  c->id3_tag = tag ? g_byte_array_ref(tag) : NULL;
+}
 
-  if (cb)
-    cb(user_data, CCA_RSS_DOWNLOAD_END, &(f->channel_info), NULL, NULL);
+/* Sets the record that the time spent in each phase of an update is
+   added to. */
+void channel_set_stats(channel *c, struct _stats_channel *stats)
+{
+  c->stats = stats;
+}
 
-  return f;
+/* Sets the amount of space to leave free on the file system of the spool
+   directory. Downloads that would eat into it are deferred. */
+void channel_set_reserve(channel *c, gint64 reserve)
+{
+  c->reserve = reserve;
 }
 
-static int _do_download(channel *c, channel_info *channel_info, rss_item *item,
-                        void *user_data, channel_callback cb, int resume,
-                        int debug, int show_progress_bar)
+/* Limits the total size and number of enclosures in the spool. Zero
+   means no limit. When a limit is exceeded, the enclosures downloaded
+   first are deleted. */
+void channel_set_quota(channel *c, gint64 max_bytes, long max_episodes)
 {
-  int download_failed;
-  long resume_from = 0;
-  gchar *enclosure_full_filename;
-  FILE *enclosure_file;
-  struct stat fileinfo;
-  progress_bar *pb;
+  c->max_spool_bytes = max_bytes;
+  c->max_spool_episodes = max_episodes;
+}
 
-  /* Check that the spool directory exists. */
-  if (!g_file_test(c->spool_directory, G_FILE_TEST_IS_DIR)) {
-    g_fprintf(stderr, "Spool directory %s not found.\n", c->spool_directory);
-    return 1;
+void channel_set_layout(channel *c, spool_layout layout)
+{
+  c->layout = layout;
+}
+
+/* Returns the path of a file in the spool directory. With the date
+   layout, the file is placed by the given time. */
+static gchar *_spool_path(channel *c, const gchar *filename, time_t t)
+{
+  gchar *checksum, *shard, *path;
+  gchar year[8], month[4];
+  struct tm tm;
+
+  switch (c->layout) {
+  case SPOOL_LAYOUT_HASH:
+    checksum = g_compute_checksum_for_string(G_CHECKSUM_MD5, filename, -1);
+    shard = g_strndup(checksum, 2);
+    path = g_build_filename(c->spool_directory, shard, filename, NULL);
+    g_free(shard);
+    g_free(checksum);
+    return path;
+
+  case SPOOL_LAYOUT_DATE:
+    localtime_r(&t, &tm);
+    g_snprintf(year, sizeof(year), "%04d", tm.tm_year + 1900);
+    g_snprintf(month, sizeof(month), "%02d", tm.tm_mon + 1);
+    return g_build_filename(c->spool_directory, year, month, filename, NULL);
+
+  case SPOOL_LAYOUT_FLAT:
+  default:
+    return g_build_filename(c->spool_directory, filename, NULL);
   }
+}
 
-  /* Build enclosure file name and open file. */
-  enclosure_full_filename = g_build_filename(c->spool_directory, item->enclosure->filename, NULL);
+/* Creates the directory that a file in the spool directory goes in. */
+static int _make_spool_subdirectory(const gchar *path)
+{
+  gchar *directory;
+  int ret = 0;
 
-  if (resume) {
-    /* We're told to continue from where we are now. Get the
-     * size of the file as it is now and open it for append instead.
-     * Stolen from curl. */
+  directory = g_path_get_dirname(path);
 
-    if (0 == stat(enclosure_full_filename, &fileinfo))
-      /* Set offset to current file size. */
-      resume_from = fileinfo.st_size;
-    else
-      /* Let offset be 0. */
-      resume_from = 0;
+  if (g_mkdir_with_parents(directory, 0755)) {
+    g_fprintf(stderr, "Error creating directory %s: %s.\n", directory, g_strerror(errno));
+    ret = -1;
   }
 
-  enclosure_file = fopen(enclosure_full_filename, resume_from ? "ab" : "wb");
+  g_free(directory);
 
-  if (!enclosure_file) {
-    g_fprintf(stderr, "Error opening enclosure file %s.\n", enclosure_full_filename);
-    g_free(enclosure_full_filename);
-    return 1;
+  return ret;
+}
+
+/* Sets the rules for choosing between renditions of the media of an
+   item. Without any rules, the first rendition is chosen. */
+void channel_set_selection(channel *c, long max_bitrate, gint64 max_file_size,
+                           gchar **mime_types)
+{
+  if (c->selection) {
+    g_strfreev(c->selection->mime_types);
+    g_free(c->selection);
+    c->selection = NULL;
   }
 
-  if (cb)
-    cb(user_data, CCA_ENCLOSURE_DOWNLOAD_START, channel_info, item->enclosure, enclosure_full_filename);
+  if (max_bitrate <= 0 && max_file_size <= 0 && !mime_types)
+    return;
 
-  if (show_progress_bar)
-    pb = progress_bar_new(resume_from);
-  else
-    pb = NULL;
+  c->selection = g_malloc(sizeof(media_selection));
+  c->selection->max_bitrate = max_bitrate;
+  c->selection->max_file_size = max_file_size;
+  c->selection->mime_types = g_strdupv(mime_types);
+}
 
-  if (urlget_buffer(item->enclosure->url, enclosure_file, _enclosure_urlget_cb, resume_from, debug, pb)) {
-    g_fprintf(stderr, "Error downloading enclosure from %s.\n", item->enclosure->url);
+static gboolean _over_quota(channel *c)
+{
+  return (c->max_spool_bytes > 0 && c->spool_bytes > c->max_spool_bytes) ||
+    (c->max_spool_episodes > 0 && c->spool_episodes > c->max_spool_episodes);
+}
 
-    download_failed = 1;
-  } else
-    download_failed = 0;
+/* Evicts the oldest enclosures until the spool is within its quota. The
+   most recent enclosure is always kept, even if it alone exceeds the
+   quota. */
+static void _enforce_quota(channel *c)
+{
+  enclosure_state *s;
 
-  if (pb)
-    progress_bar_free(pb);
+  while (c->spool_episodes > 1 && _over_quota(c)) {
+    s = (enclosure_state *)g_queue_peek_head(c->spool);
 
-  fclose(enclosure_file);
+    if (unlink(s->file) < 0 && errno != ENOENT)
+      g_fprintf(stderr, "Error deleting evicted enclosure %s: %s.\n", s->file,
+                strerror(errno));
 
-  if (cb)
-    cb(user_data, CCA_ENCLOSURE_DOWNLOAD_END, channel_info, item->enclosure, enclosure_full_filename);
+    _spool_remove(c, s);
+    s->evicted = TRUE;
+    stats_count(c->stats, STATS_ENCLOSURES_EVICTED);
+  }
+}
 
-  g_free(enclosure_full_filename);
+/* Sets the point at which changes to the channel file are committed to
+   disk. With CHANNEL_COMMIT_ITEM the file is written after every
+   enclosure, with CHANNEL_COMMIT_CHANNEL once per update, and with
+   CHANNEL_COMMIT_RUN it is added to a commit group that the caller
+   commits later. */
+void channel_set_commit_policy(channel *c, channel_commit_policy policy,
+                               commit_group *group)
+{
+  g_assert(policy != CHANNEL_COMMIT_RUN || group);
 
-  return download_failed;
+  c->commit_policy = policy;
+  c->commit_group = group;
 }
 
-static int _do_catchup(channel *c, channel_info *channel_info, rss_item *item,
-                       void *user_data, channel_callback cb)
+void channel_free(channel *c)
 {
-  if (cb) {
-    cb(user_data, CCA_ENCLOSURE_DOWNLOAD_START, channel_info, item->enclosure, NULL);
-
-    cb(user_data, CCA_ENCLOSURE_DOWNLOAD_END, channel_info, item->enclosure, NULL);
+  if (c->selection) {
+    g_strfreev(c->selection->mime_types);
+    g_free(c->selection);
   }
 
-  return 0;
+  g_queue_free(c->spool);
+  g_hash_table_destroy(c->partials);
+  g_hash_table_destroy(c->downloaded_enclosures);
+
+  if (c->id3_tag)
+    g_byte_array_unref(c->id3_tag);
+
+  g_free(c->rss_last_fetched);
+  g_free(c->spool_directory);
+  g_free(c->channel_filename);
+  g_free(c->url);
+  free(c);
 }
 
-int channel_update(channel *c, void *user_data, channel_callback cb,
-                   int no_download, int no_mark_read, int first_only,
-                   int resume, enclosure_filter *filter, int debug,
-                   int show_progress_bar)
+/* Writes a downloaded enclosure to disk. If an ID3v2 tag is injected
+   into the file, any ID3v2 tag at the start of the downloaded data is
+   dropped. When a download is resumed, the data already held is
+   discarded if the server sends the whole enclosure instead of the
+   rest of it. */
+typedef struct _enclosure_writer {
+  FILE *f;
+  int strip_id3v2;
+  guchar header[ID3V2_HEADER_SIZE];
+  gsize header_length;
+  gsize skip;
+  urlget_range *range;
+  gboolean started;
+  void (*start)(struct _enclosure_writer *w);
+  channel *channel;
+  const gchar *url;
+  const gchar *part_filename;
+  int debug;
+  disk_writer *disk;
+} enclosure_writer;
+
+/* Writes data to the enclosure file, through the writer thread of the
+   spool device if there is one. */
+static int _enclosure_write(enclosure_writer *w, const void *data, gsize length)
 {
-  int i, download_failed;
-  rss_file *f;
+  if (w->disk)
+    return disk_writer_write(w->disk, w->f, data, length);
 
-  /* Retrieve the RSS file. */
-  f = _get_rss(c, user_data, cb, debug);
+  return fwrite(data, 1, length, w->f) != length ? -1 : 0;
+}
 
-  if (!f)
-    return 1;
+static size_t _enclosure_urlget_cb(void *buffer, size_t size, size_t nmemb, void *user_data)
+{
+  enclosure_writer *w = (enclosure_writer *)user_data;
+  const guchar *p = (const guchar *)buffer;
+  size_t length = size * nmemb;
+  size_t n;
+  gssize tag_size;
 
-  /* Check enclosures in RSS file. */
-  for (i = 0; i < f->num_items; i++)
-    if (f->items[i]->enclosure) {
-      if (!g_hash_table_lookup_extended(c->downloaded_enclosures, f->items[i]->enclosure->url, NULL, NULL)) {
-        rss_item *item;
-
-        item = f->items[i];
-
-        if (!filter || _enclosure_pattern_match(filter, item->enclosure)) {
-          if (no_download)
-            download_failed = _do_catchup(c, &(f->channel_info), item, user_data, cb);
-          else
-            download_failed = _do_download(c, &(f->channel_info), item, user_data, cb, resume, debug, show_progress_bar);
-
-          if (download_failed)
-            break;
-
-          if (!no_mark_read) {
-            /* Mark enclosure as downloaded and immediately save channel
-               file to ensure that it reflects the change. */
-            g_hash_table_insert(c->downloaded_enclosures, f->items[i]->enclosure->url,
-                                (gpointer)get_rfc822_time());
-
-            _cast_channel_save(c, debug);
-          }
-
-          /* If we have been instructed to deal only with the first
-             available enclosure, it is time to break out of the loop. */
-          if (first_only)
-            break;
-        }
-      }
+  /* Leave the data held alone if the server sends an error page. */
+  if (w->range && w->range->response_code >= 400)
+    return 0;
+
+  if (!w->started) {
+    w->started = TRUE;
+
+    if (w->range && w->range->offset > 0 && w->range->response_code == 200) {
+      if ((w->disk && disk_writer_drain(w->disk)) || fflush(w->f) ||
+          ftruncate(fileno(w->f), 0) || fseeko(w->f, 0, SEEK_SET))
+        return 0;
+
+      w->range->offset = 0;
     }
 
-  if (!no_mark_read) {
-    /* Update the RSS last fetched time and save the channel file again. */
+    if (w->start)
+      w->start(w);
+  }
 
-    if (c->rss_last_fetched)
-      g_free(c->rss_last_fetched);
+  /* Collect enough data to tell if the stream starts with a tag. */
+  if (w->strip_id3v2 && w->header_length < ID3V2_HEADER_SIZE) {
+    n = MIN(length, ID3V2_HEADER_SIZE - w->header_length);
+    memcpy(w->header + w->header_length, p, n);
+    w->header_length += n;
+    p += n;
+    length -= n;
 
-    c->rss_last_fetched = g_strdup(f->fetched_time);
+    if (w->header_length < ID3V2_HEADER_SIZE)
+      return size * nmemb;
 
-    _cast_channel_save(c, debug);
+    tag_size = id3v2_tag_size(w->header);
+
+    if (tag_size < 0) {
+      if (_enclosure_write(w, w->header, ID3V2_HEADER_SIZE))
+        return 0;
+    } else
+      w->skip = tag_size - ID3V2_HEADER_SIZE;
   }
 
-  rss_close(f);
+  if (w->skip) {
+    n = MIN(length, w->skip);
+    p += n;
+    length -= n;
+    w->skip -= n;
+  }
 
-  return 0;
+  if (length && _enclosure_write(w, p, length))
+    return 0;
+
+  return size * nmemb;
 }
 
-/* Match the (file) name of an enclosure against a regexp. Letters
-   in the pattern match both upper and lower case letters if
-   'caseless' is TRUE. Returns TRUE if the pattern matches, FALSE
-   otherwise. */
-static gboolean _enclosure_pattern_match(enclosure_filter *filter,
-                                         const enclosure *enclosure)
+/* Writes out data held back while looking for a tag in a stream too short
+   to hold one. */
+static int _enclosure_writer_finish(enclosure_writer *w)
 {
-#ifdef ENABLE_GREGEX
-  GError *error = NULL;
-  GRegexCompileFlags compile_options = 0;
-  GRegexMatchFlags match_options = 0;
-  GRegex *regex;
-  gboolean match;
+  if (w->strip_id3v2 && w->header_length < ID3V2_HEADER_SIZE)
+    return _enclosure_write(w, w->header, w->header_length);
 
-  g_assert(filter);
-  g_assert(filter->pattern);
-  g_assert(enclosure);
+  return 0;
+}
 
-  if (filter->caseless)
-    compile_options |= G_REGEX_CASELESS;
+/* Invokes the callback, if any, and records the time spent in it. */
+static void _notify(channel *c, void *user_data, channel_callback cb,
+                    channel_action action, channel_info *channel_info,
+                    enclosure *enclosure, const char *filename,
+                    const transfer_info *transfer)
+{
+  gint64 start;
 
-  regex = g_regex_new(filter->pattern, compile_options, match_options,
-                      &error);
+  if (!cb)
+    return;
 
-  if (error) {
-    fprintf(stderr, "Error compiling regular expression %s: %s\n",
-            filter->pattern, error->message);
-    g_error_free(error);
-    return FALSE;
+  start = stats_now();
+  cb(user_data, action, channel_info, enclosure, filename, transfer);
+  stats_record(c->stats, STATS_CALLBACK, start);
+}
+
+static rss_file *_get_rss(channel *c, void *user_data, channel_callback cb, int debug)
+{
+  rss_file *f = NULL;
+  gchar *rss_filename;
+  transfer_info info, *transfer = NULL;
+  gint64 start;
+
+  _notify(c, user_data, cb, CCA_RSS_DOWNLOAD_START, NULL, NULL, NULL, NULL);
+
+  if (!strncmp("http://", c->url, strlen("http://"))) {
+    start = stats_now();
+    rss_filename = rss_fetch_url(c->url, debug, &info);
+    stats_record(c->stats, STATS_FETCH, start);
+    stats_record_transfer(c->stats, c->url, &info);
+    transfer = &info;
+
+    if (rss_filename) {
+      start = stats_now();
+      f = rss_open_file(rss_filename, c->selection);
+      stats_record(c->stats, STATS_PARSE, start);
+
+      unlink(rss_filename);
+      g_free(rss_filename);
+    }
+  } else {
+    start = stats_now();
+    f = rss_open_file(c->url, c->selection);
+    stats_record(c->stats, STATS_PARSE, start);
   }
 
-  match = g_regex_match(regex, enclosure->filename, match_options,
-                        NULL);
+  stats_count(c->stats, f ? STATS_FEEDS_FETCHED : STATS_FEED_FAILURES);
 
-  g_regex_unref(regex);
+  _notify(c, user_data, cb, CCA_RSS_DOWNLOAD_END, f ? &(f->channel_info) : NULL, NULL, NULL,
+          transfer);
 
-  return match;
-#else
-  return FALSE;
-#endif
+  return f;
 }
 
-enclosure_filter *enclosure_filter_new(const gchar *pattern,
-                                       gboolean caseless)
-{
-  enclosure_filter *e = g_malloc(sizeof(struct _enclosure_filter));
+/* Returned by _do_download() when an enclosure is left for a later run. */
+#define DOWNLOAD_DEFERRED 2
 
-  g_assert(pattern);
+/* Bytes fetched from each source of an enclosure to time it. */
+#define MIRROR_PROBE_BYTES (64 * 1024)
 
-  e->pattern = g_strdup(pattern);
-  e->caseless = caseless;
+struct ranked_source {
+  const char *url;
+  int failed;
+  double time;
+};
 
-  return e;
+static gint _compare_sources(gconstpointer a, gconstpointer b)
+{
+  const struct ranked_source *x = a, *y = b;
+
+  if (x->failed != y->failed)
+    return x->failed - y->failed;
+
+  return x->time < y->time ? -1 : (x->time > y->time);
 }
 
-void enclosure_filter_free(enclosure_filter *e)
+/* Returns the URLs an enclosure can be downloaded from, fastest first.
+   Mirrors are timed by fetching the start of the enclosure from all
+   sources at once. Sources that fail come last, in the order of the
+   feed, so that they can still be tried if the others fail. */
+static GPtrArray *_rank_sources(enclosure *enclosure, int debug)
 {
+  GPtrArray *urls;
+  GArray *sources;
+  urlget_request *requests;
+  struct ranked_source source;
+  guint i, n;
+
+  urls = g_ptr_array_new();
+
+  if (!enclosure->mirrors) {
+    g_ptr_array_add(urls, enclosure->url);
+    return urls;
+  }
+
+  n = enclosure->mirrors->len + 1;
+  requests = g_new0(urlget_request, n);
+  requests[0].url = enclosure->url;
+
+  for (i = 1; i < n; i++)
+    requests[i].url = g_ptr_array_index(enclosure->mirrors, i - 1);
+
+  for (i = 0; i < n; i++)
+    requests[i].probe = MIRROR_PROBE_BYTES;
+
+  urlget_batch(requests, n, n, debug);
+
+  sources = g_array_sized_new(FALSE, FALSE, sizeof(struct ranked_source), n);
+
+  for (i = 0; i < n; i++) {
+    source.url = requests[i].url;
+    source.failed = requests[i].failed;
+    source.time = requests[i].info.total_time;
+    g_array_append_val(sources, source);
+  }
+
+  /* The sort is stable, so failed sources keep the order of the feed. */
+  g_array_sort(sources, _compare_sources);
+
+  for (i = 0; i < n; i++)
+    g_ptr_array_add(urls, (gpointer)g_array_index(sources, struct ranked_source, i).url);
+
+  g_array_free(sources, TRUE);
+  g_free(requests);
+
+  return urls;
+}
+
+/* Decides whether an enclosure fits in the spool directory without
+   eating into the reserve. The size is taken from the feed or, if the
+   feed does not give one, asked for from the server, and is stored in
+   the enclosure. If the size cannot be found, only the reserve is
+   checked. */
+static gboolean _admit_download(channel *c, enclosure *enclosure, long resume_from,
+                                int debug)
+{
+  gint64 available, needed = 0;
+  urlget_request request;
+  gchar *needed_string, *available_string;
+
+  available = free_space(c->spool_directory);
+
+  if (available < 0)
+    return TRUE;
+
+  if (available >= c->reserve && enclosure->length <= 0) {
+    memset(&request, 0, sizeof(request));
+    request.url = enclosure->url;
+
+    if (!urlget_batch(&request, 1, 1, debug) && request.length > 0)
+      enclosure->length = (long)request.length;
+  }
+
+  if (enclosure->length > 0)
+    needed = MAX(0, enclosure->length - resume_from);
+
+  if (available >= needed + c->reserve)
+    return TRUE;
+
+  needed_string = g_format_size(needed + c->reserve);
+  available_string = g_format_size(available);
+  g_fprintf(stderr, "Deferring enclosure %s: %s needed in %s but only %s free.\n",
+            enclosure->url, needed_string, c->spool_directory, available_string);
+  g_free(needed_string);
+  g_free(available_string);
+
+  return FALSE;
+}
+
+/* Records the validators of a download so that it can be resumed if it
+   is interrupted. Unless the channel file is committed in batches, it is
+   saved straight away, since the download may be interrupted in a way
+   that leaves no chance to save it later. */
+static void _record_partial(enclosure_writer *w)
+{
+  partial_download *p;
+
+  /* Without validators, the data cannot safely be resumed. */
+  if (!w->range->etag[0] && !w->range->last_modified[0]) {
+    if (!g_hash_table_remove(w->channel->partials, w->url))
+      return;
+  } else {
+    p = _partial_download_new();
+    p->file = g_strdup(w->part_filename);
+    p->etag = w->range->etag[0] ? g_strdup(w->range->etag) : NULL;
+    p->last_modified = w->range->last_modified[0] ? g_strdup(w->range->last_modified) : NULL;
+    p->offset = w->range->offset;
+    g_hash_table_replace(w->channel->partials, g_strdup(w->url), p);
+  }
+
+  if (w->channel->commit_policy == CHANNEL_COMMIT_ITEM)
+    _cast_channel_save(w->channel, w->debug);
+}
+
+/* Returns the path of the data held for an interrupted download. Those
+   recorded without one were kept in the spool directory itself. */
+static gchar *_partial_path(channel *c, partial_download *p, enclosure *enclosure)
+{
+  if (p->file && g_str_has_suffix(p->file, ".part"))
+    return g_strdup(p->file);
+
+  return g_strconcat(c->spool_directory, G_DIR_SEPARATOR_S, enclosure->filename,
+                     ".part", NULL);
+}
+
+/* Forgets an interrupted download and deletes the data held for it. */
+static void _discard_partial(channel *c, enclosure *enclosure)
+{
+  partial_download *p;
+  gchar *path;
+
+  p = g_hash_table_lookup(c->partials, enclosure->url);
+
+  if (!p)
+    return;
+
+  path = _partial_path(c, p, enclosure);
+  unlink(path);
+  g_free(path);
+
+  g_hash_table_remove(c->partials, enclosure->url);
+}
+
+/* Returns the validator to send with If-Range. Weak ETags cannot be used
+   for ranges, so the Last-Modified date is sent instead. */
+static const gchar *_if_range(partial_download *p)
+{
+  if (p->etag && strncmp(p->etag, "W/", 2))
+    return p->etag;
+
+  return p->last_modified;
+}
+
+/* Gets ready to download an enclosure from another source after a
+   failed attempt. The data held is kept if the last response gave a
+   validator to check that the new source has the same version, and is
+   thrown away otherwise, in which case the tag, if any, is written
+   again. */
+static int _prepare_failover(enclosure_writer *w, urlget_range *range, char *validator,
+                             gsize size, GByteArray *tag)
+{
+  if ((w->disk && disk_writer_drain(w->disk)) || fflush(w->f))
+    return -1;
+
+  w->started = FALSE;
+
+  if (!tag && range->response_code != 416 && (range->etag[0] || range->last_modified[0])) {
+    g_strlcpy(validator, range->etag[0] && strncmp(range->etag, "W/", 2) ?
+              range->etag : range->last_modified, size);
+    range->if_range = validator;
+    range->offset = ftello(w->f);
+
+    if (range->offset > 0 && validator[0])
+      return 0;
+  }
+
+  range->if_range = NULL;
+  range->offset = 0;
+  w->header_length = 0;
+  w->skip = 0;
+
+  if (ftruncate(fileno(w->f), 0) || fseeko(w->f, 0, SEEK_SET))
+    return -1;
+
+  if (tag && fwrite(tag->data, 1, tag->len, w->f) != tag->len)
+    return -1;
+
+  return 0;
+}
+
+/* Downloads an enclosure and sets size to the size of the file it was
+   written to and file to its path. The data is written to a .part file
+   that is renamed once the download is complete. A download interrupted
+   in an earlier run is resumed if the enclosure is unchanged since, or
+   with resume set, whenever data for it is held. If the enclosure has
+   mirrors, the fastest source is tried first and the others if it
+   fails. */
+static int _do_download(channel *c, channel_info *channel_info, enclosure *enclosure,
+                        void *user_data, channel_callback cb, int resume,
+                        int debug, progress_display *progress, gint64 *size,
+                        gchar **file)
+{
+  int download_failed;
+  int inject_tag;
+  gchar *enclosure_full_filename, *part_filename;
+  FILE *enclosure_file;
+  enclosure_writer writer;
+  urlget_range range;
+  transfer_info info;
+  struct stat fileinfo;
+  partial_download *partial;
+  progress_bar *pb;
+  GPtrArray *sources;
+  const char *url;
+  char validator[256];
+  guint i;
+
+  /* Check that the spool directory exists. */
+  if (!g_file_test(c->spool_directory, G_FILE_TEST_IS_DIR)) {
+    g_fprintf(stderr, "Spool directory %s not found.\n", c->spool_directory);
+    return 1;
+  }
+
+  /* Build enclosure file name and open file. An interrupted download is
+     finished where it was started, even if the layout has changed. */
+  partial = g_hash_table_lookup(c->partials, enclosure->url);
+
+  if (partial) {
+    part_filename = _partial_path(c, partial, enclosure);
+    enclosure_full_filename = g_strndup(part_filename, strlen(part_filename) - strlen(".part"));
+  } else {
+    enclosure_full_filename = _spool_path(c, enclosure->filename, time(NULL));
+    part_filename = g_strconcat(enclosure_full_filename, ".part", NULL);
+  }
+
+  /* Write the tag ahead of the audio data so that the file does not have
+     to be rewritten to tag it. Offsets in a file written this way do not
+     match the remote file, so it cannot be resumed. */
+  inject_tag = c->id3_tag && enclosure->type &&
+    !strcmp(enclosure->type, "audio/mpeg");
+
+  memset(&range, 0, sizeof(range));
+
+  if (partial && !inject_tag)
+    range.if_range = _if_range(partial);
+
+  if ((range.if_range || resume) && !inject_tag && stat(part_filename, &fileinfo) == 0)
+    range.offset = fileinfo.st_size;
+
+  /* Leave the enclosure for later rather than fill the file system. */
+  if (!_admit_download(c, enclosure, (long)range.offset, debug)) {
+    _notify(c, user_data, cb, CCA_ENCLOSURE_DEFERRED, channel_info, enclosure,
+            enclosure_full_filename, NULL);
+    g_free(part_filename);
+    g_free(enclosure_full_filename);
+    return DOWNLOAD_DEFERRED;
+  }
+
+  if (_make_spool_subdirectory(part_filename)) {
+    g_free(part_filename);
+    g_free(enclosure_full_filename);
+    return 1;
+  }
+
+  enclosure_file = fopen(part_filename, range.offset ? "ab" : "wb");
+
+  if (!enclosure_file) {
+    g_fprintf(stderr, "Error opening enclosure file %s.\n", part_filename);
+    g_free(part_filename);
+    g_free(enclosure_full_filename);
+    return 1;
+  }
+
+  writer.f = enclosure_file;
+  writer.strip_id3v2 = FALSE;
+  writer.header_length = 0;
+  writer.skip = 0;
+  writer.range = &range;
+  writer.started = FALSE;
+  writer.start = inject_tag ? NULL : _record_partial;
+  writer.channel = c;
+  writer.url = enclosure->url;
+  writer.part_filename = part_filename;
+  writer.debug = debug;
+  writer.disk = disk_writer_for_directory(c->spool_directory);
+
+  if (inject_tag) {
+    if (fwrite(c->id3_tag->data, 1, c->id3_tag->len, enclosure_file) != c->id3_tag->len) {
+      g_fprintf(stderr, "Error writing enclosure file %s.\n", part_filename);
+      fclose(enclosure_file);
+      g_free(part_filename);
+      g_free(enclosure_full_filename);
+      return 1;
+    }
+
+    writer.strip_id3v2 = TRUE;
+  }
+
+  _notify(c, user_data, cb, CCA_ENCLOSURE_DOWNLOAD_START, channel_info, enclosure,
+          enclosure_full_filename, NULL);
+
+  if (progress)
+    pb = progress_bar_new(progress, enclosure->filename, (long)range.offset);
+  else
+    pb = NULL;
+
+  sources = _rank_sources(enclosure, debug);
+
+  for (i = 0; i < sources->len; i++) {
+    url = g_ptr_array_index(sources, i);
+
+    /* Carry on from where the last source left off if this one has the
+       same version of the enclosure, or start over. */
+    if (i > 0 && _prepare_failover(&writer, &range, validator, sizeof(validator),
+                                   inject_tag ? c->id3_tag : NULL)) {
+      g_strlcpy(info.error, "error writing enclosure file", sizeof(info.error));
+      download_failed = 1;
+      break;
+    }
+
+    download_failed = urlget_buffer(url, &writer, _enclosure_urlget_cb,
+                                    &range, debug, pb, &info);
+    stats_record_transfer(c->stats, url, &info);
+
+    if (!download_failed && _enclosure_writer_finish(&writer)) {
+      g_strlcpy(info.error, "error writing enclosure file", sizeof(info.error));
+      download_failed = 1;
+    }
+
+    /* The data held is no use if the server cannot send the rest of it. */
+    if (range.response_code == 416) {
+      g_strlcpy(info.error, "requested range not satisfiable", sizeof(info.error));
+      download_failed = 1;
+    } else if (range.response_code >= 400) {
+      g_snprintf(info.error, sizeof(info.error), "server returned status %ld",
+                 range.response_code);
+      download_failed = 1;
+    }
+
+    if (!download_failed)
+      break;
+
+    g_fprintf(stderr, "Error downloading enclosure from %s.\n", url);
+  }
+
+  g_ptr_array_free(sources, TRUE);
+
+  if (writer.disk && disk_writer_drain(writer.disk) && !download_failed) {
+    g_strlcpy(info.error, "error writing enclosure file", sizeof(info.error));
+    download_failed = 1;
+  }
+
+  if (pb)
+    progress_bar_free(pb);
+
+  *size = MAX(0, (gint64)ftello(enclosure_file));
+
+  if (fclose(enclosure_file) && !download_failed) {
+    g_strlcpy(info.error, "error writing enclosure file", sizeof(info.error));
+    download_failed = 1;
+  }
+
+  if (!download_failed) {
+    if (g_rename(part_filename, enclosure_full_filename)) {
+      g_fprintf(stderr, "Error renaming %s to %s: %s.\n", part_filename,
+                enclosure_full_filename, g_strerror(errno));
+      g_strlcpy(info.error, "error renaming enclosure file", sizeof(info.error));
+      download_failed = 1;
+    } else {
+      g_hash_table_remove(c->partials, enclosure->url);
+      *file = g_strdup(enclosure_full_filename);
+    }
+  } else if (range.response_code == 416)
+    _discard_partial(c, enclosure);
+  else if ((partial = g_hash_table_lookup(c->partials, enclosure->url)))
+    partial->offset = *size;
+
+  _notify(c, user_data, cb, CCA_ENCLOSURE_DOWNLOAD_END, channel_info, enclosure,
+          enclosure_full_filename, &info);
+
+  g_free(part_filename);
+  g_free(enclosure_full_filename);
+
+  return download_failed;
+}
+
+static int _do_catchup(channel *c, channel_info *channel_info, enclosure *enclosure,
+                       void *user_data, channel_callback cb)
+{
+  _notify(c, user_data, cb, CCA_ENCLOSURE_DOWNLOAD_START, channel_info, enclosure, NULL,
+          NULL);
+
+  _notify(c, user_data, cb, CCA_ENCLOSURE_DOWNLOAD_END, channel_info, enclosure, NULL,
+          NULL);
+
+  return 0;
+}
+
+/* Returns the enclosures in a feed that have not been downloaded and
+   that match the filter, if any, in the order they appear in the feed. */
+static GPtrArray *_find_new_enclosures(channel *c, rss_file *f, enclosure_filter *filter)
+{
+  GPtrArray *new_enclosures;
+  int i;
+
+  new_enclosures = g_ptr_array_new();
+
+  for (i = 0; i < f->num_items; i++)
+    if (f->items[i]->enclosure &&
+        !g_hash_table_lookup_extended(c->downloaded_enclosures, f->items[i]->enclosure->url, NULL, NULL) &&
+        (!filter || _enclosure_pattern_match(filter, f->items[i]->enclosure)))
+      g_ptr_array_add(new_enclosures, f->items[i]->enclosure);
+
+  return new_enclosures;
+}
+
+/* Downloads or catches up with enclosures in order, marking each one as
+   downloaded as it completes. Stops at the first failed download and
+   returns non-zero if there was one. */
+static int _process_enclosures(channel *c, channel_info *channel_info, GPtrArray *enclosures,
+                                void *user_data, channel_callback cb, int no_download,
+                                int no_mark_read, int first_only, int resume, int debug,
+                                progress_display *progress)
+{
+  int i, download_failed = 0;
+  enclosure *e;
+  enclosure_state *s;
+  gint64 start, size = 0;
+  gchar *file = NULL;
+
+  for (i = 0; i < enclosures->len; i++) {
+    e = g_ptr_array_index(enclosures, i);
+
+    /* The same enclosure may occur more than once in a feed. */
+    if (g_hash_table_lookup_extended(c->downloaded_enclosures, e->url, NULL, NULL))
+      continue;
+
+    if (no_download) {
+      download_failed = _do_catchup(c, channel_info, e, user_data, cb);
+
+      if (!no_mark_read)
+        _discard_partial(c, e);
+    } else {
+      start = stats_now();
+      download_failed = _do_download(c, channel_info, e, user_data, cb, resume, debug, progress,
+                                     &size, &file);
+      stats_record(c->stats, STATS_DOWNLOAD, start);
+
+      /* A smaller enclosure further on may still fit. */
+      if (download_failed == DOWNLOAD_DEFERRED) {
+        stats_count(c->stats, STATS_ENCLOSURES_DEFERRED);
+
+        if (first_only)
+          break;
+
+        continue;
+      }
+
+      stats_count(c->stats, download_failed ? STATS_DOWNLOAD_FAILURES : STATS_ENCLOSURES_DOWNLOADED);
+    }
+
+    if (download_failed)
+      break;
+
+    if (!no_mark_read) {
+      /* Mark enclosure as downloaded and, unless the channel file
+         is committed in batches, immediately save the channel file
+         to ensure that it reflects the change. */
+      s = _enclosure_state_new(get_rfc822_time());
+      g_hash_table_insert(c->downloaded_enclosures, g_strdup(e->url), (gpointer)s);
+
+      if (!no_download) {
+        s->file = file;
+        file = NULL;
+        s->size = size;
+        _spool_add(c, s);
+        _enforce_quota(c);
+      }
+
+      if (c->commit_policy == CHANNEL_COMMIT_ITEM)
+        _cast_channel_save(c, debug);
+    }
+
+    /* If we have been instructed to deal only with the first
+       available enclosure, it is time to break out of the loop. */
+    if (first_only)
+      break;
+  }
+
+  g_free(file);
+
+  return download_failed == 1;
+}
+
+/* Fetches and parses the feed of a channel. Returns NULL if it cannot
+   be fetched or parsed. */
+struct _rss_file *channel_fetch(channel *c, void *user_data, channel_callback cb, int debug)
+{
+  rss_file *f;
+
+  f = _get_rss(c, user_data, cb, debug);
+
+  if (f && stats_enabled()) {
+    stats_record_memory(c->stats, STATS_MEMORY_FEED, rss_file_size(f));
+    stats_record_memory(c->stats, STATS_MEMORY_STATE, _downloaded_enclosures_size(c));
+  }
+
+  return f;
+}
+
+/* Records that a feed has been dealt with: updates the time the feed was
+   last fetched and the counts of missing enclosures, enforces the quota
+   and saves the channel file. */
+void channel_finish_update(channel *c, struct _rss_file *f, int debug)
+{
+  gint64 start;
+
+  if (c->rss_last_fetched)
+    g_free(c->rss_last_fetched);
+
+  c->rss_last_fetched = g_strdup(f->fetched_time);
+
+  start = stats_now();
+  _update_missing_counts(c, f);
+  stats_record(c->stats, STATS_DIFF, start);
+
+  /* The quota may have been lowered since the last run. */
+  _enforce_quota(c);
+
+  _cast_channel_save(c, debug);
+
+  if (stats_enabled())
+    stats_record_memory(c->stats, STATS_MEMORY_STATE, _downloaded_enclosures_size(c));
+}
+
+int channel_update(channel *c, void *user_data, channel_callback cb,
+                   int no_download, int no_mark_read, int first_only,
+                   int resume, enclosure_filter *filter, int debug,
+                   progress_display *progress)
+{
+  rss_file *f;
+  GPtrArray *new_enclosures;
+  gint64 start;
+
+  /* Retrieve the RSS file. */
+  f = channel_fetch(c, user_data, cb, debug);
+
+  if (!f)
+    return 1;
+
+  /* Find enclosures in the RSS file that have not been downloaded. */
+  start = stats_now();
+  new_enclosures = _find_new_enclosures(c, f, filter);
+  stats_record(c->stats, STATS_DIFF, start);
+
+  if (!new_enclosures->len)
+    stats_count(c->stats, STATS_FEEDS_UNCHANGED);
+
+  _process_enclosures(c, &(f->channel_info), new_enclosures, user_data, cb, no_download,
+                      no_mark_read, first_only, resume, debug, progress);
+
+  g_ptr_array_free(new_enclosures, TRUE);
+
+  if (!no_mark_read)
+    channel_finish_update(c, f, debug);
+
+  rss_close(f);
+
+  return 0;
+}
+
+enclosure *enclosure_copy(const enclosure *e)
+{
+  enclosure *copy = g_malloc(sizeof(enclosure));
+  guint i;
+
+  copy->url = g_strdup(e->url);
+  copy->length = e->length;
+  copy->type = g_strdup(e->type);
+  copy->filename = g_strdup(e->filename);
+  copy->pub_date = e->pub_date;
+  copy->mirrors = NULL;
+
+  if (e->mirrors) {
+    copy->mirrors = g_ptr_array_new_with_free_func(g_free);
+
+    for (i = 0; i < e->mirrors->len; i++)
+      g_ptr_array_add(copy->mirrors, g_strdup(g_ptr_array_index(e->mirrors, i)));
+  }
+
+  return copy;
+}
+
+void enclosure_free(enclosure *e)
+{
+  g_free(e->url);
+  g_free(e->type);
+  g_free(e->filename);
+
+  if (e->mirrors)
+    g_ptr_array_free(e->mirrors, TRUE);
+
+  g_free(e);
+}
+
+/* Returns the enclosures in a feed that have not been downloaded, once
+   each, or only the first of them if first_only is set. The enclosures
+   belong to the feed. */
+static GPtrArray *_pending_enclosures(channel *c, rss_file *f, int first_only,
+                                      enclosure_filter *filter)
+{
+  GPtrArray *new_enclosures, *pending;
+  GHashTable *seen;
+  enclosure *e;
+  int i;
+
+  new_enclosures = _find_new_enclosures(c, f, filter);
+  pending = g_ptr_array_new();
+
+  /* The same enclosure may occur more than once in a feed. */
+  seen = g_hash_table_new(g_str_hash, g_str_equal);
+
+  for (i = 0; i < new_enclosures->len && !(first_only && pending->len); i++) {
+    e = g_ptr_array_index(new_enclosures, i);
+
+    if (g_hash_table_contains(seen, e->url))
+      continue;
+
+    g_hash_table_insert(seen, e->url, NULL);
+    g_ptr_array_add(pending, e);
+  }
+
+  g_hash_table_destroy(seen);
+  g_ptr_array_free(new_enclosures, TRUE);
+
+  return pending;
+}
+
+/* Returns the enclosures that an update would download from a feed
+   fetched with channel_fetch(). The enclosures belong to the feed. */
+GPtrArray *channel_new_enclosures(channel *c, struct _rss_file *f, int first_only,
+                                  enclosure_filter *filter)
+{
+  GPtrArray *pending;
+  gint64 start;
+
+  start = stats_now();
+  pending = _pending_enclosures(c, f, first_only, filter);
+  stats_record(c->stats, STATS_DIFF, start);
+
+  if (!pending->len)
+    stats_count(c->stats, STATS_FEEDS_UNCHANGED);
+
+  return pending;
+}
+
+/* Returns copies of the enclosures that an update would download from a
+   feed that has already been fetched to a file, without downloading
+   anything or changing the channel. If title is not NULL, it is set to
+   the title of the channel. Returns NULL if the feed cannot be parsed. */
+GPtrArray *channel_pending_enclosures(channel *c, const char *feed_file, int first_only,
+                                      enclosure_filter *filter, gchar **title)
+{
+  rss_file *f;
+  GPtrArray *pending, *copies;
+  gint64 start;
+  int i;
+
+  start = stats_now();
+  f = rss_open_file(feed_file, c->selection);
+  stats_record(c->stats, STATS_PARSE, start);
+
+  if (!f)
+    return NULL;
+
+  start = stats_now();
+  pending = _pending_enclosures(c, f, first_only, filter);
+  copies = g_ptr_array_new_with_free_func((GDestroyNotify)enclosure_free);
+
+  for (i = 0; i < pending->len; i++)
+    g_ptr_array_add(copies, enclosure_copy(g_ptr_array_index(pending, i)));
+
+  g_ptr_array_free(pending, TRUE);
+  stats_record(c->stats, STATS_DIFF, start);
+
+  if (title)
+    *title = g_strdup(f->channel_info.title);
+
+  rss_close(f);
+
+  return copies;
+}
+
+/* Downloads exactly the given enclosures, for instance those listed in a
+   plan, skipping any that have been downloaded since. The feed is not
+   fetched, so the time it was last fetched and the counts of missing
+   enclosures are left alone. Stops at the first failed download and
+   returns non-zero if there was one. */
+int channel_download(channel *c, void *user_data, channel_callback cb,
+                     channel_info *channel_info, GPtrArray *enclosures, int resume,
+                     int debug, progress_display *progress)
+{
+  return _process_enclosures(c, channel_info, enclosures, user_data, cb, 0, 0, 0, resume,
+                             debug, progress);
+}
+
+/* Saves changes that the commit policy has held back. */
+void channel_commit(channel *c, int debug)
+{
+  if (c->commit_policy != CHANNEL_COMMIT_ITEM)
+    _cast_channel_save(c, debug);
+}
+
+/* Removes the directories that a file was moved out of, up to the spool
+   directory, as long as they are empty. */
+static void _remove_empty_subdirectories(channel *c, const gchar *path)
+{
+  gchar *directory, *parent;
+
+  directory = g_path_get_dirname(path);
+
+  while (strcmp(directory, c->spool_directory) &&
+         g_str_has_prefix(directory, c->spool_directory) && !g_rmdir(directory)) {
+    parent = g_path_get_dirname(directory);
+    g_free(directory);
+    directory = parent;
+  }
+
+  g_free(directory);
+}
+
+/* Moves a file in the spool directory to where the layout puts it. Sets
+   moved if it was moved and, if moves is not NULL, adds the old and new
+   paths to it. Files outside the spool directory and files that no
+   longer exist are left alone. */
+static int _migrate_file(channel *c, gchar **file, time_t t, const gchar *suffix,
+                         GHashTable *moves, gboolean *moved)
+{
+  gchar *filename, *target, *prefix;
+  int ret = 0;
+
+  *moved = FALSE;
+
+  if (g_str_has_suffix(c->spool_directory, G_DIR_SEPARATOR_S))
+    prefix = g_strdup(c->spool_directory);
+  else
+    prefix = g_strconcat(c->spool_directory, G_DIR_SEPARATOR_S, NULL);
+
+  if (!g_str_has_prefix(*file, prefix) || !g_file_test(*file, G_FILE_TEST_EXISTS)) {
+    g_free(prefix);
+    return 0;
+  }
+
+  g_free(prefix);
+
+  filename = g_path_get_basename(*file);
+
+  if (suffix && g_str_has_suffix(filename, suffix))
+    filename[strlen(filename) - strlen(suffix)] = '\0';
+
+  target = _spool_path(c, filename, t);
+  g_free(filename);
+
+  if (suffix) {
+    filename = target;
+    target = g_strconcat(filename, suffix, NULL);
+    g_free(filename);
+  }
+
+  if (!strcmp(target, *file)) {
+    g_free(target);
+    return 0;
+  }
+
+  if (g_file_test(target, G_FILE_TEST_EXISTS)) {
+    g_fprintf(stderr, "Not moving %s: %s already exists.\n", *file, target);
+    ret = -1;
+  } else if (_make_spool_subdirectory(target))
+    ret = -1;
+  else if (g_rename(*file, target)) {
+    g_fprintf(stderr, "Error moving %s to %s: %s.\n", *file, target, g_strerror(errno));
+    ret = -1;
+  } else {
+    _remove_empty_subdirectories(c, *file);
+
+    if (moves)
+      g_hash_table_insert(moves, g_strdup(*file), g_strdup(target));
+
+    g_free(*file);
+    *file = target;
+    *moved = TRUE;
+    return 0;
+  }
+
+  g_free(target);
+
+  return ret;
+}
+
+/* Moves the enclosures downloaded from a channel, and any interrupted
+   downloads, to where the layout puts them, and saves the channel file.
+   Only files that the channel file records are moved, since the spool
+   directory may be shared with other channels. If moves is not NULL,
+   the old and new paths of the enclosures moved are added to it. Returns
+   the number of files moved, or -1 if any could not be moved. */
+int channel_migrate_spool(channel *c, GHashTable *moves, int debug)
+{
+  GHashTableIter iter;
+  enclosure_state *s;
+  partial_download *p;
+  gboolean moved;
+  time_t t;
+  int n = 0, ret = 0;
+
+  g_hash_table_iter_init(&iter, c->downloaded_enclosures);
+
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&s)) {
+    if (!s->file || s->evicted)
+      continue;
+
+    t = s->downloadtime ? parse_rfc822_time(s->downloadtime) : (time_t)-1;
+
+    if (t == (time_t)-1)
+      t = time(NULL);
+
+    if (_migrate_file(c, &s->file, t, NULL, moves, &moved))
+      ret = -1;
+    else if (moved)
+      n++;
+  }
+
+  g_hash_table_iter_init(&iter, c->partials);
+
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&p)) {
+    if (!p->file)
+      continue;
+
+    if (_migrate_file(c, &p->file, time(NULL), ".part", NULL, &moved))
+      ret = -1;
+    else if (moved)
+      n++;
+  }
+
+  if (n)
+    _cast_channel_save(c, debug);
+
+  return ret ? -1 : n;
+}
+
+/* Match the (file) name of an enclosure against the filter. Returns TRUE
+   if the filter matches, FALSE otherwise. */
+static gboolean _enclosure_pattern_match(enclosure_filter *filter,
+                                         const enclosure *enclosure)
+{
+#ifdef ENABLE_GREGEX
+  g_assert(filter);
+  g_assert(filter->regex);
+  g_assert(enclosure);
+
+  if (!enclosure->filename)
+    return FALSE;
+
+  return g_regex_match(filter->regex, enclosure->filename, 0, NULL);
+#else
+  return FALSE;
+#endif
+}
+
+#ifdef ENABLE_GREGEX
+/* Splits a filter into its patterns. Patterns are separated by
+   semicolons, and a semicolon that is part of a pattern is escaped with a
+   backslash, which the regular expression engine will accept as a
+   literal semicolon. */
+static gchar **_split_patterns(const gchar *pattern)
+{
+  GPtrArray *patterns;
+  GString *current;
+  const gchar *p;
+
+  patterns = g_ptr_array_new();
+  current = g_string_new(NULL);
+
+  for (p = pattern; *p; p++) {
+    if (*p == '\\' && *(p + 1)) {
+      g_string_append_c(current, *p++);
+      g_string_append_c(current, *p);
+    } else if (*p == ';') {
+      if (current->len)
+        g_ptr_array_add(patterns, g_strdup(current->str));
+
+      g_string_truncate(current, 0);
+    } else
+      g_string_append_c(current, *p);
+  }
+
+  if (current->len)
+    g_ptr_array_add(patterns, g_strdup(current->str));
+
+  g_string_free(current, TRUE);
+  g_ptr_array_add(patterns, NULL);
+
+  return (gchar **)g_ptr_array_free(patterns, FALSE);
+}
+
+static void _append_alternation(GString *s, GPtrArray *patterns)
+{
+  int i;
+
+  g_string_append(s, "(?:");
+
+  for (i = 0; i < patterns->len; i++) {
+    if (i)
+      g_string_append_c(s, '|');
+
+    g_string_append_printf(s, "(?:%s)", (gchar *)g_ptr_array_index(patterns, i));
+  }
+
+  g_string_append_c(s, ')');
+}
+
+/* Combines the include and exclude patterns of a filter into a single
+   regular expression that matches names that match at least one include
+   pattern and no exclude patterns. A filter that consists of a single
+   include pattern is used as is. */
+static gchar *_combine_patterns(const gchar *pattern)
+{
+  gchar **patterns;
+  GPtrArray *include, *exclude;
+  GString *combined;
+  int i;
+
+  patterns = _split_patterns(pattern);
+  include = g_ptr_array_new();
+  exclude = g_ptr_array_new();
+
+  for (i = 0; patterns[i]; i++) {
+    if (patterns[i][0] == '!')
+      g_ptr_array_add(exclude, patterns[i] + 1);
+    else
+      g_ptr_array_add(include, patterns[i]);
+  }
+
+  if (include->len == 1 && exclude->len == 0)
+    combined = g_string_new(g_ptr_array_index(include, 0));
+  else {
+    combined = g_string_new("^");
+
+    if (exclude->len) {
+      g_string_append(combined, "(?!.*");
+      _append_alternation(combined, exclude);
+      g_string_append_c(combined, ')');
+    }
+
+    if (include->len) {
+      g_string_append(combined, ".*?");
+      _append_alternation(combined, include);
+    }
+  }
+
+  g_ptr_array_free(exclude, TRUE);
+  g_ptr_array_free(include, TRUE);
+  g_strfreev(patterns);
+
+  return g_string_free(combined, FALSE);
+}
+#endif /* ENABLE_GREGEX */
+
+/* Creates a filter from a list of patterns. Letters in the patterns match
+   both upper and lower case letters if 'caseless' is TRUE. Returns NULL
+   if the patterns are not valid regular expressions. */
+enclosure_filter *enclosure_filter_new(const gchar *pattern,
+                                       gboolean caseless)
+{
+  enclosure_filter *e;
+#ifdef ENABLE_GREGEX
+  GError *error = NULL;
+  GRegexCompileFlags compile_options = G_REGEX_OPTIMIZE;
+  gchar *combined;
+  GRegex *regex;
+
+  g_assert(pattern);
+
+  if (caseless)
+    compile_options |= G_REGEX_CASELESS;
+
+  combined = _combine_patterns(pattern);
+  regex = g_regex_new(combined, compile_options, 0, &error);
+  g_free(combined);
+
+  if (error) {
+    fprintf(stderr, "Error compiling regular expression %s: %s\n",
+            pattern, error->message);
+    g_error_free(error);
+    return NULL;
+  }
+#endif /* ENABLE_GREGEX */
+
+  e = g_malloc(sizeof(struct _enclosure_filter));
+
+  e->pattern = g_strdup(pattern);
+  e->caseless = caseless;
+#ifdef ENABLE_GREGEX
+  e->regex = regex;
+#endif /* ENABLE_GREGEX */
+
+  return e;
+}
+
+void enclosure_filter_free(enclosure_filter *e)
+{
+#ifdef ENABLE_GREGEX
+  g_regex_unref(e->regex);
+#endif /* ENABLE_GREGEX */
   g_free(e->pattern);
   g_free(e);
 }
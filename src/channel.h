@@ -24,17 +24,81 @@ typedef enum {
   CCA_RSS_DOWNLOAD_START,
   CCA_RSS_DOWNLOAD_END,
   CCA_ENCLOSURE_DOWNLOAD_START,
-  CCA_ENCLOSURE_DOWNLOAD_END
+  CCA_ENCLOSURE_DOWNLOAD_END,
+  CCA_ENCLOSURE_DEFERRED
 } channel_action;
 
+typedef enum {
+  CHANNEL_COMMIT_ITEM,
+  CHANNEL_COMMIT_CHANNEL,
+  CHANNEL_COMMIT_RUN
+} channel_commit_policy;
+
+/* How enclosures are laid out in the spool directory: all in the spool
+   directory itself, in subdirectories named by the first two hex digits
+   of the MD5 hash of the file name, or in year and month
+   subdirectories of the date of download. */
+typedef enum {
+  SPOOL_LAYOUT_FLAT,
+  SPOOL_LAYOUT_HASH,
+  SPOOL_LAYOUT_DATE
+} spool_layout;
+
+/* Rules for choosing between renditions of the same media. A limit of 0
+   means no limit, and a NULL list of MIME types accepts any type. */
+typedef struct _media_selection {
+  long max_bitrate;
+  gint64 max_file_size;
+  gchar **mime_types;
+} media_selection;
+
 typedef struct _channel {
   gchar *url;
   gchar *channel_filename;
   gchar *spool_directory;
   GHashTable *downloaded_enclosures;
   gchar *rss_last_fetched;
+  long expire_age;
+  int expire_missing;
+  channel_commit_policy commit_policy;
+  struct _commit_group *commit_group;
+  GByteArray *id3_tag;
+  struct _stats_channel *stats;
+  gint64 reserve;
+  gint64 max_spool_bytes;
+  long max_spool_episodes;
+  gint64 spool_bytes;
+  long spool_episodes;
+  GQueue *spool;
+  GHashTable *partials;
+  media_selection *selection;
+  spool_layout layout;
 } channel;
 
+/* The file an enclosure was downloaded to is only known for enclosures
+   downloaded since it was first recorded. An evicted enclosure has been
+   deleted to keep the spool within its quota but is still counted as
+   downloaded. */
+typedef struct _enclosure_state {
+  gchar *downloadtime;
+  int missing;
+  gchar *file;
+  gint64 size;
+  gboolean evicted;
+  GList *spool_link;
+} enclosure_state;
+
+/* An interrupted download, kept in the spool directory with a .part
+   suffix. The ETag and Last-Modified date, either of which may be NULL,
+   identify the version of the remote file that the data came from. The
+   file is NULL if it was not recorded. */
+typedef struct _partial_download {
+  gchar *file;
+  gchar *etag;
+  gchar *last_modified;
+  gint64 offset;
+} partial_download;
+
 typedef struct _channel_info {
   char *title;
   char *link;
@@ -42,30 +106,69 @@ typedef struct _channel_info {
   char *language;
 } channel_info;
 
+/* The length is negative and the publication date is -1 if the feed
+   does not give them. Mirrors are other URLs of the same media, or NULL
+   if the feed gives none. The enclosure is always known by its first
+   URL. */
 typedef struct _enclosure {
   char *url;
   long length;
   char *type;
   char *filename;
+  time_t pub_date;
+  GPtrArray *mirrors;
 } enclosure;
 
 typedef struct _enclosure_filter {
   gchar *pattern;
   gboolean caseless;
+#ifdef ENABLE_GREGEX
+  GRegex *regex;
+#endif /* ENABLE_GREGEX */
 } enclosure_filter;
 
+struct _transfer_info;
+struct _progress_display;
+struct _rss_file;
+
 typedef void (*channel_callback)(void *user_data,
                                  channel_action action,
                                  channel_info *channel_info,
                                  enclosure *enclosure,
-                                 const char *filename);
+                                 const char *filename,
+                                 const struct _transfer_info *transfer);
 
 channel *channel_new(const char *url, const char *channel_file,
                      const char *spool_directory, int resume);
 void channel_free(channel *c);
+void channel_set_expiry(channel *c, long max_age, int max_missing);
+void channel_set_id3_tag(channel *c, GByteArray *tag);
+void channel_set_stats(channel *c, struct _stats_channel *stats);
+void channel_set_reserve(channel *c, gint64 reserve);
+void channel_set_quota(channel *c, gint64 max_bytes, long max_episodes);
+void channel_set_layout(channel *c, spool_layout layout);
+void channel_set_selection(channel *c, long max_bitrate, gint64 max_file_size,
+                           gchar **mime_types);
+void channel_set_commit_policy(channel *c, channel_commit_policy policy,
+                               struct _commit_group *group);
 int channel_update(channel *c, void *user_data, channel_callback cb, int no_download,
                    int no_mark_read, int first_only, int resume,
-                   enclosure_filter *filter, int debug, int progress_bar);
+                   enclosure_filter *filter, int debug,
+                   struct _progress_display *progress);
+struct _rss_file *channel_fetch(channel *c, void *user_data, channel_callback cb, int debug);
+GPtrArray *channel_new_enclosures(channel *c, struct _rss_file *f, int first_only,
+                                  enclosure_filter *filter);
+void channel_finish_update(channel *c, struct _rss_file *f, int debug);
+GPtrArray *channel_pending_enclosures(channel *c, const char *feed_file, int first_only,
+                                      enclosure_filter *filter, gchar **title);
+int channel_download(channel *c, void *user_data, channel_callback cb,
+                     channel_info *channel_info, GPtrArray *enclosures, int resume,
+                     int debug, struct _progress_display *progress);
+void channel_commit(channel *c, int debug);
+int channel_migrate_spool(channel *c, GHashTable *moves, int debug);
+
+enclosure *enclosure_copy(const enclosure *e);
+void enclosure_free(enclosure *e);
 
 enclosure_filter *enclosure_filter_new(const gchar *pattern,
                                        gboolean caseless);
@@ -20,156 +20,462 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <glib/gstdio.h>
 
 #include "configuration.h"
+#include "utils.h"
+
+/* Keys that may appear in a channel definition and the fields they are
+   stored in. */
+static const struct {
+  const gchar *key;
+  glong offset;
+} _keys[] = {
+  { "url",             G_STRUCT_OFFSET(struct channel_configuration, url) },
+  { "spool",           G_STRUCT_OFFSET(struct channel_configuration, spool_directory) },
+  { "playlist",        G_STRUCT_OFFSET(struct channel_configuration, playlist) },
+  { "id3leadartist",   G_STRUCT_OFFSET(struct channel_configuration, id3_lead_artist) },
+  { "id3contentgroup", G_STRUCT_OFFSET(struct channel_configuration, id3_content_group) },
+  { "id3title",        G_STRUCT_OFFSET(struct channel_configuration, id3_title) },
+  { "id3album",        G_STRUCT_OFFSET(struct channel_configuration, id3_album) },
+  { "id3contenttype",  G_STRUCT_OFFSET(struct channel_configuration, id3_content_type) },
+  { "id3year",         G_STRUCT_OFFSET(struct channel_configuration, id3_year) },
+  { "id3comment",      G_STRUCT_OFFSET(struct channel_configuration, id3_comment) },
+  { "id3mode",         G_STRUCT_OFFSET(struct channel_configuration, id3_mode) },
+  { "filter",          G_STRUCT_OFFSET(struct channel_configuration, regex_filter) },
+  { "expiredays",      G_STRUCT_OFFSET(struct channel_configuration, expire_days) },
+  { "expiremissing",   G_STRUCT_OFFSET(struct channel_configuration, expire_missing) },
+  { "reserve",         G_STRUCT_OFFSET(struct channel_configuration, reserve) },
+  { "maxspool",        G_STRUCT_OFFSET(struct channel_configuration, max_spool) },
+  { "maxepisodes",     G_STRUCT_OFFSET(struct channel_configuration, max_episodes) },
+  { "priority",        G_STRUCT_OFFSET(struct channel_configuration, priority) },
+  { "maxbitrate",      G_STRUCT_OFFSET(struct channel_configuration, max_bitrate) },
+  { "maxfilesize",     G_STRUCT_OFFSET(struct channel_configuration, max_file_size) },
+  { "mimetypes",       G_STRUCT_OFFSET(struct channel_configuration, mime_types) },
+  { "layout",          G_STRUCT_OFFSET(struct channel_configuration, layout) },
+};
+
+#define NUM_KEYS G_N_ELEMENTS(_keys)
+
+#define FIELD(c, i) G_STRUCT_MEMBER(gchar *, (c), _keys[(i)].offset)
+
+/* A snapshot is a header followed by a pool of NUL-terminated strings and
+   a table of records. Record 0 holds the global configuration and the
+   following records hold the channels in configuration file order. Each
+   record is the offset of the identifier followed by the offset of each
+   key in _keys, or SNAPSHOT_NULL if the key is not set. Identical strings
+   are only stored once. The header holds a hash of the names of the keys
+   so that a snapshot made with a different list of keys is not used. */
+#define SNAPSHOT_MAGIC "castget\002"
+#define SNAPSHOT_NULL G_MAXUINT32
+
+struct snapshot_header {
+  gchar magic[8];
+  guint32 num_keys;
+  guint32 keys_hash;
+  guint32 num_channels;
+  guint32 rcfile_mtime_nsec;
+  gint64 rcfile_mtime;
+  gint64 rcfile_size;
+  guint32 rcfile;
+  guint32 strings_size;
+};
+
+#define SNAPSHOT_RECORD_SIZE ((1 + NUM_KEYS) * sizeof(guint32))
+
+/* Returns an FNV-1a hash of the names of the keys in order. */
+static guint32 _keys_hash(void)
+{
+  guint32 hash = 2166136261U;
+  const gchar *p;
+  int i;
+
+  for (i = 0; i < NUM_KEYS; i++)
+    for (p = _keys[i].key; ; p++) {
+      hash = (hash ^ (guchar)*p) * 16777619U;
+
+      if (!*p)
+        break;
+    }
+
+  return hash;
+}
 
-static gchar *_read_channel_configuration_key(GKeyFile *kf, const gchar *identifier,
-                                              const gchar *key)
+/* Returns the nanoseconds part of the modification time of a file, or 0
+   where it is not available. */
+static guint32 _mtime_nsec(const struct stat *info)
 {
-  GError *error = NULL;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  return info->st_mtim.tv_nsec;
+#else
+  return 0;
+#endif /* HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC */
+}
 
-  if (g_key_file_has_key(kf, identifier, key, &error))
-    return g_strdup(g_key_file_get_value(kf, identifier, key, &error));
+static struct configuration *_configuration_new(void)
+{
+  struct configuration *cfg = g_malloc(sizeof(struct configuration));
+
+  cfg->defaults = NULL;
+  cfg->channels = g_ptr_array_new_with_free_func(g_free);
+  cfg->channels_by_identifier = g_hash_table_new(g_str_hash, g_str_equal);
+  cfg->invalid_channels = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  cfg->strings = NULL;
+  cfg->snapshot = NULL;
 
-  return NULL;
+  return cfg;
 }
 
-void channel_configuration_free(struct channel_configuration *c)
+void configuration_free(struct configuration *cfg)
 {
-  g_free(c->identifier);
+  g_free(cfg->defaults);
+  g_ptr_array_free(cfg->channels, TRUE);
+  g_hash_table_destroy(cfg->channels_by_identifier);
+  g_hash_table_destroy(cfg->invalid_channels);
 
-  if (c->url)
-    g_free(c->url);
+  if (cfg->strings)
+    g_string_chunk_free(cfg->strings);
 
-  if (c->spool_directory)
-    g_free(c->spool_directory);
+  g_free(cfg->snapshot);
+  g_free(cfg);
+}
 
-  if (c->playlist)
-    g_free(c->playlist);
+static void _configuration_add_channel(struct configuration *cfg,
+                                       struct channel_configuration *c)
+{
+  g_ptr_array_add(cfg->channels, c);
+  g_hash_table_insert(cfg->channels_by_identifier, c->identifier, c);
+}
 
-  if (c->id3_lead_artist)
-    g_free(c->id3_lead_artist);
+struct channel_configuration *configuration_lookup(struct configuration *cfg,
+                                                   const gchar *identifier)
+{
+  return g_hash_table_lookup(cfg->channels_by_identifier, identifier);
+}
 
-  if (c->id3_content_group)
-    g_free(c->id3_content_group);
+gboolean configuration_is_invalid(struct configuration *cfg, const gchar *identifier)
+{
+  return g_hash_table_lookup_extended(cfg->invalid_channels, identifier, NULL, NULL);
+}
 
-  if (c->id3_title)
-    g_free(c->id3_title);
+static int _verify_keys(GKeyFile *kf, const char *identifier, GHashTable *known_keys)
+{
+  int i;
+  gchar **key_list;
 
-  if (c->id3_album)
-    g_free(c->id3_album);
+  key_list = g_key_file_get_keys(kf, identifier, NULL, NULL);
 
-  if (c->id3_content_type)
-    g_free(c->id3_content_type);
+  if (!key_list) {
+    fprintf(stderr, "Error reading keys in configuration of channel %s.\n", identifier);
 
-  if (c->id3_year)
-    g_free(c->id3_year);
+    return -1;
+  }
 
-  if (c->id3_comment)
-    g_free(c->id3_comment);
+  for (i = 0; key_list[i]; i++) {
+    if (!g_hash_table_lookup_extended(known_keys, key_list[i], NULL, NULL)) {
+      fprintf(stderr, "Invalid key %s in configuration of channel %s.\n", key_list[i], identifier);
+      g_strfreev(key_list);
+      return -1;
+    }
+  }
 
-  if (c->regex_filter)
-    g_free(c->regex_filter);
+  g_strfreev(key_list);
 
-  g_free(c);
+  return 0;
 }
 
-struct channel_configuration *channel_configuration_new(GKeyFile *kf, const gchar *identifier,
-                                                        struct channel_configuration *defaults)
+static struct channel_configuration *_channel_configuration_new(GKeyFile *kf,
+                                                                const gchar *identifier,
+                                                                struct channel_configuration *defaults,
+                                                                GStringChunk *strings)
 {
   struct channel_configuration *c;
+  gchar *value;
+  int i;
 
-  g_assert(g_key_file_has_group(kf, identifier));
+  c = g_malloc(sizeof(struct channel_configuration));
 
-  /* Allocate new structure and save identifierr. */
-  c = (struct channel_configuration *)g_malloc(sizeof(struct channel_configuration));
+  c->identifier = g_string_chunk_insert_const(strings, identifier);
 
-  c->identifier = g_strdup(identifier);
+  /* Read keys from the configuration file and populate with defaults if
+     necessary. Inherited values are shared with the defaults. */
+  for (i = 0; i < NUM_KEYS; i++) {
+    value = g_key_file_get_value(kf, identifier, _keys[i].key, NULL);
 
-  /* Read keys from configuration file. */
-  c->url = _read_channel_configuration_key(kf, identifier, "url");
-  c->spool_directory = _read_channel_configuration_key(kf, identifier, "spool");
-  c->playlist = _read_channel_configuration_key(kf, identifier, "playlist");
-  c->id3_lead_artist = _read_channel_configuration_key(kf, identifier, "id3leadartist");
-  c->id3_content_group = _read_channel_configuration_key(kf, identifier, "id3contentgroup");
-  c->id3_title = _read_channel_configuration_key(kf, identifier, "id3title");
-  c->id3_album = _read_channel_configuration_key(kf, identifier, "id3album");
-  c->id3_content_type = _read_channel_configuration_key(kf, identifier, "id3contenttype");
-  c->id3_year = _read_channel_configuration_key(kf, identifier, "id3year");
-  c->id3_comment = _read_channel_configuration_key(kf, identifier, "id3comment");
-  c->regex_filter = _read_channel_configuration_key(kf, identifier, "filter");
+    if (value) {
+      FIELD(c, i) = g_string_chunk_insert_const(strings, value);
+      g_free(value);
+    } else if (defaults)
+      FIELD(c, i) = FIELD(defaults, i);
+    else
+      FIELD(c, i) = NULL;
+  }
 
-  /* Populate with defaults if necessary. */
-  if (defaults) {
-    if (!c->url && defaults->url)
-      c->url = g_strdup(defaults->url);
+  return c;
+}
 
-    if (!c->spool_directory && defaults->spool_directory)
-      c->spool_directory = g_strdup(defaults->spool_directory);
+/* Parses and verifies the configuration file. Returns NULL if the file
+   cannot be read or the global configuration is invalid. Channels with
+   invalid configurations are reported and recorded as invalid. */
+static struct configuration *_configuration_parse(const gchar *rcfile)
+{
+  struct configuration *cfg;
+  GKeyFile *kf;
+  GError *error = NULL;
+  GHashTable *known_keys;
+  gchar **groups;
+  int i;
 
-    if (!c->playlist && defaults->playlist)
-      c->playlist = g_strdup(defaults->playlist);
+  kf = g_key_file_new();
 
-    if (!c->id3_lead_artist && defaults->id3_lead_artist)
-      c->id3_lead_artist = g_strdup(defaults->id3_lead_artist);
+  if (!g_key_file_load_from_file(kf, rcfile, G_KEY_FILE_NONE, &error)) {
+    fprintf(stderr, "Error reading configuration file %s: %s.\n", rcfile, error->message);
+    g_error_free(error);
+    g_key_file_free(kf);
+    return NULL;
+  }
+
+  known_keys = g_hash_table_new(g_str_hash, g_str_equal);
 
-    if (!c->id3_content_group && defaults->id3_content_group)
-      c->id3_content_group = g_strdup(defaults->id3_content_group);
+  for (i = 0; i < NUM_KEYS; i++)
+    g_hash_table_insert(known_keys, (gpointer)_keys[i].key, NULL);
 
-    if (!c->id3_title && defaults->id3_title)
-      c->id3_title = g_strdup(defaults->id3_title);
+  cfg = _configuration_new();
+  cfg->strings = g_string_chunk_new(4096);
 
-    if (!c->id3_album && defaults->id3_album)
-      c->id3_album = g_strdup(defaults->id3_album);
+  /* Read defaults. */
+  if (g_key_file_has_group(kf, "*")) {
+    if (_verify_keys(kf, "*", known_keys) < 0) {
+      g_hash_table_destroy(known_keys);
+      g_key_file_free(kf);
+      configuration_free(cfg);
+      return NULL;
+    }
 
-    if (!c->id3_content_type && defaults->id3_content_type)
-      c->id3_content_type = g_strdup(defaults->id3_content_type);
+    cfg->defaults = _channel_configuration_new(kf, "*", NULL, cfg->strings);
+  }
 
-    if (!c->id3_year && defaults->id3_year)
-      c->id3_year = g_strdup(defaults->id3_year);
+  groups = g_key_file_get_groups(kf, NULL);
 
-    if (!c->id3_comment && defaults->id3_comment)
-      c->id3_comment = g_strdup(defaults->id3_comment);
+  for (i = 0; groups[i]; i++) {
+    if (!strcmp(groups[i], "*"))
+      continue;
 
-    if (!c->regex_filter && defaults->regex_filter)
-      c->regex_filter = g_strdup(defaults->regex_filter);
+    if (_verify_keys(kf, groups[i], known_keys) < 0)
+      g_hash_table_insert(cfg->invalid_channels, g_strdup(groups[i]), NULL);
+    else
+      _configuration_add_channel(cfg, _channel_configuration_new(kf, groups[i], cfg->defaults,
+                                                                 cfg->strings));
   }
 
-  return c;
+  g_strfreev(groups);
+  g_hash_table_destroy(known_keys);
+  g_key_file_free(kf);
+
+  return cfg;
 }
 
-int channel_configuration_verify_keys(GKeyFile *kf, const char *identifier)
+struct snapshot_writer {
+  struct configuration *cfg;
+  const gchar *rcfile;
+  struct stat *rcfile_info;
+};
+
+static guint32 _snapshot_intern(GHashTable *offsets, GString *pool, const gchar *s)
 {
+  gpointer offset;
+
+  if (!s)
+    return SNAPSHOT_NULL;
+
+  if (g_hash_table_lookup_extended(offsets, s, NULL, &offset))
+    return GPOINTER_TO_UINT(offset);
+
+  offset = GUINT_TO_POINTER(pool->len);
+  g_string_append_len(pool, s, strlen(s) + 1);
+  g_hash_table_insert(offsets, (gpointer)s, offset);
+
+  return GPOINTER_TO_UINT(offset);
+}
+
+static void _snapshot_add_record(GArray *records, GHashTable *offsets, GString *pool,
+                                 struct channel_configuration *c)
+{
+  guint32 offset;
   int i;
-  gchar **key_list;
 
-  key_list = g_key_file_get_keys(kf, identifier, NULL, NULL);
+  offset = _snapshot_intern(offsets, pool, c ? c->identifier : NULL);
+  g_array_append_val(records, offset);
 
-  if (!key_list) {
-    fprintf(stderr, "Error reading keys in configuration of channel %s.\n", identifier);
+  for (i = 0; i < NUM_KEYS; i++) {
+    offset = _snapshot_intern(offsets, pool, c ? FIELD(c, i) : NULL);
+    g_array_append_val(records, offset);
+  }
+}
 
-    return -1;
+static int _snapshot_write(FILE *f, gpointer user_data, int debug)
+{
+  struct snapshot_writer *w = (struct snapshot_writer *)user_data;
+  struct snapshot_header header;
+  GHashTable *offsets;
+  GString *pool;
+  GArray *records;
+  int i, ret = 0;
+
+  offsets = g_hash_table_new(g_str_hash, g_str_equal);
+  pool = g_string_new(NULL);
+  records = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+  memset(&header, 0, sizeof(struct snapshot_header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.num_keys = NUM_KEYS;
+  header.keys_hash = _keys_hash();
+  header.num_channels = w->cfg->channels->len;
+  header.rcfile_mtime = w->rcfile_info->st_mtime;
+  header.rcfile_mtime_nsec = _mtime_nsec(w->rcfile_info);
+  header.rcfile_size = w->rcfile_info->st_size;
+  header.rcfile = _snapshot_intern(offsets, pool, w->rcfile);
+
+  _snapshot_add_record(records, offsets, pool, w->cfg->defaults);
+
+  for (i = 0; i < w->cfg->channels->len; i++)
+    _snapshot_add_record(records, offsets, pool, g_ptr_array_index(w->cfg->channels, i));
+
+  /* Keep the record table aligned. */
+  while (pool->len % sizeof(guint32))
+    g_string_append_c(pool, 0);
+
+  header.strings_size = pool->len;
+
+  if (fwrite(&header, sizeof(struct snapshot_header), 1, f) != 1 ||
+      fwrite(pool->str, 1, pool->len, f) != pool->len ||
+      fwrite(records->data, sizeof(guint32), records->len, f) != records->len)
+    ret = -1;
+
+  g_array_free(records, TRUE);
+  g_string_free(pool, TRUE);
+  g_hash_table_destroy(offsets);
+
+  return ret;
+}
+
+static struct channel_configuration *_snapshot_read_record(const gchar *pool,
+                                                           const guint32 *record)
+{
+  struct channel_configuration *c;
+  int i;
+
+  c = g_malloc(sizeof(struct channel_configuration));
+
+  c->identifier = (gchar *)pool + record[0];
+
+  for (i = 0; i < NUM_KEYS; i++)
+    FIELD(c, i) = record[i + 1] == SNAPSHOT_NULL ? NULL : (gchar *)pool + record[i + 1];
+
+  return c;
+}
+
+/* Loads a snapshot of the configuration file. Returns NULL if there is no
+   usable snapshot or if it is out of date. The configuration keeps the
+   snapshot in memory and points into it. */
+static struct configuration *_snapshot_load(const gchar *snapshot_file, const gchar *rcfile,
+                                            struct stat *rcfile_info)
+{
+  struct configuration *cfg;
+  struct snapshot_header *header;
+  const gchar *pool;
+  const guint32 *records;
+  gchar *data;
+  gsize length, i, num_offsets;
+
+  if (!g_file_get_contents(snapshot_file, &data, &length, NULL))
+    return NULL;
+
+  header = (struct snapshot_header *)data;
+
+  if (length < sizeof(struct snapshot_header) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->num_keys != NUM_KEYS ||
+      header->keys_hash != _keys_hash() ||
+      header->rcfile_mtime != rcfile_info->st_mtime ||
+      header->rcfile_mtime_nsec != _mtime_nsec(rcfile_info) ||
+      header->rcfile_size != rcfile_info->st_size ||
+      header->strings_size == 0 ||
+      header->strings_size % sizeof(guint32) ||
+      length != sizeof(struct snapshot_header) + header->strings_size +
+      (header->num_channels + 1) * SNAPSHOT_RECORD_SIZE) {
+    g_free(data);
+    return NULL;
   }
 
-  for (i = 0; key_list[i]; i++) {
-    if (! (!strcmp(key_list[i], "url") ||
-           !strcmp(key_list[i], "spool") ||
-           !strcmp(key_list[i], "playlist") ||
-           !strcmp(key_list[i], "id3leadartist") ||
-           !strcmp(key_list[i], "id3contentgroup") ||
-           !strcmp(key_list[i], "id3title") ||
-           !strcmp(key_list[i], "id3album") ||
-           !strcmp(key_list[i], "id3contenttype") ||
-           !strcmp(key_list[i], "id3year") ||
-           !strcmp(key_list[i], "id3comment") ||
-           !strcmp(key_list[i], "filter"))) {
-      fprintf(stderr, "Invalid key %s in configuration of channel %s.\n", key_list[i], identifier);
-      return -1;
+  pool = data + sizeof(struct snapshot_header);
+  records = (const guint32 *)(pool + header->strings_size);
+  num_offsets = (header->num_channels + 1) * (1 + NUM_KEYS);
+
+  /* Make sure that every offset points to a NUL-terminated string within
+     the pool and that the snapshot was made from the same file. */
+  for (i = 0; i < num_offsets; i++) {
+    if (records[i] != SNAPSHOT_NULL && records[i] >= header->strings_size) {
+      g_free(data);
+      return NULL;
     }
   }
 
-  g_strfreev(key_list);
+  if (pool[header->strings_size - 1] || header->rcfile >= header->strings_size ||
+      strcmp(pool + header->rcfile, rcfile)) {
+    g_free(data);
+    return NULL;
+  }
 
-  return 0;
+  cfg = _configuration_new();
+  cfg->snapshot = data;
+
+  if (records[0] != SNAPSHOT_NULL)
+    cfg->defaults = _snapshot_read_record(pool, records);
+
+  for (i = 1; i <= header->num_channels; i++) {
+    if (records[i * (1 + NUM_KEYS)] == SNAPSHOT_NULL) {
+      configuration_free(cfg);
+      return NULL;
+    }
+
+    _configuration_add_channel(cfg, _snapshot_read_record(pool, records + i * (1 + NUM_KEYS)));
+  }
+
+  return cfg;
+}
+
+/* Loads the configuration file. If snapshot_file is given, a verified
+   snapshot of the configuration is kept there and used as long as the
+   modification time and size of the configuration file are unchanged. */
+struct configuration *configuration_load(const gchar *rcfile, const gchar *snapshot_file)
+{
+  struct configuration *cfg;
+  struct snapshot_writer w;
+  struct stat rcfile_info;
+
+  if (snapshot_file && g_stat(rcfile, &rcfile_info) == 0) {
+    cfg = _snapshot_load(snapshot_file, rcfile, &rcfile_info);
+
+    if (cfg)
+      return cfg;
+  } else
+    snapshot_file = NULL;
+
+  cfg = _configuration_parse(rcfile);
+
+  /* Only snapshot configurations without errors so that errors are
+     reported every time. */
+  if (cfg && snapshot_file && g_hash_table_size(cfg->invalid_channels) == 0) {
+    w.cfg = cfg;
+    w.rcfile = rcfile;
+    w.rcfile_info = &rcfile_info;
+
+    write_by_temporary_file(snapshot_file, _snapshot_write, &w, NULL, 0);
+  }
+
+  return cfg;
 }
@@ -22,6 +22,9 @@
 
 #include <glib.h>
 
+/* All strings in a channel configuration are owned by the configuration
+   it belongs to, and values inherited from the global configuration are
+   shared with it. */
 struct channel_configuration {
   gchar *identifier;
   gchar *url;
@@ -34,12 +37,33 @@ struct channel_configuration {
   gchar *id3_content_type;
   gchar *id3_year;
   gchar *id3_comment;
+  gchar *id3_mode;
   gchar *regex_filter;
+  gchar *expire_days;
+  gchar *expire_missing;
+  gchar *reserve;
+  gchar *max_spool;
+  gchar *max_episodes;
+  gchar *priority;
+  gchar *max_bitrate;
+  gchar *max_file_size;
+  gchar *mime_types;
+  gchar *layout;
 };
 
-struct channel_configuration *channel_configuration_new(GKeyFile *kf, const gchar *identifier,
-                                                        struct channel_configuration *defaults);
-void channel_configuration_free(struct channel_configuration *c);
-int channel_configuration_verify_keys(GKeyFile *kf, const char *identifier);
+struct configuration {
+  struct channel_configuration *defaults;
+  GPtrArray *channels;
+  GHashTable *channels_by_identifier;
+  GHashTable *invalid_channels;
+  GStringChunk *strings;
+  gchar *snapshot;
+};
+
+struct configuration *configuration_load(const gchar *rcfile, const gchar *snapshot_file);
+void configuration_free(struct configuration *cfg);
+struct channel_configuration *configuration_lookup(struct configuration *cfg,
+                                                   const gchar *identifier);
+gboolean configuration_is_invalid(struct configuration *cfg, const gchar *identifier);
 
 #endif /* CONFIGURATION_H */
@@ -0,0 +1,265 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "diskwriter.h"
+
+/* Enclosures are written to disk by a thread for each device, so that a
+   slow disk does not hold up the transfer feeding it. Data is passed to
+   the thread through a ring of buffers with a single producer, the
+   thread doing the transfers, and a single consumer, the writer thread.
+   Each side only ever advances its own index, so the ring itself needs
+   no lock. The lock and condition are only used to sleep when the ring
+   is full or empty. */
+
+#define RING_SLOTS 8
+#define SLOT_SIZE (256 * 1024)
+
+typedef struct _ring_slot {
+  FILE *f;
+  gsize length;
+  guchar *data;
+} ring_slot;
+
+struct _disk_writer {
+  ring_slot slots[RING_SLOTS];
+
+  /* Number of slots published by the producer and written by the
+     consumer. The slot at head is being filled if filling is set. */
+  volatile gint head;
+  volatile gint tail;
+  gboolean filling;
+  volatile gint failed;
+
+  GMutex lock;
+  GCond cond;
+  gboolean stop;
+  GThread *thread;
+};
+
+static GHashTable *_writers = NULL;
+
+static gpointer _writer_thread(gpointer data)
+{
+  disk_writer *w = (disk_writer *)data;
+  ring_slot *slot;
+  gint tail;
+
+  for (;;) {
+    tail = g_atomic_int_get(&w->tail);
+
+    g_mutex_lock(&w->lock);
+
+    while (!w->stop && g_atomic_int_get(&w->head) == tail)
+      g_cond_wait(&w->cond, &w->lock);
+
+    if (g_atomic_int_get(&w->head) == tail) {
+      g_mutex_unlock(&w->lock);
+      break;
+    }
+
+    g_mutex_unlock(&w->lock);
+
+    slot = &w->slots[tail % RING_SLOTS];
+
+    if (!g_atomic_int_get(&w->failed) &&
+        fwrite(slot->data, 1, slot->length, slot->f) != slot->length)
+      g_atomic_int_set(&w->failed, 1);
+
+    slot->f = NULL;
+    slot->length = 0;
+
+    g_atomic_int_set(&w->tail, tail + 1);
+
+    g_mutex_lock(&w->lock);
+    g_cond_broadcast(&w->cond);
+    g_mutex_unlock(&w->lock);
+  }
+
+  return NULL;
+}
+
+static disk_writer *_disk_writer_new(void)
+{
+  disk_writer *w;
+  int i;
+
+  w = g_malloc0(sizeof(disk_writer));
+
+  for (i = 0; i < RING_SLOTS; i++)
+    w->slots[i].data = g_malloc(SLOT_SIZE);
+
+  g_mutex_init(&w->lock);
+  g_cond_init(&w->cond);
+  w->thread = g_thread_new("diskwriter", _writer_thread, w);
+
+  return w;
+}
+
+/* Hands the slot being filled to the writer thread. */
+static void _publish(disk_writer *w)
+{
+  w->filling = FALSE;
+  g_atomic_int_set(&w->head, w->head + 1);
+
+  g_mutex_lock(&w->lock);
+  g_cond_broadcast(&w->cond);
+  g_mutex_unlock(&w->lock);
+}
+
+/* Returns the slot to fill, waiting for the writer thread to free one if
+   the ring is full. */
+static ring_slot *_producer_slot(disk_writer *w)
+{
+  if (!w->filling) {
+    g_mutex_lock(&w->lock);
+
+    while (w->head - g_atomic_int_get(&w->tail) >= RING_SLOTS)
+      g_cond_wait(&w->cond, &w->lock);
+
+    g_mutex_unlock(&w->lock);
+    w->filling = TRUE;
+  }
+
+  return &w->slots[w->head % RING_SLOTS];
+}
+
+static void _disk_writer_free(gpointer data)
+{
+  disk_writer *w = (disk_writer *)data;
+  int i;
+
+  disk_writer_drain(w);
+
+  g_mutex_lock(&w->lock);
+  w->stop = TRUE;
+  g_cond_broadcast(&w->cond);
+  g_mutex_unlock(&w->lock);
+
+  g_thread_join(w->thread);
+
+  for (i = 0; i < RING_SLOTS; i++)
+    g_free(w->slots[i].data);
+
+  g_cond_clear(&w->cond);
+  g_mutex_clear(&w->lock);
+  g_free(w);
+}
+
+/* Returns the writer for the device a directory is on, starting it if
+   need be. Returns NULL if the directory cannot be found, in which case
+   the caller should write to the file itself. Only one thread may write
+   through the writers. */
+disk_writer *disk_writer_for_directory(const gchar *directory)
+{
+  struct stat fileinfo;
+  disk_writer *w;
+  gint64 device, *key;
+
+  if (stat(directory, &fileinfo))
+    return NULL;
+
+  if (!_writers)
+    _writers = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, _disk_writer_free);
+
+  device = (gint64)fileinfo.st_dev;
+  w = g_hash_table_lookup(_writers, &device);
+
+  if (!w) {
+    w = _disk_writer_new();
+    key = g_new(gint64, 1);
+    *key = device;
+    g_hash_table_insert(_writers, key, w);
+  }
+
+  return w;
+}
+
+/* Queues data to be written to a file. Only waits if the ring is full.
+   Returns -1 if a write queued since the writer was last drained has
+   failed. */
+int disk_writer_write(disk_writer *w, FILE *f, const void *data, gsize length)
+{
+  const guchar *p = (const guchar *)data;
+  ring_slot *slot;
+  gsize n;
+
+  while (length) {
+    if (g_atomic_int_get(&w->failed))
+      return -1;
+
+    slot = _producer_slot(w);
+
+    /* A slot only ever holds data for one file. */
+    if (slot->length && slot->f != f) {
+      _publish(w);
+      continue;
+    }
+
+    n = MIN(length, SLOT_SIZE - slot->length);
+    slot->f = f;
+    memcpy(slot->data + slot->length, p, n);
+    slot->length += n;
+    p += n;
+    length -= n;
+
+    if (slot->length == SLOT_SIZE)
+      _publish(w);
+  }
+
+  return g_atomic_int_get(&w->failed) ? -1 : 0;
+}
+
+/* Waits until everything queued has been written, so that the files
+   written to can be used directly again. Returns -1 if any of the writes
+   failed. */
+int disk_writer_drain(disk_writer *w)
+{
+  if (w->filling && w->slots[w->head % RING_SLOTS].length)
+    _publish(w);
+
+  g_mutex_lock(&w->lock);
+
+  while (g_atomic_int_get(&w->tail) != w->head)
+    g_cond_wait(&w->cond, &w->lock);
+
+  g_mutex_unlock(&w->lock);
+
+  if (g_atomic_int_get(&w->failed)) {
+    g_atomic_int_set(&w->failed, 0);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Waits for all writers to finish and stops them. */
+void disk_writers_free(void)
+{
+  if (_writers) {
+    g_hash_table_destroy(_writers);
+    _writers = NULL;
+  }
+}
@@ -0,0 +1,33 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+
+#include <stdio.h>
+#include <glib.h>
+
+typedef struct _disk_writer disk_writer;
+
+disk_writer *disk_writer_for_directory(const gchar *directory);
+int disk_writer_write(disk_writer *w, FILE *f, const void *data, gsize length);
+int disk_writer_drain(disk_writer *w);
+void disk_writers_free(void);
+
+#endif /* DISKWRITER_H */
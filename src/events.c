@@ -0,0 +1,223 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <glib.h>
+#include "events.h"
+#include "utils.h"
+
+/* Events are written one JSON object per line by a separate thread, so
+   that a consumer that reads slowly never holds up a transfer. Emitting
+   an event only appends it to a bounded queue. Events that arrive when
+   the queue is full are dropped and counted, and the count is reported
+   in a "dropped" event once the writer has caught up. Droppable events,
+   such as progress updates, are dropped already when the queue is half
+   full so that there is always room for the rest. */
+
+#define QUEUE_LENGTH 1024
+
+static struct {
+  FILE *f;
+  GMutex lock;
+  GCond cond;
+  GThread *thread;
+  gboolean stop;
+  GQueue *queue;
+  guint64 dropped;
+  gboolean failed;
+} *_events = NULL;
+
+gboolean events_enabled(void)
+{
+  return _events != NULL;
+}
+
+static gboolean _write_line(FILE *f, const gchar *line)
+{
+  return fputs(line, f) >= 0 && fputc('\n', f) != EOF;
+}
+
+static gpointer _writer_thread(gpointer data)
+{
+  GQueue *batch;
+  GString *e;
+  guint64 dropped;
+  gboolean stop, ok = TRUE;
+
+  g_mutex_lock(&_events->lock);
+
+  for (;;) {
+    while (!_events->stop && g_queue_is_empty(_events->queue))
+      g_cond_wait(&_events->cond, &_events->lock);
+
+    /* Take the whole queue and write it without holding the lock. */
+    batch = _events->queue;
+    _events->queue = g_queue_new();
+    dropped = _events->dropped;
+    _events->dropped = 0;
+    stop = _events->stop;
+
+    g_mutex_unlock(&_events->lock);
+
+    while ((e = g_queue_pop_head(batch))) {
+      ok = _write_line(_events->f, e->str) && ok;
+      g_string_free(e, TRUE);
+    }
+
+    g_queue_free(batch);
+
+    if (dropped) {
+      e = event_new("dropped");
+      event_add_int(e, "count", (gint64)dropped);
+      g_string_append_c(e, '}');
+      ok = _write_line(_events->f, e->str) && ok;
+      g_string_free(e, TRUE);
+    }
+
+    ok = fflush(_events->f) == 0 && ok;
+
+    g_mutex_lock(&_events->lock);
+
+    if (stop && g_queue_is_empty(_events->queue) && !_events->dropped)
+      break;
+  }
+
+  _events->failed = !ok;
+
+  g_mutex_unlock(&_events->lock);
+
+  return NULL;
+}
+
+/* Starts writing events to a stream. */
+void events_open(FILE *f)
+{
+  _events = g_malloc(sizeof(*_events));
+  _events->f = f;
+  g_mutex_init(&_events->lock);
+  g_cond_init(&_events->cond);
+  _events->stop = FALSE;
+  _events->queue = g_queue_new();
+  _events->dropped = 0;
+  _events->failed = FALSE;
+  _events->thread = g_thread_new("events", _writer_thread, NULL);
+}
+
+/* Writes any queued events and stops the writer. Returns non-zero if the
+   events could not be written. */
+int events_close(void)
+{
+  int ret;
+
+  if (!_events)
+    return 0;
+
+  g_mutex_lock(&_events->lock);
+  _events->stop = TRUE;
+  g_cond_signal(&_events->cond);
+  g_mutex_unlock(&_events->lock);
+
+  g_thread_join(_events->thread);
+
+  ret = _events->failed ? -1 : 0;
+
+  g_queue_free(_events->queue);
+  g_cond_clear(&_events->cond);
+  g_mutex_clear(&_events->lock);
+  g_free(_events);
+  _events = NULL;
+
+  if (ret)
+    fprintf(stderr, "Error writing events.\n");
+
+  return ret;
+}
+
+/* Starts a new event of the given type stamped with the current time in
+   seconds since the epoch. Fields are added with the event_add_*
+   functions before the event is emitted. */
+GString *event_new(const gchar *type)
+{
+  GString *e;
+  gint64 now = g_get_real_time();
+
+  e = g_string_new(NULL);
+  g_string_append_printf(e, "{\"time\":%" G_GINT64_FORMAT ".%03d,\"event\":",
+                         now / G_USEC_PER_SEC, (int)(now % G_USEC_PER_SEC / 1000));
+  append_json_string(e, type);
+
+  return e;
+}
+
+/* Adds a string field. Nothing is added if the value is NULL. */
+void event_add_string(GString *e, const gchar *key, const gchar *value)
+{
+  if (!value)
+    return;
+
+  g_string_append_printf(e, ",\"%s\":", key);
+  append_json_string(e, value);
+}
+
+void event_add_int(GString *e, const gchar *key, gint64 value)
+{
+  g_string_append_printf(e, ",\"%s\":%" G_GINT64_FORMAT, key, value);
+}
+
+void event_add_double(GString *e, const gchar *key, double value)
+{
+  g_string_append_printf(e, ",\"%s\":%.3f", key, value);
+}
+
+void event_add_bool(GString *e, const gchar *key, gboolean value)
+{
+  g_string_append_printf(e, ",\"%s\":%s", key, value ? "true" : "false");
+}
+
+/* Queues an event for writing and takes ownership of it. Never blocks on
+   the stream. */
+void event_emit(GString *e, gboolean droppable)
+{
+  guint limit = droppable ? QUEUE_LENGTH / 2 : QUEUE_LENGTH;
+
+  if (!_events) {
+    g_string_free(e, TRUE);
+    return;
+  }
+
+  g_string_append_c(e, '}');
+
+  g_mutex_lock(&_events->lock);
+
+  if (g_queue_get_length(_events->queue) < limit) {
+    g_queue_push_tail(_events->queue, e);
+    g_cond_signal(&_events->cond);
+    e = NULL;
+  } else
+    _events->dropped++;
+
+  g_mutex_unlock(&_events->lock);
+
+  if (e)
+    g_string_free(e, TRUE);
+}
@@ -0,0 +1,37 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdio.h>
+#include <glib.h>
+
+void events_open(FILE *f);
+int events_close(void);
+gboolean events_enabled(void);
+
+GString *event_new(const gchar *type);
+void event_add_string(GString *e, const gchar *key, const gchar *value);
+void event_add_int(GString *e, const gchar *key, gint64 value);
+void event_add_double(GString *e, const gchar *key, double value);
+void event_add_bool(GString *e, const gchar *key, gboolean value);
+void event_emit(GString *e, gboolean droppable);
+
+#endif /* EVENTS_H */
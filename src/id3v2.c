@@ -0,0 +1,177 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include "id3v2.h"
+
+/* A minimal ID3v2.3 writer used to build a tag before an enclosure is
+   downloaded, so that the tag can be written ahead of the audio data
+   instead of being added by rewriting the finished file. */
+
+#define ID3V2_ENCODING_ISO_8859_1 0
+#define ID3V2_ENCODING_UTF_16 1
+
+static void _append_uint32(GByteArray *a, guint32 n, int syncsafe)
+{
+  guint8 b[4];
+  int shift = syncsafe ? 7 : 8;
+
+  b[0] = (n >> (3 * shift)) & (syncsafe ? 0x7f : 0xff);
+  b[1] = (n >> (2 * shift)) & (syncsafe ? 0x7f : 0xff);
+  b[2] = (n >> shift) & (syncsafe ? 0x7f : 0xff);
+  b[3] = n & (syncsafe ? 0x7f : 0xff);
+
+  g_byte_array_append(a, b, 4);
+}
+
+/* Appends a string in the chosen encoding, optionally terminated. */
+static void _append_text(GByteArray *a, int encoding, const gchar *text,
+                         int terminate)
+{
+  static const guint8 bom[] = { 0xff, 0xfe };
+  static const guint8 nul[] = { 0, 0 };
+  gchar *converted;
+  gsize length;
+
+  if (encoding == ID3V2_ENCODING_ISO_8859_1) {
+    converted = g_convert(text, -1, "ISO-8859-1", "UTF-8", NULL, &length, NULL);
+    g_byte_array_append(a, (guint8 *)converted, length);
+    g_free(converted);
+
+    if (terminate)
+      g_byte_array_append(a, nul, 1);
+  } else {
+    converted = g_convert(text, -1, "UTF-16LE", "UTF-8", NULL, &length, NULL);
+    g_byte_array_append(a, bom, sizeof(bom));
+
+    if (converted)
+      g_byte_array_append(a, (guint8 *)converted, length);
+
+    g_free(converted);
+
+    if (terminate)
+      g_byte_array_append(a, nul, 2);
+  }
+}
+
+/* Use ISO-8859-1 where possible and fall back on UTF-16. */
+static int _choose_encoding(const gchar *text)
+{
+  gchar *converted;
+
+  converted = g_convert(text, -1, "ISO-8859-1", "UTF-8", NULL, NULL, NULL);
+
+  if (!converted)
+    return ID3V2_ENCODING_UTF_16;
+
+  g_free(converted);
+
+  return ID3V2_ENCODING_ISO_8859_1;
+}
+
+static void _append_frame(GByteArray *tag, const gchar *id, const gchar *value,
+                          int comment)
+{
+  static const guint8 flags[] = { 0, 0 };
+  GByteArray *body;
+  guint8 encoding;
+
+  /* Empty values remove the frame, as they do with id3lib. */
+  if (!value || !*value)
+    return;
+
+  encoding = _choose_encoding(value);
+
+  body = g_byte_array_new();
+  g_byte_array_append(body, &encoding, 1);
+
+  if (comment) {
+    /* Language and an empty content description precede the text. */
+    g_byte_array_append(body, (const guint8 *)"eng", 3);
+    _append_text(body, encoding, "", TRUE);
+  }
+
+  _append_text(body, encoding, value, FALSE);
+
+  g_byte_array_append(tag, (const guint8 *)id, 4);
+  _append_uint32(tag, body->len, FALSE);
+  g_byte_array_append(tag, flags, sizeof(flags));
+  g_byte_array_append(tag, body->data, body->len);
+
+  g_byte_array_free(body, TRUE);
+}
+
+/* Renders an ID3v2.3 tag with the given frames. Returns NULL if no frames
+   are set. */
+GByteArray *id3v2_tag_new(const gchar *lead_artist, const gchar *content_group,
+                          const gchar *title, const gchar *album,
+                          const gchar *content_type, const gchar *year,
+                          const gchar *comment)
+{
+  static const guint8 header[] = { 'I', 'D', '3', 3, 0, 0 };
+  GByteArray *frames, *tag;
+
+  frames = g_byte_array_new();
+
+  _append_frame(frames, "TPE1", lead_artist, FALSE);
+  _append_frame(frames, "TIT1", content_group, FALSE);
+  _append_frame(frames, "TIT2", title, FALSE);
+  _append_frame(frames, "TALB", album, FALSE);
+  _append_frame(frames, "TCON", content_type, FALSE);
+  _append_frame(frames, "TYER", year, FALSE);
+  _append_frame(frames, "COMM", comment, TRUE);
+
+  if (frames->len == 0) {
+    g_byte_array_free(frames, TRUE);
+    return NULL;
+  }
+
+  tag = g_byte_array_sized_new(ID3V2_HEADER_SIZE + frames->len);
+  g_byte_array_append(tag, header, sizeof(header));
+  _append_uint32(tag, frames->len, TRUE);
+  g_byte_array_append(tag, frames->data, frames->len);
+
+  g_byte_array_free(frames, TRUE);
+
+  return tag;
+}
+
+/* Returns the total size of the ID3v2 tag that starts with the given
+   header, including the header and any footer, or -1 if the header is
+   not an ID3v2 header. */
+gssize id3v2_tag_size(const guchar *header)
+{
+  gssize size;
+
+  if (memcmp(header, "ID3", 3) || header[3] == 0xff || header[4] == 0xff ||
+      (header[6] | header[7] | header[8] | header[9]) & 0x80)
+    return -1;
+
+  size = ((gssize)header[6] << 21) | (header[7] << 14) | (header[8] << 7) | header[9];
+
+  /* ID3v2.4 tags may have a footer. */
+  if (header[5] & 0x10)
+    size += ID3V2_HEADER_SIZE;
+
+  return ID3V2_HEADER_SIZE + size;
+}
@@ -0,0 +1,33 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef ID3V2_H
+#define ID3V2_H
+
+#include <glib.h>
+
+#define ID3V2_HEADER_SIZE 10
+
+GByteArray *id3v2_tag_new(const gchar *lead_artist, const gchar *content_group,
+                          const gchar *title, const gchar *album,
+                          const gchar *content_type, const gchar *year,
+                          const gchar *comment);
+gssize id3v2_tag_size(const guchar *header);
+
+#endif /* ID3V2_H */
@@ -21,7 +21,9 @@
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
+#include <stdlib.h>
 #include <string.h>
+#include <glib.h>
 #include "libxmlutil.h"
 
 char *libxmlutil_dup_attr(const xmlNode *node, const char *name)
@@ -103,3 +105,129 @@ const xmlNode *libxmlutil_child_node_by_name(const xmlNode *node, const char *ns
 
   return NULL;
 }
+
+/* Allocations made by libxml2 can be counted by replacing its allocator
+   with one that stores the size of each block in a header in front of
+   it. The header is large enough to keep blocks suitably aligned. */
+
+#define MEMORY_HEADER_SIZE 16
+
+static GMutex _memory_lock;
+static gsize _memory_in_use = 0;
+static gsize _memory_peak = 0;
+
+static void _memory_add(gssize delta)
+{
+  g_mutex_lock(&_memory_lock);
+
+  _memory_in_use += delta;
+
+  if (_memory_in_use > _memory_peak)
+    _memory_peak = _memory_in_use;
+
+  g_mutex_unlock(&_memory_lock);
+}
+
+static void *_tracked_malloc(size_t size)
+{
+  char *p = malloc(size + MEMORY_HEADER_SIZE);
+
+  if (!p)
+    return NULL;
+
+  *(size_t *)p = size;
+  _memory_add(size);
+
+  return p + MEMORY_HEADER_SIZE;
+}
+
+static void *_tracked_realloc(void *mem, size_t size)
+{
+  char *p;
+  size_t old_size;
+
+  if (!mem)
+    return _tracked_malloc(size);
+
+  p = (char *)mem - MEMORY_HEADER_SIZE;
+  old_size = *(size_t *)p;
+
+  p = realloc(p, size + MEMORY_HEADER_SIZE);
+
+  if (!p)
+    return NULL;
+
+  *(size_t *)p = size;
+  _memory_add((gssize)size - (gssize)old_size);
+
+  return p + MEMORY_HEADER_SIZE;
+}
+
+static void _tracked_free(void *mem)
+{
+  char *p;
+
+  if (!mem)
+    return;
+
+  p = (char *)mem - MEMORY_HEADER_SIZE;
+  _memory_add(-(gssize)*(size_t *)p);
+  free(p);
+}
+
+static char *_tracked_strdup(const char *s)
+{
+  size_t length = strlen(s) + 1;
+  char *p = _tracked_malloc(length);
+
+  if (p)
+    memcpy(p, s, length);
+
+  return p;
+}
+
+/* Starts counting memory allocated by libxml2. Must be called before
+   libxml2 allocates anything. */
+int libxmlutil_track_memory(void)
+{
+  return xmlMemSetup(_tracked_free, _tracked_malloc, _tracked_realloc, _tracked_strdup);
+}
+
+/* Returns the number of bytes currently allocated by libxml2. */
+size_t libxmlutil_memory_in_use(void)
+{
+  gsize in_use;
+
+  g_mutex_lock(&_memory_lock);
+  in_use = _memory_in_use;
+  g_mutex_unlock(&_memory_lock);
+
+  return in_use;
+}
+
+/* Resets the peak to the number of bytes currently allocated and returns
+   it. */
+size_t libxmlutil_memory_reset_peak(void)
+{
+  gsize in_use;
+
+  g_mutex_lock(&_memory_lock);
+  in_use = _memory_in_use;
+  _memory_peak = in_use;
+  g_mutex_unlock(&_memory_lock);
+
+  return in_use;
+}
+
+/* Returns the largest number of bytes allocated by libxml2 at any time
+   since the peak was last reset. */
+size_t libxmlutil_memory_peak(void)
+{
+  gsize peak;
+
+  g_mutex_lock(&_memory_lock);
+  peak = _memory_peak;
+  g_mutex_unlock(&_memory_lock);
+
+  return peak;
+}
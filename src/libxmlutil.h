@@ -33,5 +33,9 @@ void libxmlutil_iterate_by_tag_name(const xmlNode *node, const char *name, void
                                     void(*f)(const void *user_data, int i, const xmlNode *node));
 const xmlNode *libxmlutil_child_node_by_name(const xmlNode *node, const char *ns,
                                              const char *name);
+int libxmlutil_track_memory(void);
+size_t libxmlutil_memory_in_use(void);
+size_t libxmlutil_memory_reset_peak(void);
+size_t libxmlutil_memory_peak(void);
 
 #endif /* LIBXMLUTIL_H */
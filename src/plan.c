@@ -0,0 +1,338 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include "channel.h"
+#include "plan.h"
+#include "utils.h"
+
+/* A plan is stored as an XML file with a channel element for each
+   channel and an enclosure element for each enclosure to download:
+
+     <plan version="1.0" created="..." bytes="..." unknown="...">
+       <channel identifier="..." title="..." bytes="..." unknown="...">
+         <enclosure url="..." filename="..." type="..." length="..."
+                    pubdate="...">
+           <mirror url="..."/>
+         </enclosure>
+       </channel>
+     </plan>
+
+   The byte counts are totals of the enclosures with a known length and
+   the unknown counts are the number of enclosures without one. They are
+   there for the reader's benefit and are ignored when the plan is read
+   back. */
+
+plan *plan_new(void)
+{
+  plan *p = g_malloc(sizeof(plan));
+
+  p->channels = g_ptr_array_new();
+
+  return p;
+}
+
+static void _plan_channel_free(plan_channel *pc)
+{
+  g_free(pc->identifier);
+  g_free(pc->title);
+  g_ptr_array_free(pc->enclosures, TRUE);
+  g_free(pc);
+}
+
+void plan_free(plan *p)
+{
+  int i;
+
+  for (i = 0; i < p->channels->len; i++)
+    _plan_channel_free(g_ptr_array_index(p->channels, i));
+
+  g_ptr_array_free(p->channels, TRUE);
+  g_free(p);
+}
+
+/* Adds a channel to a plan. The plan takes ownership of the enclosures,
+   which must have been created with enclosure_copy(). */
+plan_channel *plan_add_channel(plan *p, const gchar *identifier, const gchar *title,
+                               GPtrArray *enclosures)
+{
+  plan_channel *pc = g_malloc(sizeof(plan_channel));
+
+  pc->identifier = g_strdup(identifier);
+  pc->title = g_strdup(title);
+  pc->enclosures = enclosures;
+
+  g_ptr_array_add(p->channels, pc);
+
+  return pc;
+}
+
+/* Returns the total size of the enclosures with a known length. If
+   unknown is not NULL, it is set to the number of enclosures without
+   one. */
+gint64 plan_channel_bytes(const plan_channel *pc, int *unknown)
+{
+  enclosure *e;
+  gint64 bytes = 0;
+  int i, n = 0;
+
+  for (i = 0; i < pc->enclosures->len; i++) {
+    e = g_ptr_array_index(pc->enclosures, i);
+
+    if (e->length >= 0)
+      bytes += e->length;
+    else
+      n++;
+  }
+
+  if (unknown)
+    *unknown = n;
+
+  return bytes;
+}
+
+static void _print_attr(FILE *f, const gchar *name, const gchar *value)
+{
+  gchar *escaped;
+
+  if (!value)
+    return;
+
+  escaped = g_markup_escape_text(value, -1);
+  g_fprintf(f, " %s=\"%s\"", name, escaped);
+  g_free(escaped);
+}
+
+static int _write_plan(FILE *f, gpointer user_data, int debug)
+{
+  plan *p = (plan *)user_data;
+  plan_channel *pc;
+  enclosure *e;
+  gint64 bytes, total_bytes = 0;
+  int i, j, k, unknown, total_unknown = 0;
+  gchar *created, *pub_date;
+
+  for (i = 0; i < p->channels->len; i++) {
+    total_bytes += plan_channel_bytes(g_ptr_array_index(p->channels, i), &unknown);
+    total_unknown += unknown;
+  }
+
+  created = get_rfc822_time();
+
+  g_fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  g_fprintf(f, "<plan version=\"1.0\"");
+  _print_attr(f, "created", created);
+  g_fprintf(f, " bytes=\"%" G_GINT64_FORMAT "\" unknown=\"%d\">\n", total_bytes,
+            total_unknown);
+
+  g_free(created);
+
+  for (i = 0; i < p->channels->len; i++) {
+    pc = g_ptr_array_index(p->channels, i);
+    bytes = plan_channel_bytes(pc, &unknown);
+
+    g_fprintf(f, "  <channel");
+    _print_attr(f, "identifier", pc->identifier);
+    _print_attr(f, "title", pc->title);
+    g_fprintf(f, " bytes=\"%" G_GINT64_FORMAT "\" unknown=\"%d\">\n", bytes, unknown);
+
+    for (j = 0; j < pc->enclosures->len; j++) {
+      e = g_ptr_array_index(pc->enclosures, j);
+
+      g_fprintf(f, "    <enclosure");
+      _print_attr(f, "url", e->url);
+      _print_attr(f, "filename", e->filename);
+      _print_attr(f, "type", e->type);
+
+      if (e->length >= 0)
+        g_fprintf(f, " length=\"%ld\"", e->length);
+
+      if (e->pub_date != (time_t)-1) {
+        pub_date = format_rfc822_time(e->pub_date);
+        _print_attr(f, "pubdate", pub_date);
+        g_free(pub_date);
+      }
+
+      if (e->mirrors) {
+        g_fprintf(f, ">\n");
+
+        for (k = 0; k < e->mirrors->len; k++) {
+          g_fprintf(f, "      <mirror");
+          _print_attr(f, "url", g_ptr_array_index(e->mirrors, k));
+          g_fprintf(f, "/>\n");
+        }
+
+        g_fprintf(f, "    </enclosure>\n");
+      } else
+        g_fprintf(f, "/>\n");
+    }
+
+    g_fprintf(f, "  </channel>\n");
+  }
+
+  g_fprintf(f, "</plan>\n");
+
+  return ferror(f) ? -1 : 0;
+}
+
+/* Writes a plan to a file, replacing it atomically. */
+int plan_write(plan *p, const gchar *filename, int debug)
+{
+  if (write_by_temporary_file(filename, _write_plan, p, NULL, debug)) {
+    fprintf(stderr, "Error writing plan file %s.\n", filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Returns a copy of an attribute of a node, or NULL if it is not set. */
+static gchar *_dup_prop(xmlNode *node, const char *name)
+{
+  xmlChar *s;
+  gchar *value;
+
+  s = xmlGetProp(node, (const xmlChar *)name);
+
+  if (!s)
+    return NULL;
+
+  value = g_strdup((const gchar *)s);
+  xmlFree(s);
+
+  return value;
+}
+
+static void _read_mirrors(xmlNode *node, enclosure *e)
+{
+  gchar *url;
+
+  for (node = node->children; node; node = node->next) {
+    if (node->type != XML_ELEMENT_NODE || strcmp((char *)node->name, "mirror"))
+      continue;
+
+    url = _dup_prop(node, "url");
+
+    if (!url)
+      continue;
+
+    if (!e->mirrors)
+      e->mirrors = g_ptr_array_new_with_free_func(g_free);
+
+    g_ptr_array_add(e->mirrors, url);
+  }
+}
+
+static void _read_enclosures(xmlNode *node, GPtrArray *enclosures)
+{
+  enclosure *e;
+  gchar *length, *pub_date;
+
+  for (node = node->children; node; node = node->next) {
+    if (node->type != XML_ELEMENT_NODE || strcmp((char *)node->name, "enclosure"))
+      continue;
+
+    e = g_malloc(sizeof(enclosure));
+    e->url = _dup_prop(node, "url");
+    e->filename = _dup_prop(node, "filename");
+    e->type = _dup_prop(node, "type");
+    e->pub_date = (time_t)-1;
+    e->mirrors = NULL;
+
+    length = _dup_prop(node, "length");
+    e->length = length ? strtol(length, NULL, 10) : -1;
+    g_free(length);
+
+    pub_date = _dup_prop(node, "pubdate");
+
+    if (pub_date) {
+      e->pub_date = parse_rfc822_time(pub_date);
+      g_free(pub_date);
+    }
+
+    if (!e->url || !e->filename) {
+      enclosure_free(e);
+      continue;
+    }
+
+    _read_mirrors(node, e);
+    g_ptr_array_add(enclosures, e);
+  }
+}
+
+/* Reads a plan written by plan_write(). Returns NULL if the file cannot
+   be read. */
+plan *plan_read(const gchar *filename)
+{
+  xmlDocPtr doc;
+  xmlNode *root, *node;
+  GPtrArray *enclosures;
+  gchar *identifier, *title;
+  plan *p;
+
+  doc = xmlReadFile(filename, NULL, 0);
+
+  if (!doc) {
+    fprintf(stderr, "Error parsing plan file %s.\n", filename);
+    return NULL;
+  }
+
+  root = xmlDocGetRootElement(doc);
+
+  if (!root || strcmp((char *)root->name, "plan")) {
+    fprintf(stderr, "Error parsing plan file %s.\n", filename);
+    xmlFreeDoc(doc);
+    return NULL;
+  }
+
+  p = plan_new();
+
+  for (node = root->children; node; node = node->next) {
+    if (node->type != XML_ELEMENT_NODE || strcmp((char *)node->name, "channel"))
+      continue;
+
+    identifier = _dup_prop(node, "identifier");
+
+    if (!identifier)
+      continue;
+
+    title = _dup_prop(node, "title");
+    enclosures = g_ptr_array_new_with_free_func((GDestroyNotify)enclosure_free);
+    _read_enclosures(node, enclosures);
+
+    plan_add_channel(p, identifier, title, enclosures);
+
+    g_free(identifier);
+    g_free(title);
+  }
+
+  xmlFreeDoc(doc);
+
+  return p;
+}
@@ -0,0 +1,44 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <glib.h>
+
+/* The enclosures that would be downloaded from a channel. */
+typedef struct _plan_channel {
+  gchar *identifier;
+  gchar *title;
+  GPtrArray *enclosures;
+} plan_channel;
+
+typedef struct _plan {
+  GPtrArray *channels;
+} plan;
+
+plan *plan_new(void);
+void plan_free(plan *p);
+plan_channel *plan_add_channel(plan *p, const gchar *identifier, const gchar *title,
+                               GPtrArray *enclosures);
+gint64 plan_channel_bytes(const plan_channel *pc, int *unknown);
+int plan_write(plan *p, const gchar *filename, int debug);
+plan *plan_read(const gchar *filename);
+
+#endif /* PLAN_H */
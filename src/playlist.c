@@ -0,0 +1,271 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "playlist.h"
+#include "utils.h"
+
+/* Entries added to a playlist are held in memory and appended to the
+   playlist file when the writer is flushed, so that a playlist shared by
+   several channels is opened once and synchronised once per commit.
+
+   If duplicates are to be dropped, the entries already in a playlist file
+   are read into an index the first time an entry is added to it. Later
+   entries are checked against the index rather than the file. */
+
+typedef struct _playlist {
+  gchar *filename;
+  FILE *f;
+  GString *pending;
+  GHashTable *index;
+} playlist;
+
+static void _playlist_free(playlist *p)
+{
+  if (p->f)
+    fclose(p->f);
+
+  g_string_free(p->pending, TRUE);
+
+  if (p->index)
+    g_hash_table_destroy(p->index);
+
+  g_free(p->filename);
+  g_free(p);
+}
+
+/* Reads the entries in an existing playlist file into the index. A
+   missing file is an empty playlist. */
+static int _playlist_load_index(playlist *p)
+{
+  gchar *contents;
+  gchar **lines;
+  GError *error = NULL;
+  int i;
+
+  p->index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  if (!g_file_get_contents(p->filename, &contents, NULL, &error)) {
+    if (g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      g_error_free(error);
+      return 0;
+    }
+
+    fprintf(stderr, "Error reading playlist file %s: %s.\n",
+            p->filename, error->message);
+    g_error_free(error);
+    return -1;
+  }
+
+  lines = g_strsplit(contents, "\n", -1);
+  g_free(contents);
+
+  for (i = 0; lines[i]; i++)
+    if (*lines[i])
+      g_hash_table_add(p->index, g_strdup(lines[i]));
+
+  g_strfreev(lines);
+
+  return 0;
+}
+
+static playlist *_playlist_lookup(playlist_writer *w, const gchar *playlist_file)
+{
+  playlist *p;
+
+  p = g_hash_table_lookup(w->playlists, playlist_file);
+
+  if (!p) {
+    p = g_malloc(sizeof(playlist));
+    p->filename = g_strdup(playlist_file);
+    p->f = NULL;
+    p->pending = g_string_new(NULL);
+    p->index = NULL;
+
+    if (w->dedupe && _playlist_load_index(p)) {
+      _playlist_free(p);
+      return NULL;
+    }
+
+    g_hash_table_insert(w->playlists, p->filename, p);
+  }
+
+  return p;
+}
+
+playlist_writer *playlist_writer_new(int dedupe)
+{
+  playlist_writer *w = g_malloc(sizeof(playlist_writer));
+
+  g_mutex_init(&w->lock);
+  w->playlists = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify)_playlist_free);
+  w->dedupe = dedupe;
+
+  return w;
+}
+
+/* Queues an entry for a playlist. Safe to call from any thread. */
+int playlist_writer_add(playlist_writer *w, const gchar *playlist_file,
+                        const gchar *media_file)
+{
+  playlist *p;
+  int ret = 0;
+
+  g_mutex_lock(&w->lock);
+
+  p = _playlist_lookup(w, playlist_file);
+
+  if (!p)
+    ret = -1;
+  else if (!p->index || !g_hash_table_contains(p->index, media_file)) {
+    if (p->index)
+      g_hash_table_add(p->index, g_strdup(media_file));
+
+    g_string_append(p->pending, media_file);
+    g_string_append_c(p->pending, '\n');
+  }
+
+  g_mutex_unlock(&w->lock);
+
+  return ret;
+}
+
+static int _playlist_flush(playlist *p, int sync)
+{
+  if (!p->pending->len)
+    return 0;
+
+  if (!p->f) {
+    p->f = fopen(p->filename, "a");
+
+    if (!p->f) {
+      fprintf(stderr, "Error opening playlist file %s: %s.\n",
+              p->filename, strerror(errno));
+      return -1;
+    }
+  }
+
+  if (fwrite(p->pending->str, 1, p->pending->len, p->f) != p->pending->len ||
+      (sync ? sync_stream(p->f) : fflush(p->f))) {
+    fprintf(stderr, "Error writing playlist file %s: %s.\n",
+            p->filename, strerror(errno));
+    return -1;
+  }
+
+  g_string_truncate(p->pending, 0);
+
+  return 0;
+}
+
+/* Appends queued entries to their playlist files. If sync is set, the
+   files are also flushed to disk, which is left to the end of a commit
+   group rather than done for every entry. */
+int playlist_writer_flush(playlist_writer *w, int sync)
+{
+  GHashTableIter iter;
+  gpointer value;
+  int ret = 0;
+
+  g_mutex_lock(&w->lock);
+
+  g_hash_table_iter_init(&iter, w->playlists);
+
+  while (g_hash_table_iter_next(&iter, NULL, &value))
+    if (_playlist_flush((playlist *)value, sync))
+      ret = -1;
+
+  g_mutex_unlock(&w->lock);
+
+  return ret;
+}
+
+struct playlist_rewrite {
+  gchar **lines;
+  GHashTable *moves;
+};
+
+static int _write_rewritten_playlist(FILE *f, gpointer user_data, int debug)
+{
+  struct playlist_rewrite *r = (struct playlist_rewrite *)user_data;
+  const gchar *line;
+  int i;
+
+  for (i = 0; r->lines[i]; i++) {
+    /* The text after the last newline is not an entry. */
+    if (!r->lines[i + 1] && !*r->lines[i])
+      break;
+
+    line = g_hash_table_lookup(r->moves, r->lines[i]);
+    fprintf(f, "%s\n", line ? line : r->lines[i]);
+  }
+
+  return ferror(f) ? -1 : 0;
+}
+
+/* Replaces the entries in a playlist file for media files that have been
+   moved, given a table of old and new paths, and replaces the file
+   atomically, keeping its mode so that players running as other users
+   can still read it. A missing file is left missing. */
+int playlist_rewrite(const gchar *playlist_file, GHashTable *moves, int debug)
+{
+  struct playlist_rewrite r;
+  gchar *contents;
+  GError *error = NULL;
+  int ret = 0;
+
+  if (!g_file_get_contents(playlist_file, &contents, NULL, &error)) {
+    if (g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      g_error_free(error);
+      return 0;
+    }
+
+    fprintf(stderr, "Error reading playlist file %s: %s.\n",
+            playlist_file, error->message);
+    g_error_free(error);
+    return -1;
+  }
+
+  r.lines = g_strsplit(contents, "\n", -1);
+  r.moves = moves;
+  g_free(contents);
+
+  if (write_by_temporary_file(playlist_file, _write_rewritten_playlist, &r, NULL, debug)) {
+    fprintf(stderr, "Error writing playlist file %s.\n", playlist_file);
+    ret = -1;
+  }
+
+  g_strfreev(r.lines);
+
+  return ret;
+}
+
+/* Frees the writer. Entries that have not been flushed are lost. */
+void playlist_writer_free(playlist_writer *w)
+{
+  g_hash_table_destroy(w->playlists);
+  g_mutex_clear(&w->lock);
+  g_free(w);
+}
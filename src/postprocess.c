@@ -0,0 +1,154 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include "postprocess.h"
+
+/* Downloaded files are processed by a pool of worker threads so that slow
+   work like rewriting tags overlaps with the next download. The
+   completion step is run in the order in which files were queued, one
+   file at a time, regardless of the order in which the workers finish. */
+
+typedef struct _postprocess_job {
+  guint64 sequence;
+  gchar *filename;
+  gpointer user_data;
+} postprocess_job;
+
+static void _postprocess_job_free(postprocess_job *job)
+{
+  g_free(job->filename);
+  g_free(job);
+}
+
+/* Completes every finished job that is next in line. Must be called with
+   the queue locked. */
+static void _complete_finished_jobs(postprocess_queue *q)
+{
+  postprocess_job *job;
+
+  while ((job = g_hash_table_lookup(q->finished, &q->next_completion))) {
+    g_hash_table_remove(q->finished, &q->next_completion);
+
+    if (q->complete)
+      q->complete(job->filename, job->user_data);
+
+    _postprocess_job_free(job);
+    q->next_completion++;
+  }
+
+  g_cond_broadcast(&q->completed);
+}
+
+static void _postprocess_job_finish(postprocess_queue *q, postprocess_job *job)
+{
+  g_mutex_lock(&q->lock);
+  g_hash_table_insert(q->finished, &job->sequence, job);
+  _complete_finished_jobs(q);
+  g_mutex_unlock(&q->lock);
+}
+
+static void _worker(gpointer data, gpointer user_data)
+{
+  postprocess_job *job = (postprocess_job *)data;
+  postprocess_queue *q = (postprocess_queue *)user_data;
+
+  if (q->process)
+    q->process(job->filename, job->user_data);
+
+  _postprocess_job_finish(q, job);
+}
+
+/* Creates a queue with at most max_workers worker threads. If max_workers
+   is 0, or the threads cannot be created, files are processed
+   synchronously when they are queued. */
+postprocess_queue *postprocess_queue_new(int max_workers, postprocess_func process,
+                                         postprocess_func complete)
+{
+  postprocess_queue *q;
+  GError *error = NULL;
+
+  q = g_malloc(sizeof(struct _postprocess_queue));
+  g_mutex_init(&q->lock);
+  g_cond_init(&q->completed);
+  q->next_job = 0;
+  q->next_completion = 0;
+  q->finished = g_hash_table_new(g_int64_hash, g_int64_equal);
+  q->process = process;
+  q->complete = complete;
+  q->pool = NULL;
+
+  if (max_workers > 0) {
+    q->pool = g_thread_pool_new(_worker, q, max_workers, FALSE, &error);
+
+    if (!q->pool) {
+      fprintf(stderr, "Error starting worker threads: %s\n", error->message);
+      g_error_free(error);
+    }
+  }
+
+  return q;
+}
+
+void postprocess_queue_push(postprocess_queue *q, const gchar *filename,
+                            gpointer user_data)
+{
+  postprocess_job *job;
+
+  job = g_malloc(sizeof(struct _postprocess_job));
+  job->sequence = q->next_job++;
+  job->filename = g_strdup(filename);
+  job->user_data = user_data;
+
+  if (q->pool)
+    g_thread_pool_push(q->pool, job, NULL);
+  else
+    _worker(job, q);
+}
+
+/* Waits for all files queued so far to be processed and completed. Must
+   be called from the thread that queues files. */
+void postprocess_queue_drain(postprocess_queue *q)
+{
+  g_mutex_lock(&q->lock);
+
+  while (q->next_completion < q->next_job)
+    g_cond_wait(&q->completed, &q->lock);
+
+  g_mutex_unlock(&q->lock);
+}
+
+/* Waits for all queued files to be processed and completed, then frees
+   the queue. */
+void postprocess_queue_free(postprocess_queue *q)
+{
+  if (q->pool)
+    g_thread_pool_free(q->pool, FALSE, TRUE);
+
+  g_assert(g_hash_table_size(q->finished) == 0);
+
+  g_hash_table_destroy(q->finished);
+  g_cond_clear(&q->completed);
+  g_mutex_clear(&q->lock);
+  g_free(q);
+}
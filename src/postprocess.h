@@ -0,0 +1,45 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include <glib.h>
+
+typedef void (*postprocess_func)(const gchar *filename, gpointer user_data);
+
+typedef struct _postprocess_queue {
+  GThreadPool *pool;
+  GMutex lock;
+  GCond completed;
+  guint64 next_job;
+  guint64 next_completion;
+  GHashTable *finished;
+  postprocess_func process;
+  postprocess_func complete;
+} postprocess_queue;
+
+postprocess_queue *postprocess_queue_new(int max_workers, postprocess_func process,
+                                         postprocess_func complete);
+void postprocess_queue_push(postprocess_queue *q, const gchar *filename,
+                            gpointer user_data);
+void postprocess_queue_drain(postprocess_queue *q);
+void postprocess_queue_free(postprocess_queue *q);
+
+#endif /* POSTPROCESS_H */
@@ -22,95 +22,368 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <stdio.h>
-#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <glib.h>
 #include "progress.h"
 
-/* This code was inspired/guided by the progress-bar implementation found in
- * curl (src/tool_cb_prg.c) by Daniel Stenberg, in turn building on an
- * implementation by Lars Aas. */
+/* The display shows a row for each active transfer and a row with the
+   total of all of them. Transfers only update their counters; a separate
+   thread redraws the display at a fixed rate, so writing to a slow
+   terminal never holds up a transfer. On a terminal the rows are redrawn
+   in place. Otherwise only the total is drawn, on a single line. A
+   display without a stream draws nothing and only feeds its listener.
 
-int progress_bar_cb(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
+   The layout of the bars was inspired by the progress-bar implementation
+   found in curl (src/tool_cb_prg.c) by Daniel Stenberg, in turn building
+   on an implementation by Lars Aas. */
+
+#define REDRAW_INTERVAL (G_TIME_SPAN_SECOND / 10)
+#define NAME_WIDTH 20
+#define DEFAULT_COLUMNS 80
+
+/* Width of everything on a row except the bar itself. */
+#define FIXED_WIDTH (NAME_WIDTH + 3 + 5 + 12 + 10)
+
+struct _progress_display {
+  FILE *f;
+  gboolean rows;
+  int columns;
+
+  GMutex lock;
+  GCond cond;
+  GThread *thread;
+  gboolean stop;
+  gboolean dirty;
+  GPtrArray *bars;
+  gint64 finished_bytes;
+  gint64 last_redraw;
+  guint64 renders;
+  progress_listener listener;
+  gpointer listener_data;
+  gint64 listener_interval;
+  gint64 last_notified;
+
+  /* Serialises writes to the terminal. Never held together with lock. */
+  GMutex output_lock;
+  int lines_drawn;
+  guint64 last_drawn;
+};
+
+static void _format_bytes(gchar *buffer, gsize size, double bytes)
 {
+  if (bytes >= 1024.0 * 1024.0 * 1024.0)
+    g_snprintf(buffer, size, "%.1f GB", bytes / (1024.0 * 1024.0 * 1024.0));
+  else if (bytes >= 1024.0 * 1024.0)
+    g_snprintf(buffer, size, "%.1f MB", bytes / (1024.0 * 1024.0));
+  else if (bytes >= 1024.0)
+    g_snprintf(buffer, size, "%.1f kB", bytes / 1024.0);
+  else
+    g_snprintf(buffer, size, "%.0f B", bytes);
+}
+
+static void _append_row(GString *s, int columns, const gchar *name, gint64 position,
+                        gint64 total, double rate, gboolean eta)
+{
+  gchar rate_string[16], eta_string[16] = "";
+  int bar_width, num, i;
   double fraction;
-  int num;
-  int i;
+  gint64 remaining;
 
-  progress_bar *pb = (progress_bar *)clientp;
+  fraction = total > 0 ? MIN((double)position / (double)total, 1.0) : 0.0;
+  bar_width = MAX(0, columns - 1 - FIXED_WIDTH);
+  num = (int)(bar_width * fraction);
 
-  /* We expect ultotal and ulnow to be 0 since we never upload anything. */
-  g_assert(ultotal == 0);
-  g_assert(ulnow == 0);
+  _format_bytes(rate_string, sizeof(rate_string), rate);
 
-  if (pb->width > 0) {
-    if (dltotal == 0.0) {
-      fraction = 0.0;
-      num = 0;
-    } else {
-      long total;
-      long position;
+  if (eta && total > 0 && rate > 0.0) {
+    remaining = (gint64)((total - MIN(position, total)) / rate);
+    g_snprintf(eta_string, sizeof(eta_string), "%d:%02d:%02d",
+               (int)(remaining / 3600), (int)(remaining / 60 % 60), (int)(remaining % 60));
+  }
 
-      total = (long)dltotal + pb->resume_from;
-      position = MIN((long)dlnow + pb->resume_from, total);
+  g_string_append_printf(s, "%-*.*s [", NAME_WIDTH, NAME_WIDTH, name);
 
-      fraction = (double)position/(double)total;
-      num = (int)((double)pb->width * fraction);
-    }
+  for (i = 0; i < bar_width; i++)
+    g_string_append_c(s, i < num ? '#' : ' ');
 
-    if (num != pb->previous_num) {
-      for (i = 0; i < pb->width; i++)
-        pb->buffer[i] = (i < num ? '#' : ' ');
+  g_string_append_printf(s, "] %3d%% %9s/s %9s", (int)(fraction * 100.0), rate_string,
+                         eta_string);
+}
+
+/* Updates transfer rates, passes them on to the listener when it is due,
+   and renders the display. Renders are numbered
+   so that one that is overtaken on its way to the terminal can be
+   dropped. Must be called with the display locked. */
+static GString *_render(progress_display *d, gint64 time, guint64 *number)
+{
+  GString *s;
+  progress_bar *pb;
+  gint64 position = d->finished_bytes, total = d->finished_bytes;
+  double elapsed, rate = 0.0;
+  gchar *name;
+  gboolean notify;
+  guint i;
+
+  notify = d->listener && time - d->last_notified >= d->listener_interval;
+
+  if (notify)
+    d->last_notified = time;
 
-      pb->buffer[pb->width] = 0;
+  s = g_string_new(NULL);
+  *number = ++d->renders;
+  elapsed = (double)(time - d->last_redraw) / G_TIME_SPAN_SECOND;
+  d->last_redraw = time;
 
-      fprintf(pb->f, "\r%s %3d%%", pb->buffer, (int)(fraction * 100.0));
-      fflush(pb->f);
+  for (i = 0; i < d->bars->len; i++) {
+    pb = g_ptr_array_index(d->bars, i);
 
-      pb->previous_num = num;
+    /* Smooth the rate over the last few redraws. */
+    if (elapsed > 0.0)
+      pb->rate = 0.7 * pb->rate + 0.3 * (pb->now - pb->last_now) / elapsed;
+
+    pb->last_now = pb->now;
+
+    if (notify)
+      d->listener(d->listener_data, pb->name, pb->resume_from + pb->now,
+                  pb->total ? pb->resume_from + pb->total : 0, pb->rate);
+
+    position += pb->resume_from + pb->now;
+    total += pb->resume_from + (pb->total ? pb->total : pb->now);
+    rate += pb->rate;
+
+    if (d->rows) {
+      _append_row(s, d->columns, pb->name, pb->resume_from + pb->now,
+                  pb->total ? pb->resume_from + pb->total : 0, pb->rate, FALSE);
+      g_string_append(s, "\033[K\n");
     }
   }
 
-  return 0;
+  name = g_strdup_printf("total (%u)", d->bars->len);
+  _append_row(s, d->columns, name, position, total, rate, TRUE);
+  g_free(name);
+
+  return s;
+}
+
+/* Writes a rendered display, replacing the one drawn before. */
+static void _draw(progress_display *d, GString *s, guint64 number, gboolean final)
+{
+  int lines = 0;
+  gsize i;
+
+  if (!d->f)
+    return;
+
+  g_mutex_lock(&d->output_lock);
+
+  if (number < d->last_drawn) {
+    g_mutex_unlock(&d->output_lock);
+    return;
+  }
+
+  d->last_drawn = number;
+
+  if (d->rows) {
+    if (d->lines_drawn > 0)
+      fprintf(d->f, "\r\033[%dA", d->lines_drawn);
+
+    for (i = 0; i < s->len; i++)
+      if (s->str[i] == '\n')
+        lines++;
+
+    fprintf(d->f, "\r%s\033[K\033[J", s->str);
+  } else
+    fprintf(d->f, "\r%s", s->str);
+
+  if (final) {
+    fputc('\n', d->f);
+    d->lines_drawn = 0;
+  } else
+    d->lines_drawn = lines;
+
+  fflush(d->f);
+
+  g_mutex_unlock(&d->output_lock);
 }
 
-progress_bar *progress_bar_new(long resume_from)
+static gpointer _redraw_thread(gpointer data)
 {
-  progress_bar *pb;
-  gchar **environ;
-  const gchar *columns;
+  progress_display *d = (progress_display *)data;
+  gint64 end_time;
+  guint64 number;
+  GString *s;
 
-  pb = (progress_bar *)g_malloc(sizeof(struct _progress_bar));
-  pb->resume_from = resume_from;
-  pb->f = stdout;
-  pb->width = 79;
-  pb->previous_num = -1;
+  g_mutex_lock(&d->lock);
 
-  /* Try to grab the COLUMNS environment variable to initialize pb->with with a suitable value. */
-  environ = g_get_environ();
-  g_environ_getenv(environ, "COLUMNS");
+  while (!d->stop) {
+    end_time = g_get_monotonic_time() + REDRAW_INTERVAL;
+
+    while (!d->stop && g_cond_wait_until(&d->cond, &d->lock, end_time))
+      ;
+
+    if (d->stop || !d->dirty || !d->bars->len)
+      continue;
+
+    d->dirty = FALSE;
+    s = _render(d, g_get_monotonic_time(), &number);
+
+    g_mutex_unlock(&d->lock);
+    _draw(d, s, number, FALSE);
+    g_string_free(s, TRUE);
+    g_mutex_lock(&d->lock);
+  }
+
+  g_mutex_unlock(&d->lock);
+
+  return NULL;
+}
+
+static int _terminal_columns(void)
+{
+  const gchar *columns;
+  gchar *endptr;
+  long num;
+
+  columns = g_getenv("COLUMNS");
 
   if (columns) {
-    char *endptr;
-    long num = strtol(columns, &endptr, 10);
-    if ((endptr != columns) && (endptr == columns + g_strlen(columns)) && (num > 0)) {
-      pb->width = MIN(pb->width, (int)num); /* restrict width of progress bar to avoid insane values */
-    }
+    num = strtol(columns, &endptr, 10);
+
+    /* Restrict the width to avoid insane values. */
+    if (endptr != columns && *endptr == '\0' && num > 0)
+      return (int)MIN(num, 200);
   }
 
-  g_strfreev(environ);
+  return DEFAULT_COLUMNS;
+}
+
+/* Creates a display that draws on a stream, or that draws nothing if the
+   stream is NULL. */
+progress_display *progress_display_new(FILE *f)
+{
+  progress_display *d;
+
+  d = g_malloc(sizeof(progress_display));
+  d->f = f;
+  d->rows = f && isatty(fileno(f));
+  d->columns = _terminal_columns();
+
+  g_mutex_init(&d->lock);
+  g_cond_init(&d->cond);
+  d->stop = FALSE;
+  d->dirty = FALSE;
+  d->bars = g_ptr_array_new();
+  d->finished_bytes = 0;
+  d->last_redraw = g_get_monotonic_time();
+  d->renders = 0;
+  d->listener = NULL;
+  d->listener_data = NULL;
+  d->listener_interval = 0;
+  d->last_notified = 0;
 
-  /* Leave a margin for printing the percentages (the longest string is " 100%") */
-  pb->width = MAX(0, pb->width - 5);
+  g_mutex_init(&d->output_lock);
+  d->lines_drawn = 0;
+  d->last_drawn = 0;
 
-  /* Allocate space for progress bar string + terminating zero. */
-  pb->buffer = g_malloc(pb->width + 1);
+  d->thread = g_thread_new("progress", _redraw_thread, d);
+
+  return d;
+}
+
+void progress_display_free(progress_display *d)
+{
+  g_mutex_lock(&d->lock);
+  d->stop = TRUE;
+  g_cond_signal(&d->cond);
+  g_mutex_unlock(&d->lock);
+
+  g_thread_join(d->thread);
+
+  g_ptr_array_free(d->bars, TRUE);
+  g_cond_clear(&d->cond);
+  g_mutex_clear(&d->lock);
+  g_mutex_clear(&d->output_lock);
+  g_free(d);
+}
+
+/* Sets a function to receive the state of active transfers every
+   interval microseconds. */
+void progress_display_set_listener(progress_display *d, progress_listener listener,
+                                   gpointer user_data, gint64 interval)
+{
+  g_mutex_lock(&d->lock);
+  d->listener = listener;
+  d->listener_data = user_data;
+  d->listener_interval = interval;
+  g_mutex_unlock(&d->lock);
+}
+
+/* Adds a transfer to the display. */
+progress_bar *progress_bar_new(progress_display *d, const gchar *name, long resume_from)
+{
+  progress_bar *pb;
+
+  pb = g_malloc(sizeof(progress_bar));
+  pb->display = d;
+  pb->name = g_strdup(name);
+  pb->resume_from = resume_from;
+  pb->total = 0;
+  pb->now = 0;
+  pb->last_now = 0;
+  pb->rate = 0.0;
+
+  g_mutex_lock(&d->lock);
+
+  /* Start the totals afresh when a new batch of transfers begins. */
+  if (!d->bars->len)
+    d->finished_bytes = 0;
+
+  g_ptr_array_add(d->bars, pb);
+  d->dirty = TRUE;
+  g_mutex_unlock(&d->lock);
 
   return pb;
 }
 
+/* Records the progress of a transfer. Called from the transfer's thread
+   and does not write anything. */
+void progress_bar_update(progress_bar *pb, gint64 dltotal, gint64 dlnow)
+{
+  progress_display *d = pb->display;
+
+  g_mutex_lock(&d->lock);
+  pb->total = dltotal;
+  pb->now = dlnow;
+  d->dirty = TRUE;
+  g_mutex_unlock(&d->lock);
+}
+
+/* Removes a transfer from the display. When the last active transfer is
+   removed, the display is drawn one last time and left on screen. */
 void progress_bar_free(progress_bar *pb)
 {
-  fprintf(pb->f, "\n"); /* Make sure that we will start output on a new line. */
-  g_free(pb->buffer);
+  progress_display *d = pb->display;
+  GString *s = NULL;
+  guint64 number;
+
+  g_mutex_lock(&d->lock);
+
+  if (d->bars->len == 1)
+    s = _render(d, g_get_monotonic_time(), &number);
+
+  g_ptr_array_remove(d->bars, pb);
+  d->finished_bytes += pb->resume_from + pb->now;
+  d->dirty = TRUE;
+
+  g_mutex_unlock(&d->lock);
+
+  if (s) {
+    _draw(d, s, number, TRUE);
+    g_string_free(s, TRUE);
+  }
+
+  g_free(pb->name);
   g_free(pb);
 }
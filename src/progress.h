@@ -1,5 +1,5 @@
 /*
-  Copyright (C) 2005, 2007, 2011 Marius L. Jøhndal
+  Copyright (C) 2013 Marius L. Jøhndal
 
   This library is free software; you can redistribute it and/or
   modify it under the terms of the GNU Lesser General Public
@@ -20,16 +20,32 @@
 #ifndef PROGRESS_H
 #define PROGRESS_H
 
+#include <stdio.h>
+#include <glib.h>
+
+typedef struct _progress_display progress_display;
+
+/* Receives the state of each active transfer at most once per interval.
+   Called with the display locked, so it must not block. */
+typedef void (*progress_listener)(gpointer user_data, const gchar *name, gint64 position,
+                                  gint64 total, double rate);
+
 typedef struct _progress_bar {
-  FILE *f;
-  long resume_from;
-  int width;
-  int previous_num;
-  char *buffer;
+  progress_display *display;
+  gchar *name;
+  gint64 resume_from;
+  gint64 total;
+  gint64 now;
+  gint64 last_now;
+  double rate;
 } progress_bar;
 
-progress_bar *progress_bar_new(long resume_from);
-void progress_bar_end(progress_bar *pb);
-int progress_bar_cb(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+progress_display *progress_display_new(FILE *f);
+void progress_display_free(progress_display *d);
+void progress_display_set_listener(progress_display *d, progress_listener listener,
+                                   gpointer user_data, gint64 interval);
+progress_bar *progress_bar_new(progress_display *d, const gchar *name, long resume_from);
+void progress_bar_update(progress_bar *pb, gint64 dltotal, gint64 dlnow);
+void progress_bar_free(progress_bar *pb);
 
 #endif /* PROGRESS_H */
@@ -47,12 +47,194 @@ static char *_dup_child_node_value(const xmlNode *node, const gchar *tag)
     return NULL;
 }
 
+static gboolean _is_mrss_content(const xmlNode *node)
+{
+  return node->type == XML_ELEMENT_NODE && !strcmp((char *)node->name, "content") &&
+    node->ns && !strcmp((char *)node->ns->href, MRSS_NAMESPACE);
+}
+
+/* Adds the URL of a media:content or enclosure node as a mirror of an
+   enclosure whose media has the given bitrate, or -1 if it is not
+   known. Only a node of the same size, type and bitrate describes the
+   same media elsewhere rather than another rendition of it, so nodes
+   that do not give a size are never taken as mirrors. */
+static void _add_mirror(enclosure *e, long bitrate, const xmlNode *node,
+                        const char *length_attr)
+{
+  char *url, *type;
+  long length, node_bitrate;
+  int i;
+
+  url = libxmlutil_dup_attr(node, "url");
+  type = libxmlutil_dup_attr(node, "type");
+  length = libxmlutil_attr_as_long(node, length_attr);
+  node_bitrate = _is_mrss_content(node) ? libxmlutil_attr_as_long(node, "bitrate") : -1;
+
+  if (url && strcmp(url, e->url) && !(type && e->type && strcmp(type, e->type)) &&
+      length > 0 && length == e->length &&
+      !(node_bitrate > 0 && bitrate > 0 && node_bitrate != bitrate)) {
+    if (!e->mirrors)
+      e->mirrors = g_ptr_array_new_with_free_func(g_free);
+
+    for (i = 0; i < e->mirrors->len; i++)
+      if (!strcmp(url, g_ptr_array_index(e->mirrors, i)))
+        break;
+
+    if (i == e->mirrors->len)
+      g_ptr_array_add(e->mirrors, g_strdup(url));
+  }
+
+  free(url);
+  free(type);
+}
+
+/* Collects the media:content nodes directly under a node as mirrors. */
+static void _add_mrss_mirrors(enclosure *e, long bitrate, const xmlNode *node)
+{
+  for (node = node->children; node; node = node->next)
+    if (_is_mrss_content(node))
+      _add_mirror(e, bitrate, node, "fileSize");
+}
+
+struct rss_parse {
+  rss_file *f;
+  const media_selection *selection;
+};
+
+/* Returns the position of the first of the preferred types that a type
+   matches, or -1 if it matches none of them. A preferred type may end in
+   an asterisk to match any subtype. Any type matches an empty list. */
+static int _type_preference(const char *type, gchar **types)
+{
+  int i;
+  gsize n;
+
+  if (!types || !*types)
+    return 0;
+
+  if (!type)
+    return -1;
+
+  for (i = 0; types[i]; i++) {
+    n = strlen(types[i]);
+
+    if (n && types[i][n - 1] == '*' ? !g_ascii_strncasecmp(type, types[i], n - 1) :
+        !g_ascii_strcasecmp(type, types[i]))
+      return i;
+  }
+
+  return -1;
+}
+
+/* A rendition of an item's media, and how well it suits the rules. */
+struct variant {
+  const xmlNode *node;
+  gboolean acceptable;
+  int preference;
+  gint64 cost;
+};
+
+/* Works out the number of bytes a rendition will take, from its size or
+   else from its bitrate in kilobits per second and its duration in
+   seconds. Returns -1 if neither is known. */
+static struct variant _evaluate_variant(const xmlNode *node, const char *length_attr,
+                                        const media_selection *selection)
+{
+  struct variant v;
+  char *type;
+  long length, bitrate, duration;
+
+  type = libxmlutil_dup_attr(node, "type");
+  length = libxmlutil_attr_as_long(node, length_attr);
+  bitrate = _is_mrss_content(node) ? libxmlutil_attr_as_long(node, "bitrate") : -1;
+  duration = _is_mrss_content(node) ? libxmlutil_attr_as_long(node, "duration") : -1;
+
+  v.node = node;
+  v.preference = _type_preference(type, selection->mime_types);
+
+  if (length > 0)
+    v.cost = length;
+  else if (bitrate > 0 && duration > 0)
+    v.cost = (gint64)bitrate * 125 * duration;
+  else
+    v.cost = -1;
+
+  v.acceptable = v.preference >= 0 &&
+    !(selection->max_bitrate > 0 && bitrate > selection->max_bitrate) &&
+    !(selection->max_file_size > 0 && v.cost > selection->max_file_size);
+
+  free(type);
+
+  return v;
+}
+
+/* Returns TRUE if a rendition is a better choice than another: an
+   acceptable one over one that is not, then a more preferred type, then
+   a smaller size, with those of unknown size last. */
+static gboolean _better_variant(const struct variant *a, const struct variant *b)
+{
+  if (a->acceptable != b->acceptable)
+    return a->acceptable;
+
+  if (a->preference != b->preference)
+    return b->preference < 0 || (a->preference >= 0 && a->preference < b->preference);
+
+  if (a->cost != b->cost)
+    return b->cost < 0 || (a->cost >= 0 && a->cost < b->cost);
+
+  return FALSE;
+}
+
+static void _consider_variants(const xmlNode *node, const media_selection *selection,
+                               struct variant *best)
+{
+  struct variant v;
+
+  for (node = node->children; node; node = node->next)
+    if (_is_mrss_content(node)) {
+      v = _evaluate_variant(node, "fileSize", selection);
+
+      if (!best->node || _better_variant(&v, best))
+        *best = v;
+    }
+}
+
+/* Chooses the rendition of an item's media that best suits the rules,
+   among its media:content elements, those in its media:group elements
+   and its enclosure element. If no rendition is acceptable, the one of
+   the most preferred type is chosen, and the smallest of those. */
+static const xmlNode *_select_variant(const xmlNode *item, const xmlNode *encl,
+                                      const media_selection *selection)
+{
+  struct variant best = { NULL, FALSE, -1, -1 }, v;
+  const xmlNode *node;
+
+  _consider_variants(item, selection, &best);
+
+  for (node = item->children; node; node = node->next)
+    if (node->type == XML_ELEMENT_NODE && !strcmp((char *)node->name, "group") &&
+        node->ns && !strcmp((char *)node->ns->href, MRSS_NAMESPACE))
+      _consider_variants(node, selection, &best);
+
+  if (encl) {
+    v = _evaluate_variant(encl, "length", selection);
+
+    if (!best.node || _better_variant(&v, &best))
+      best = v;
+  }
+
+  return best.node;
+}
+
 static void _item_iterator(const void *user_data, int i, const xmlNode *node)
 {
-  rss_file *f = (rss_file *)user_data;
-  const xmlNode *encl;
+  const struct rss_parse *parse = (const struct rss_parse *)user_data;
+  rss_file *f = parse->f;
+  const xmlNode *encl, *chosen;
   const xmlNode *mrss_content;
   const xmlNode *mrss_group;
+  gchar *pub_date;
+  long bitrate;
 
   /* Allocate item structure. */
   f->items[i] = (rss_item *)malloc(sizeof(struct _rss_item));
@@ -80,17 +262,39 @@ static void _item_iterator(const void *user_data, int i, const xmlNode *node)
   /* Figure out if there is an "enclosure" tag here. */
   encl = libxmlutil_child_node_by_name(node, NULL, "enclosure");
 
+  /* With selection rules, the rendition is chosen among all of them
+     instead. */
+  if (parse->selection && (mrss_content || encl)) {
+    chosen = _select_variant(node, encl, parse->selection);
+
+    if (chosen != encl) {
+      mrss_content = chosen;
+      encl = NULL;
+    } else
+      mrss_content = NULL;
+  }
+
   if (mrss_content || encl) {
     f->items[i]->enclosure = (enclosure *)malloc(sizeof(struct _enclosure));
     f->items[i]->enclosure->url = NULL;
     f->items[i]->enclosure->length = 0;
     f->items[i]->enclosure->type = NULL;
+    f->items[i]->enclosure->pub_date = (time_t)-1;
+    f->items[i]->enclosure->mirrors = NULL;
+
+    pub_date = _dup_child_node_value(node, "pubDate");
+
+    if (pub_date) {
+      f->items[i]->enclosure->pub_date = parse_pub_date(pub_date);
+      free(pub_date);
+    }
 
     /* Now read attributes. Prefer mrss over enclosure. */
     if (mrss_content) {
       f->items[i]->enclosure->url = libxmlutil_dup_attr(mrss_content, "url");
       f->items[i]->enclosure->length = libxmlutil_attr_as_long(mrss_content, "fileSize");
-      f->items[i]->enclosure->type = libxmlutil_dup_attr(encl, "type");
+      f->items[i]->enclosure->type = parse->selection ?
+        libxmlutil_dup_attr(mrss_content, "type") : libxmlutil_dup_attr(encl, "type");
     }
 
     if (encl) {
@@ -103,6 +307,23 @@ static void _item_iterator(const void *user_data, int i, const xmlNode *node)
       if (!f->items[i]->enclosure->type)
         f->items[i]->enclosure->type = libxmlutil_dup_attr(encl, "type");
     }
+
+    /* Any other sources of the same media are kept as mirrors. */
+    if (f->items[i]->enclosure->url) {
+      bitrate = mrss_content ? libxmlutil_attr_as_long(mrss_content, "bitrate") : -1;
+
+      _add_mrss_mirrors(f->items[i]->enclosure, bitrate, node);
+
+      mrss_group = libxmlutil_child_node_by_name(node, MRSS_NAMESPACE, "group");
+
+      if (mrss_group)
+        _add_mrss_mirrors(f->items[i]->enclosure, bitrate, mrss_group);
+
+      encl = libxmlutil_child_node_by_name(node, NULL, "enclosure");
+
+      if (encl)
+        _add_mirror(f->items[i]->enclosure, bitrate, encl, "length");
+    }
   } else
     f->items[i]->enclosure = NULL;
 
@@ -119,12 +340,14 @@ static void _item_iterator(const void *user_data, int i, const xmlNode *node)
   }
 }
 
-static rss_file *rss_parse(const gchar *url, const xmlNode *root_element, gchar *fetched_time)
+static rss_file *rss_parse(const gchar *url, const xmlNode *root_element, gchar *fetched_time,
+                           const media_selection *selection)
 {
   const char *version_string;
   const xmlNode *channel;
   rss_file *f;
   enum rss_version version;
+  struct rss_parse parse;
 
   /* Do some sanity checking and extract the RSS version number. */
   if (strcmp((char *)root_element->name, "rss")) {
@@ -165,7 +388,9 @@ static rss_file *rss_parse(const gchar *url, const xmlNode *root_element, gchar
     f->channel_info.description = _dup_child_node_value(channel, "description");
     f->channel_info.language = _dup_child_node_value(channel, "language");
 
-    libxmlutil_iterate_by_tag_name(channel, "item", f, _item_iterator);
+    parse.f = f;
+    parse.selection = selection;
+    libxmlutil_iterate_by_tag_name(channel, "item", &parse, _item_iterator);
   } else
     f = NULL;
 
@@ -206,7 +431,9 @@ static xmlEntityPtr _get_entity(void *ctxt, const xmlChar *name)
   return entity;
 }
 
-rss_file *rss_open_file(const char *filename)
+/* Parses a feed. If selection is not NULL, it decides which rendition of
+   each item's media becomes the enclosure. */
+rss_file *rss_open_file(const char *filename, const media_selection *selection)
 {
   xmlParserCtxtPtr ctxt;
   xmlDocPtr doc;
@@ -246,7 +473,7 @@ rss_file *rss_open_file(const char *filename)
     return NULL;
   }
 
-  f = rss_parse(filename, root_element, fetched_time);
+  f = rss_parse(filename, root_element, fetched_time, selection);
 
   xmlFreeDoc(doc);
   xmlFreeParserCtxt(ctxt);
@@ -255,22 +482,115 @@ rss_file *rss_open_file(const char *filename)
   return f;
 }
 
+struct rss_fetch {
+  const char *url;
+  transfer_info *info;
+};
+
 static int _rss_open_url_cb(FILE *f, gpointer user_data, int debug)
 {
-  gchar *url = (gchar *)user_data;
+  struct rss_fetch *fetch = (struct rss_fetch *)user_data;
+
+  return urlget_file(fetch->url, f, debug, fetch->info);
+}
+
+/* Downloads a feed to a temporary file and returns its name. The caller
+   is responsible for unlinking and freeing it. If info is not NULL, it
+   is filled in with details of the transfer. */
+gchar *rss_fetch_url(const char *url, int debug, transfer_info *info)
+{
+  gchar *rss_filename;
+  struct rss_fetch fetch = { url, info };
 
-  return urlget_file(url, f, debug);
+  if (write_by_temporary_file(NULL, _rss_open_url_cb, &fetch, &rss_filename, debug))
+    return NULL;
+
+  return rss_filename;
 }
 
-rss_file *rss_open_url(const char *url, int debug)
+/* Downloads feeds to temporary files, up to parallel of them at a time.
+   Returns an array with the name of the temporary file for each feed, or
+   NULL for feeds that could not be downloaded. The caller is responsible
+   for unlinking and freeing the files and freeing the array. info, which
+   must have room for n transfers, is filled in with details of each
+   transfer. */
+gchar **rss_fetch_urls(const char **urls, int n, int parallel, int debug,
+                       transfer_info *info)
+{
+  urlget_request *requests;
+  gchar **filenames;
+  int *feed;
+  GError *error = NULL;
+  FILE *f;
+  int i, j, m = 0, fd;
+
+  requests = g_new0(urlget_request, n);
+  feed = g_new(int, n);
+  filenames = g_new0(gchar *, n);
+
+  for (i = 0; i < n; i++) {
+    if (info) {
+      memset(&info[i], 0, sizeof(transfer_info));
+      g_strlcpy(info[i].error, "could not open temporary file", sizeof(info[i].error));
+    }
+
+    fd = g_file_open_tmp(NULL, &filenames[i], &error);
+
+    if (fd < 0) {
+      g_fprintf(stderr, "Error opening temporary file: %s\n", error->message);
+      g_clear_error(&error);
+      filenames[i] = NULL;
+      continue;
+    }
+
+    f = fdopen(fd, "w");
+
+    if (!f) {
+      perror("Error opening temporary file stream");
+      close(fd);
+      unlink(filenames[i]);
+      g_free(filenames[i]);
+      filenames[i] = NULL;
+      continue;
+    }
+
+    requests[m].url = urls[i];
+    requests[m].f = f;
+    feed[m++] = i;
+  }
+
+  urlget_batch(requests, m, parallel, debug);
+
+  for (j = 0; j < m; j++) {
+    i = feed[j];
+
+    if (info)
+      info[i] = requests[j].info;
+
+    if ((fclose(requests[j].f) | requests[j].failed) != 0) {
+      unlink(filenames[i]);
+      g_free(filenames[i]);
+      filenames[i] = NULL;
+    }
+  }
+
+  g_free(feed);
+  g_free(requests);
+
+  return filenames;
+}
+
+rss_file *rss_open_url(const char *url, int debug, const media_selection *selection)
 {
   rss_file *f;
   gchar *rss_filename;
 
-  if (write_by_temporary_file(NULL, _rss_open_url_cb, (gpointer)url, &rss_filename, debug))
+  rss_filename = rss_fetch_url(url, debug, NULL);
+
+  if (!rss_filename)
     return NULL;
 
-  f = rss_open_file(rss_filename);
+  f = rss_open_file(rss_filename, selection);
 
   unlink(rss_filename);
   g_free(rss_filename);
@@ -296,6 +616,9 @@ void rss_close(rss_file *f)
       if (item->enclosure->filename)
         free(item->enclosure->filename);
 
+      if (item->enclosure->mirrors)
+        g_ptr_array_free(item->enclosure->mirrors, TRUE);
+
       free(item->enclosure);
     }
 
@@ -324,3 +647,41 @@ long rss_total_enclosure_size(rss_file *f)
 
   return n;
 }
+
+static gsize _string_size(const char *s)
+{
+  return s ? strlen(s) + 1 : 0;
+}
+
+/* Returns an estimate of the memory held by a parsed feed. */
+gsize rss_file_size(rss_file *f)
+{
+  int i;
+  rss_item *item;
+  gsize n;
+  guint j;
+
+  n = sizeof(rss_file) + f->num_items * sizeof(rss_item *) +
+    _string_size(f->channel_info.title) + _string_size(f->channel_info.link) +
+    _string_size(f->channel_info.description) + _string_size(f->channel_info.language) +
+    _string_size(f->fetched_time);
+
+  for (i = 0; i < f->num_items; i++) {
+    item = f->items[i];
+
+    n += sizeof(rss_item) + _string_size(item->title) + _string_size(item->link) +
+      _string_size(item->description);
+
+    if (item->enclosure) {
+      n += sizeof(enclosure) + _string_size(item->enclosure->url) +
+        _string_size(item->enclosure->type) + _string_size(item->enclosure->filename);
+
+      if (item->enclosure->mirrors)
+        for (j = 0; j < item->enclosure->mirrors->len; j++)
+          n += sizeof(gpointer) +
+            _string_size(g_ptr_array_index(item->enclosure->mirrors, j));
+    }
+  }
+
+  return n;
+}
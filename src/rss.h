@@ -21,6 +21,7 @@
 #define RSS_H
 
 #include "channel.h"
+#include "urlget.h"
 
 typedef struct _rss_item {
   char *title;
@@ -44,8 +45,12 @@ typedef struct _rss_file {
   gchar *fetched_time;
 } rss_file;
 
-rss_file *rss_open_file(const char *filename);
-rss_file *rss_open_url(const char *url, int debug);
+rss_file *rss_open_file(const char *filename, const media_selection *selection);
+rss_file *rss_open_url(const char *url, int debug, const media_selection *selection);
+gchar *rss_fetch_url(const char *url, int debug, transfer_info *info);
+gchar **rss_fetch_urls(const char **urls, int n, int parallel, int debug,
+                       transfer_info *info);
 void rss_close(rss_file *f);
+gsize rss_file_size(rss_file *f);
 
 #endif /* RSS_H */
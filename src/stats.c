@@ -0,0 +1,917 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Durations of each phase of a run are recorded per channel in
+   microseconds. Phases that do not belong to a channel, like loading the
+   configuration, are recorded for the run as a whole. Transfers are
+   summed per channel and per host, and the time to the first byte of
+   each transfer is kept in a histogram per host. Nothing is recorded
+   unless stats_init() has been called. */
+
+static const gchar *_counter_names[STATS_NUM_COUNTERS] = {
+  "feeds-fetched",
+  "feeds-unchanged",
+  "feed-failures",
+  "enclosures-downloaded",
+  "download-failures",
+  "enclosures-deferred",
+  "enclosures-evicted"
+};
+
+static const gchar *_memory_names[STATS_NUM_MEMORY] = {
+  "xml-peak",
+  "xml-retained",
+  "feed",
+  "state",
+  "maxrss-growth",
+  "maxrss"
+};
+
+static const gchar *_phase_names[STATS_NUM_PHASES] = {
+  "config-load",
+  "state-load",
+  "fetch",
+  "parse",
+  "diff",
+  "download",
+  "callback",
+  "postprocess",
+  "save"
+};
+
+/* Upper bounds of the latency histogram buckets in milliseconds. The
+   last bucket holds everything slower. */
+static const guint _latency_buckets[] = {
+  10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+#define NUM_LATENCY_BUCKETS (G_N_ELEMENTS(_latency_buckets) + 1)
+
+typedef struct _stats_transfers {
+  guint count;
+  double bytes;
+  guint redirects;
+  double name_lookup_time;
+  double connect_time;
+  double app_connect_time;
+  double start_transfer_time;
+  double total_time;
+  long http_version;
+  guint latency[NUM_LATENCY_BUCKETS];
+} stats_transfers;
+
+struct _stats_channel {
+  gchar *identifier;
+  GArray *samples[STATS_NUM_PHASES];
+  stats_transfers transfers;
+  guint64 counters[STATS_NUM_COUNTERS];
+  gint64 memory[STATS_NUM_MEMORY];
+  gint64 state_size;
+};
+
+typedef struct _stats_summary {
+  guint count;
+  gint64 total;
+  gint64 p50;
+  gint64 p95;
+  gint64 p99;
+} stats_summary;
+
+static struct {
+  GMutex lock;
+  stats_channel *run;
+  GPtrArray *channels;
+  GHashTable *channels_by_identifier;
+  GHashTable *hosts;
+  gint64 start_time;
+} *_stats = NULL;
+
+static stats_channel *_stats_channel_new(const gchar *identifier)
+{
+  stats_channel *s = g_malloc(sizeof(stats_channel));
+  int i;
+
+  s->identifier = g_strdup(identifier);
+
+  for (i = 0; i < STATS_NUM_PHASES; i++)
+    s->samples[i] = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+  memset(&s->transfers, 0, sizeof(stats_transfers));
+  memset(s->counters, 0, sizeof(s->counters));
+  memset(s->memory, 0, sizeof(s->memory));
+  s->state_size = -1;
+
+  return s;
+}
+
+static void _stats_channel_free(gpointer data)
+{
+  stats_channel *s = (stats_channel *)data;
+  int i;
+
+  for (i = 0; i < STATS_NUM_PHASES; i++)
+    g_array_free(s->samples[i], TRUE);
+
+  g_free(s->identifier);
+  g_free(s);
+}
+
+void stats_init(void)
+{
+  if (_stats)
+    return;
+
+  _stats = g_malloc(sizeof(*_stats));
+  g_mutex_init(&_stats->lock);
+  _stats->run = _stats_channel_new(NULL);
+  _stats->channels = g_ptr_array_new_with_free_func(_stats_channel_free);
+  _stats->channels_by_identifier = g_hash_table_new(g_str_hash, g_str_equal);
+  _stats->hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  _stats->start_time = g_get_real_time();
+}
+
+void stats_free(void)
+{
+  if (!_stats)
+    return;
+
+  g_hash_table_destroy(_stats->hosts);
+  g_hash_table_destroy(_stats->channels_by_identifier);
+  g_ptr_array_free(_stats->channels, TRUE);
+  _stats_channel_free(_stats->run);
+  g_mutex_clear(&_stats->lock);
+  g_free(_stats);
+  _stats = NULL;
+}
+
+gboolean stats_enabled(void)
+{
+  return _stats != NULL;
+}
+
+/* Returns the record for a channel, or NULL if statistics are not being
+   collected. */
+stats_channel *stats_channel_get(const gchar *identifier)
+{
+  stats_channel *s;
+
+  if (!_stats)
+    return NULL;
+
+  g_mutex_lock(&_stats->lock);
+
+  s = g_hash_table_lookup(_stats->channels_by_identifier, identifier);
+
+  if (!s) {
+    s = _stats_channel_new(identifier);
+    g_ptr_array_add(_stats->channels, s);
+    g_hash_table_insert(_stats->channels_by_identifier, s->identifier, s);
+  }
+
+  g_mutex_unlock(&_stats->lock);
+
+  return s;
+}
+
+/* Returns the time to pass to stats_record() when a phase starts. */
+gint64 stats_now(void)
+{
+  return _stats ? g_get_monotonic_time() : 0;
+}
+
+/* Records the time since start as one sample of a phase. If s is NULL,
+   the sample belongs to the run as a whole. */
+void stats_record(stats_channel *s, stats_phase phase, gint64 start)
+{
+  if (!_stats)
+    return;
+
+  stats_record_duration(s, phase, start, g_get_monotonic_time() - start);
+}
+
+/* Records a sample of a phase that took the given number of
+   microseconds, for phases timed by something other than the caller,
+   such as transfers run alongside others. */
+void stats_record_duration(stats_channel *s, stats_phase phase, gint64 start,
+                           gint64 duration)
+{
+  if (!_stats)
+    return;
+
+  if (trace_enabled())
+    trace_span(_phase_names[phase], s ? s->identifier : NULL, start, duration);
+
+  g_mutex_lock(&_stats->lock);
+  g_array_append_val((s ? s : _stats->run)->samples[phase], duration);
+  g_mutex_unlock(&_stats->lock);
+}
+
+/* Counts an event for a channel, or for the run as a whole if s is
+   NULL. */
+void stats_count(stats_channel *s, stats_counter counter)
+{
+  if (!_stats)
+    return;
+
+  g_mutex_lock(&_stats->lock);
+  (s ? s : _stats->run)->counters[counter]++;
+  g_mutex_unlock(&_stats->lock);
+}
+
+/* Records an amount of memory used by a channel, or by the run as a
+   whole if s is NULL. Only the largest amount of each kind is kept. */
+void stats_record_memory(stats_channel *s, stats_memory kind, gint64 bytes)
+{
+  if (!_stats)
+    return;
+
+  if (!s)
+    s = _stats->run;
+
+  g_mutex_lock(&_stats->lock);
+
+  if (bytes > s->memory[kind])
+    s->memory[kind] = bytes;
+
+  g_mutex_unlock(&_stats->lock);
+}
+
+/* Records the size of a channel's channel file after the run. Channels
+   that have not been processed are ignored. */
+void stats_set_state_size(const gchar *identifier, gint64 size)
+{
+  stats_channel *s;
+
+  if (!_stats)
+    return;
+
+  g_mutex_lock(&_stats->lock);
+
+  s = g_hash_table_lookup(_stats->channels_by_identifier, identifier);
+
+  if (s)
+    s->state_size = size;
+
+  g_mutex_unlock(&_stats->lock);
+}
+
+/* Returns the host and port part of a URL. */
+static gchar *_url_host(const gchar *url)
+{
+  const gchar *start, *end, *at;
+
+  start = strstr(url, "://");
+  start = start ? start + 3 : url;
+  end = start + strcspn(start, "/?#");
+
+  at = memchr(start, '@', end - start);
+
+  if (at)
+    start = at + 1;
+
+  return g_ascii_strdown(start, end - start);
+}
+
+static void _add_transfer(stats_transfers *t, const transfer_info *info)
+{
+  guint i;
+
+  t->count++;
+  t->bytes += info->bytes;
+  t->redirects += info->redirect_count;
+  t->name_lookup_time += info->name_lookup_time;
+  t->connect_time += info->connect_time;
+  t->app_connect_time += info->app_connect_time;
+  t->start_transfer_time += info->start_transfer_time;
+  t->total_time += info->total_time;
+
+  if (info->http_version)
+    t->http_version = info->http_version;
+
+  for (i = 0; i < G_N_ELEMENTS(_latency_buckets); i++)
+    if (info->start_transfer_time * 1000.0 <= _latency_buckets[i])
+      break;
+
+  t->latency[i]++;
+}
+
+/* Records a transfer made on behalf of a channel, or of the run as a
+   whole if s is NULL. */
+void stats_record_transfer(stats_channel *s, const gchar *url, const transfer_info *info)
+{
+  stats_transfers *host;
+  gchar *name;
+
+  if (!_stats)
+    return;
+
+  name = _url_host(url);
+
+  g_mutex_lock(&_stats->lock);
+
+  _add_transfer(&(s ? s : _stats->run)->transfers, info);
+
+  host = g_hash_table_lookup(_stats->hosts, name);
+
+  if (host)
+    g_free(name);
+  else {
+    host = g_malloc0(sizeof(stats_transfers));
+    g_hash_table_insert(_stats->hosts, name, host);
+  }
+
+  _add_transfer(host, info);
+
+  g_mutex_unlock(&_stats->lock);
+}
+
+static void _sum_transfers(stats_transfers *sum, stats_channel **records, guint num_records)
+{
+  const stats_transfers *t;
+  guint i, j;
+
+  memset(sum, 0, sizeof(stats_transfers));
+
+  for (i = 0; i < num_records; i++) {
+    t = &records[i]->transfers;
+
+    sum->count += t->count;
+    sum->bytes += t->bytes;
+    sum->redirects += t->redirects;
+    sum->name_lookup_time += t->name_lookup_time;
+    sum->connect_time += t->connect_time;
+    sum->app_connect_time += t->app_connect_time;
+    sum->start_transfer_time += t->start_transfer_time;
+    sum->total_time += t->total_time;
+
+    for (j = 0; j < NUM_LATENCY_BUCKETS; j++)
+      sum->latency[j] += t->latency[j];
+  }
+}
+
+static const gchar *_http_version_name(long version)
+{
+  switch (version) {
+  case 1: return "1.0";
+  case 2: return "1.1";
+  case 3: return "2";
+  case 30: return "3";
+  default: return "-";
+  }
+}
+
+/* Returns the mean of a sum of times over a number of transfers in
+   milliseconds. */
+static double _mean_ms(double sum, guint count)
+{
+  return count ? sum * 1000.0 / count : 0.0;
+}
+
+static gint _compare_samples(gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Returns the nearest-rank percentile of sorted samples. */
+static gint64 _percentile(GArray *sorted, guint p)
+{
+  guint rank = (p * sorted->len + 99) / 100;
+
+  return g_array_index(sorted, gint64, rank ? rank - 1 : 0);
+}
+
+/* Summarises the samples of a phase in a list of records. */
+static void _summarise(stats_channel **records, guint num_records, stats_phase phase,
+                       stats_summary *summary)
+{
+  GArray *sorted;
+  guint i;
+
+  sorted = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+  for (i = 0; i < num_records; i++)
+    g_array_append_vals(sorted, records[i]->samples[phase]->data,
+                        records[i]->samples[phase]->len);
+
+  memset(summary, 0, sizeof(stats_summary));
+  summary->count = sorted->len;
+
+  if (sorted->len) {
+    g_array_sort(sorted, _compare_samples);
+
+    for (i = 0; i < sorted->len; i++)
+      summary->total += g_array_index(sorted, gint64, i);
+
+    summary->p50 = _percentile(sorted, 50);
+    summary->p95 = _percentile(sorted, 95);
+    summary->p99 = _percentile(sorted, 99);
+  }
+
+  g_array_free(sorted, TRUE);
+}
+
+/* Returns every record, with the run record last, for summarising the
+   run as a whole. */
+static GPtrArray *_all_records(void)
+{
+  GPtrArray *records;
+  guint i;
+
+  records = g_ptr_array_sized_new(_stats->channels->len + 1);
+
+  for (i = 0; i < _stats->channels->len; i++)
+    g_ptr_array_add(records, g_ptr_array_index(_stats->channels, i));
+
+  g_ptr_array_add(records, _stats->run);
+
+  return records;
+}
+
+static void _print_table_rows(FILE *f, const gchar *name, stats_channel **records,
+                              guint num_records)
+{
+  stats_summary summary;
+  int i;
+
+  for (i = 0; i < STATS_NUM_PHASES; i++) {
+    _summarise(records, num_records, i, &summary);
+
+    if (!summary.count)
+      continue;
+
+    fprintf(f, "%-20s %-12s %6u %12.1f %10.1f %10.1f %10.1f\n",
+            name, _phase_names[i], summary.count, summary.total / 1000.0,
+            summary.p50 / 1000.0, summary.p95 / 1000.0, summary.p99 / 1000.0);
+  }
+}
+
+static void _sum_counters(guint64 *sum, stats_channel **records, guint num_records)
+{
+  guint i, j;
+
+  memset(sum, 0, STATS_NUM_COUNTERS * sizeof(guint64));
+
+  for (i = 0; i < num_records; i++)
+    for (j = 0; j < STATS_NUM_COUNTERS; j++)
+      sum[j] += records[i]->counters[j];
+}
+
+static void _print_table_counters(FILE *f, const gchar *name, const guint64 *counters)
+{
+  int i;
+
+  fprintf(f, "%-20s", name);
+
+  for (i = 0; i < STATS_NUM_COUNTERS; i++)
+    fprintf(f, " %*" G_GUINT64_FORMAT, (int)strlen(_counter_names[i]), counters[i]);
+
+  fputc('\n', f);
+}
+
+static void _max_memory(gint64 *max, stats_channel **records, guint num_records)
+{
+  guint i, j;
+
+  memset(max, 0, STATS_NUM_MEMORY * sizeof(gint64));
+
+  for (i = 0; i < num_records; i++)
+    for (j = 0; j < STATS_NUM_MEMORY; j++)
+      if (records[i]->memory[j] > max[j])
+        max[j] = records[i]->memory[j];
+}
+
+static void _print_table_memory(FILE *f, const gchar *name, const gint64 *memory)
+{
+  int i;
+
+  fprintf(f, "%-20s", name);
+
+  for (i = 0; i < STATS_NUM_MEMORY; i++)
+    fprintf(f, " %*" G_GINT64_FORMAT, MAX((int)strlen(_memory_names[i]), 10), memory[i]);
+
+  fputc('\n', f);
+}
+
+static void _print_table_transfers(FILE *f, const gchar *name, const stats_transfers *t)
+{
+  guint i;
+
+  fprintf(f, "%-28s %9u %14.0f %9u %8.1f %8.1f %8.1f %8.1f %8.1f %-4s",
+          name, t->count, t->bytes, t->redirects,
+          _mean_ms(t->name_lookup_time, t->count), _mean_ms(t->connect_time, t->count),
+          _mean_ms(t->app_connect_time, t->count), _mean_ms(t->start_transfer_time, t->count),
+          _mean_ms(t->total_time, t->count), _http_version_name(t->http_version));
+
+  for (i = 0; i < NUM_LATENCY_BUCKETS; i++)
+    fprintf(f, " %u", t->latency[i]);
+
+  fputc('\n', f);
+}
+
+void stats_print_table(FILE *f)
+{
+  GPtrArray *records;
+  GHashTableIter iter;
+  gpointer key, value;
+  stats_transfers sum;
+  guint64 counters[STATS_NUM_COUNTERS];
+  gint64 memory[STATS_NUM_MEMORY];
+  stats_channel *s;
+  guint i;
+
+  if (!_stats)
+    return;
+
+  g_mutex_lock(&_stats->lock);
+
+  fprintf(f, "%-20s %-12s %6s %12s %10s %10s %10s\n",
+          "channel", "phase", "count", "total (ms)", "p50 (ms)", "p95 (ms)", "p99 (ms)");
+
+  for (i = 0; i < _stats->channels->len; i++) {
+    s = g_ptr_array_index(_stats->channels, i);
+    _print_table_rows(f, s->identifier, &s, 1);
+  }
+
+  records = _all_records();
+  _print_table_rows(f, "(all)", (stats_channel **)records->pdata, records->len);
+
+  fprintf(f, "\n%-20s", "channel");
+
+  for (i = 0; i < STATS_NUM_COUNTERS; i++)
+    fprintf(f, " %s", _counter_names[i]);
+
+  fputc('\n', f);
+
+  for (i = 0; i < _stats->channels->len; i++) {
+    s = g_ptr_array_index(_stats->channels, i);
+    _print_table_counters(f, s->identifier, s->counters);
+  }
+
+  _sum_counters(counters, (stats_channel **)records->pdata, records->len);
+  _print_table_counters(f, "(all)", counters);
+
+  /* Memory in bytes. The row for the whole run has the largest value of
+     each kind. */
+  fprintf(f, "\n%-20s", "channel");
+
+  for (i = 0; i < STATS_NUM_MEMORY; i++)
+    fprintf(f, " %*s", MAX((int)strlen(_memory_names[i]), 10), _memory_names[i]);
+
+  fputc('\n', f);
+
+  for (i = 0; i < _stats->channels->len; i++) {
+    s = g_ptr_array_index(_stats->channels, i);
+    _print_table_memory(f, s->identifier, s->memory);
+  }
+
+  _max_memory(memory, (stats_channel **)records->pdata, records->len);
+  _print_table_memory(f, "(all)", memory);
+
+  /* Transfers, with mean times in milliseconds and the number of
+     transfers in each time to first byte bucket. */
+  fprintf(f, "\n%-28s %9s %14s %9s %8s %8s %8s %8s %8s %-4s",
+          "channel/host", "transfers", "bytes", "redirects",
+          "lookup", "connect", "tls", "ttfb", "total", "http");
+
+  for (i = 0; i < G_N_ELEMENTS(_latency_buckets); i++)
+    fprintf(f, " <=%u", _latency_buckets[i]);
+
+  fprintf(f, " >%u\n", _latency_buckets[G_N_ELEMENTS(_latency_buckets) - 1]);
+
+  for (i = 0; i < _stats->channels->len; i++) {
+    s = g_ptr_array_index(_stats->channels, i);
+
+    if (s->transfers.count)
+      _print_table_transfers(f, s->identifier, &s->transfers);
+  }
+
+  _sum_transfers(&sum, (stats_channel **)records->pdata, records->len);
+  _print_table_transfers(f, "(all)", &sum);
+  g_ptr_array_free(records, TRUE);
+
+  g_hash_table_iter_init(&iter, _stats->hosts);
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    _print_table_transfers(f, (const gchar *)key, (const stats_transfers *)value);
+
+  g_mutex_unlock(&_stats->lock);
+}
+
+static void _print_json_phases(FILE *f, stats_channel **records, guint num_records)
+{
+  stats_summary summary;
+  gboolean first = TRUE;
+  int i;
+
+  fputc('{', f);
+
+  for (i = 0; i < STATS_NUM_PHASES; i++) {
+    _summarise(records, num_records, i, &summary);
+
+    if (!summary.count)
+      continue;
+
+    fprintf(f, "%s\"%s\":{\"count\":%u,\"total_ms\":%.3f,\"p50_ms\":%.3f,"
+            "\"p95_ms\":%.3f,\"p99_ms\":%.3f}",
+            first ? "" : ",", _phase_names[i], summary.count,
+            summary.total / 1000.0, summary.p50 / 1000.0,
+            summary.p95 / 1000.0, summary.p99 / 1000.0);
+    first = FALSE;
+  }
+
+  fputc('}', f);
+}
+
+static void _print_json_counters(FILE *f, const guint64 *counters)
+{
+  int i;
+
+  fputc('{', f);
+
+  for (i = 0; i < STATS_NUM_COUNTERS; i++)
+    fprintf(f, "%s\"%s\":%" G_GUINT64_FORMAT, i ? "," : "", _counter_names[i], counters[i]);
+
+  fputc('}', f);
+}
+
+static void _print_json_memory(FILE *f, const gint64 *memory)
+{
+  int i;
+
+  fputc('{', f);
+
+  for (i = 0; i < STATS_NUM_MEMORY; i++)
+    fprintf(f, "%s\"%s\":%" G_GINT64_FORMAT, i ? "," : "", _memory_names[i], memory[i]);
+
+  fputc('}', f);
+}
+
+static void _print_json_transfers(FILE *f, const stats_transfers *t)
+{
+  guint i;
+
+  fprintf(f, "{\"count\":%u,\"bytes\":%.0f,\"redirects\":%u,"
+          "\"mean_name_lookup_ms\":%.3f,\"mean_connect_ms\":%.3f,"
+          "\"mean_app_connect_ms\":%.3f,\"mean_start_transfer_ms\":%.3f,"
+          "\"mean_total_ms\":%.3f,\"http_version\":\"%s\",\"start_transfer_histogram\":{",
+          t->count, t->bytes, t->redirects,
+          _mean_ms(t->name_lookup_time, t->count), _mean_ms(t->connect_time, t->count),
+          _mean_ms(t->app_connect_time, t->count), _mean_ms(t->start_transfer_time, t->count),
+          _mean_ms(t->total_time, t->count), _http_version_name(t->http_version));
+
+  for (i = 0; i < G_N_ELEMENTS(_latency_buckets); i++)
+    fprintf(f, "\"%u\":%u,", _latency_buckets[i], t->latency[i]);
+
+  fprintf(f, "\"+Inf\":%u}}", t->latency[i]);
+}
+
+/* Prints the statistics as a JSON object with per-channel, per-host and
+   total figures. Bucket keys in histograms are upper bounds in
+   milliseconds. */
+void stats_print_json(FILE *f)
+{
+  GPtrArray *records;
+  GHashTableIter iter;
+  gpointer key, value;
+  stats_transfers sum;
+  guint64 counters[STATS_NUM_COUNTERS];
+  gint64 memory[STATS_NUM_MEMORY];
+  stats_channel *s;
+  guint i;
+
+  if (!_stats)
+    return;
+
+  g_mutex_lock(&_stats->lock);
+
+  fprintf(f, "{\"channels\":{");
+
+  for (i = 0; i < _stats->channels->len; i++) {
+    s = g_ptr_array_index(_stats->channels, i);
+
+    if (i)
+      fputc(',', f);
+
+    print_json_string(f, s->identifier);
+    fprintf(f, ":{\"phases\":");
+    _print_json_phases(f, &s, 1);
+    fprintf(f, ",\"counters\":");
+    _print_json_counters(f, s->counters);
+    fprintf(f, ",\"memory\":");
+    _print_json_memory(f, s->memory);
+    fprintf(f, ",\"transfers\":");
+    _print_json_transfers(f, &s->transfers);
+    fputc('}', f);
+  }
+
+  fprintf(f, "},\"hosts\":{");
+
+  i = 0;
+  g_hash_table_iter_init(&iter, _stats->hosts);
+
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    if (i++)
+      fputc(',', f);
+
+    print_json_string(f, (const gchar *)key);
+    fputc(':', f);
+    _print_json_transfers(f, (const stats_transfers *)value);
+  }
+
+  fprintf(f, "},\"total\":{\"phases\":");
+
+  records = _all_records();
+  _print_json_phases(f, (stats_channel **)records->pdata, records->len);
+  _sum_transfers(&sum, (stats_channel **)records->pdata, records->len);
+  _sum_counters(counters, (stats_channel **)records->pdata, records->len);
+  _max_memory(memory, (stats_channel **)records->pdata, records->len);
+  g_ptr_array_free(records, TRUE);
+
+  fprintf(f, ",\"counters\":");
+  _print_json_counters(f, counters);
+  fprintf(f, ",\"memory\":");
+  _print_json_memory(f, memory);
+  fprintf(f, ",\"transfers\":");
+  _print_json_transfers(f, &sum);
+  fprintf(f, "}}\n");
+
+  g_mutex_unlock(&_stats->lock);
+}
+
+/* Metrics are written in the Prometheus text exposition format. All
+   values describe the last run, so they are exported as gauges. */
+
+static void _print_metric_header(FILE *f, const gchar *name, const gchar *help)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+}
+
+static void _print_label_value(FILE *f, const gchar *s)
+{
+  fputc('"', f);
+
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if (*s == '\n')
+      fputs("\\n", f);
+    else
+      fputc(*s, f);
+  }
+
+  fputc('"', f);
+}
+
+static void _print_channel_metric(FILE *f, const gchar *name, const stats_channel *s,
+                                  const gchar *extra_label, const gchar *extra_value)
+{
+  fprintf(f, "%s{channel=", name);
+  _print_label_value(f, s->identifier);
+
+  if (extra_label) {
+    fprintf(f, ",%s=", extra_label);
+    _print_label_value(f, extra_value);
+  }
+
+  fputc('}', f);
+}
+
+/* Writes the statistics of the run as metrics. Has the signature of a
+   writer for write_by_temporary_file(). */
+int stats_write_metrics(FILE *f, gpointer user_data, int debug)
+{
+  static const struct {
+    stats_counter counter;
+    const gchar *name;
+    const gchar *help;
+  } counters[] = {
+    { STATS_FEEDS_FETCHED, "castget_feeds_fetched",
+      "Feeds fetched and parsed in the last run." },
+    { STATS_FEEDS_UNCHANGED, "castget_feeds_not_modified",
+      "Feeds fetched in the last run that had no new enclosures." },
+    { STATS_FEED_FAILURES, "castget_feed_failures",
+      "Feeds that could not be fetched or parsed in the last run." },
+    { STATS_ENCLOSURES_DOWNLOADED, "castget_enclosures_downloaded",
+      "Enclosures downloaded in the last run." },
+    { STATS_DOWNLOAD_FAILURES, "castget_download_failures",
+      "Enclosure downloads that failed in the last run." },
+    { STATS_ENCLOSURES_DEFERRED, "castget_enclosures_deferred",
+      "Enclosures not downloaded in the last run for lack of disk space." },
+    { STATS_ENCLOSURES_EVICTED, "castget_enclosures_evicted",
+      "Enclosures deleted in the last run to keep the spool within its quota." },
+  };
+  stats_summary summary;
+  stats_channel *s;
+  guint i, j;
+
+  if (!_stats)
+    return 0;
+
+  g_mutex_lock(&_stats->lock);
+
+  _print_metric_header(f, "castget_last_run_start_timestamp_seconds",
+                       "Time the last run started.");
+  fprintf(f, "castget_last_run_start_timestamp_seconds %.3f\n", _stats->start_time / 1e6);
+
+  _print_metric_header(f, "castget_last_run_duration_seconds",
+                       "Duration of the last run.");
+  fprintf(f, "castget_last_run_duration_seconds %.3f\n",
+          (g_get_real_time() - _stats->start_time) / 1e6);
+
+  _print_metric_header(f, "castget_config_load_seconds",
+                       "Time spent loading the configuration in the last run.");
+  _summarise(&_stats->run, 1, STATS_CONFIG_LOAD, &summary);
+  fprintf(f, "castget_config_load_seconds %.6f\n", summary.total / 1e6);
+
+  for (i = 0; i < G_N_ELEMENTS(counters); i++) {
+    _print_metric_header(f, counters[i].name, counters[i].help);
+
+    for (j = 0; j < _stats->channels->len; j++) {
+      s = g_ptr_array_index(_stats->channels, j);
+      _print_channel_metric(f, counters[i].name, s, NULL, NULL);
+      fprintf(f, " %" G_GUINT64_FORMAT "\n", s->counters[counters[i].counter]);
+    }
+  }
+
+  _print_metric_header(f, "castget_downloaded_bytes",
+                       "Bytes received for feeds and enclosures in the last run.");
+
+  for (j = 0; j < _stats->channels->len; j++) {
+    s = g_ptr_array_index(_stats->channels, j);
+    _print_channel_metric(f, "castget_downloaded_bytes", s, NULL, NULL);
+    fprintf(f, " %.0f\n", s->transfers.bytes);
+  }
+
+  _print_metric_header(f, "castget_phase_seconds",
+                       "Time spent in each phase of updating a channel in the last run.");
+
+  for (j = 0; j < _stats->channels->len; j++) {
+    s = g_ptr_array_index(_stats->channels, j);
+
+    for (i = STATS_STATE_LOAD; i < STATS_NUM_PHASES; i++) {
+      _summarise(&s, 1, i, &summary);
+      _print_channel_metric(f, "castget_phase_seconds", s, "phase", _phase_names[i]);
+      fprintf(f, " %.6f\n", summary.total / 1e6);
+    }
+  }
+
+  _print_metric_header(f, "castget_memory_bytes",
+                       "Memory used while updating a channel in the last run.");
+
+  for (j = 0; j < _stats->channels->len; j++) {
+    s = g_ptr_array_index(_stats->channels, j);
+
+    for (i = 0; i < STATS_MEMORY_MAXRSS; i++) {
+      _print_channel_metric(f, "castget_memory_bytes", s, "kind", _memory_names[i]);
+      fprintf(f, " %" G_GINT64_FORMAT "\n", s->memory[i]);
+    }
+  }
+
+  _print_metric_header(f, "castget_maxrss_bytes",
+                       "Peak resident set size of the last run.");
+  fprintf(f, "castget_maxrss_bytes %" G_GINT64_FORMAT "\n",
+          _stats->run->memory[STATS_MEMORY_MAXRSS]);
+
+  _print_metric_header(f, "castget_channel_file_bytes",
+                       "Size of the channel file after the last run.");
+
+  for (j = 0; j < _stats->channels->len; j++) {
+    s = g_ptr_array_index(_stats->channels, j);
+
+    if (s->state_size >= 0) {
+      _print_channel_metric(f, "castget_channel_file_bytes", s, NULL, NULL);
+      fprintf(f, " %" G_GINT64_FORMAT "\n", s->state_size);
+    }
+  }
+
+  g_mutex_unlock(&_stats->lock);
+
+  return ferror(f) ? -1 : 0;
+}
@@ -0,0 +1,79 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <glib.h>
+#include "urlget.h"
+
+typedef enum {
+  STATS_CONFIG_LOAD,
+  STATS_STATE_LOAD,
+  STATS_FETCH,
+  STATS_PARSE,
+  STATS_DIFF,
+  STATS_DOWNLOAD,
+  STATS_CALLBACK,
+  STATS_POSTPROCESS,
+  STATS_SAVE,
+  STATS_NUM_PHASES
+} stats_phase;
+
+typedef enum {
+  STATS_FEEDS_FETCHED,
+  STATS_FEEDS_UNCHANGED,
+  STATS_FEED_FAILURES,
+  STATS_ENCLOSURES_DOWNLOADED,
+  STATS_DOWNLOAD_FAILURES,
+  STATS_ENCLOSURES_DEFERRED,
+  STATS_ENCLOSURES_EVICTED,
+  STATS_NUM_COUNTERS
+} stats_counter;
+
+typedef enum {
+  STATS_MEMORY_XML_PEAK,
+  STATS_MEMORY_XML_RETAINED,
+  STATS_MEMORY_FEED,
+  STATS_MEMORY_STATE,
+  STATS_MEMORY_MAXRSS_GROWTH,
+  STATS_MEMORY_MAXRSS,
+  STATS_NUM_MEMORY
+} stats_memory;
+
+typedef struct _stats_channel stats_channel;
+
+void stats_init(void);
+void stats_free(void);
+gboolean stats_enabled(void);
+stats_channel *stats_channel_get(const gchar *identifier);
+gint64 stats_now(void);
+void stats_record(stats_channel *s, stats_phase phase, gint64 start);
+void stats_record_duration(stats_channel *s, stats_phase phase, gint64 start,
+                           gint64 duration);
+void stats_record_transfer(stats_channel *s, const gchar *url, const transfer_info *info);
+void stats_count(stats_channel *s, stats_counter counter);
+void stats_record_memory(stats_channel *s, stats_memory kind, gint64 bytes);
+void stats_set_state_size(const gchar *identifier, gint64 size);
+int stats_write_metrics(FILE *f, gpointer user_data, int debug);
+void stats_print_table(FILE *f);
+void stats_print_json(FILE *f);
+
+#endif /* STATS_H */
@@ -0,0 +1,146 @@
+/*
+  Copyright (C) 2016 Marius L. Jøhndal
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include "trace.h"
+#include "utils.h"
+
+/* Spans are written as complete events in the JSON array format of the
+   Chrome trace event format, which both chrome://tracing and Perfetto
+   read. Each thread that records a span gets its own track, numbered in
+   the order threads first record something. Timestamps are microseconds
+   since the trace was opened. */
+
+static struct {
+  FILE *f;
+  GMutex lock;
+  GThread *main_thread;
+  gint64 start;
+  guint next_tid;
+} *_trace = NULL;
+
+static GPrivate _thread_tid = G_PRIVATE_INIT(NULL);
+
+gboolean trace_enabled(void)
+{
+  return _trace != NULL;
+}
+
+int trace_open(const gchar *filename)
+{
+  FILE *f;
+
+  f = g_fopen(filename, "w");
+
+  if (!f) {
+    fprintf(stderr, "Error opening trace file %s: %s.\n", filename, strerror(errno));
+    return -1;
+  }
+
+  _trace = g_malloc(sizeof(*_trace));
+  _trace->f = f;
+  g_mutex_init(&_trace->lock);
+  _trace->main_thread = g_thread_self();
+  _trace->start = g_get_monotonic_time();
+  _trace->next_tid = 1;
+
+  fprintf(f, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+          "\"args\":{\"name\":\"castget\"}}");
+
+  return 0;
+}
+
+/* Returns the track of the calling thread, naming the track the first
+   time. Must be called with the trace locked. */
+static guint _thread_track(void)
+{
+  guint tid = GPOINTER_TO_UINT(g_private_get(&_thread_tid));
+
+  if (!tid) {
+    tid = _trace->next_tid++;
+    g_private_set(&_thread_tid, GUINT_TO_POINTER(tid));
+
+    fprintf(_trace->f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"name\":", tid);
+
+    if (g_thread_self() == _trace->main_thread)
+      fprintf(_trace->f, "\"main\"}}");
+    else
+      fprintf(_trace->f, "\"worker %u\"}}", tid);
+  }
+
+  return tid;
+}
+
+/* Records a span that started at a time given by g_get_monotonic_time()
+   and lasted duration microseconds. The channel may be NULL. */
+void trace_span(const gchar *name, const gchar *channel, gint64 start, gint64 duration)
+{
+  guint tid;
+
+  if (!_trace)
+    return;
+
+  g_mutex_lock(&_trace->lock);
+
+  tid = _thread_track();
+
+  fprintf(_trace->f, ",\n{\"name\":\"%s\",\"cat\":\"castget\",\"ph\":\"X\",\"pid\":1,"
+          "\"tid\":%u,\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT,
+          name, tid, start - _trace->start, duration);
+
+  if (channel) {
+    fprintf(_trace->f, ",\"args\":{\"channel\":");
+    print_json_string(_trace->f, channel);
+    fputc('}', _trace->f);
+  }
+
+  fputc('}', _trace->f);
+
+  g_mutex_unlock(&_trace->lock);
+}
+
+/* Finishes and closes the trace file. Returns non-zero if the trace could
+   not be written. */
+int trace_close(void)
+{
+  int ret;
+
+  if (!_trace)
+    return 0;
+
+  fprintf(_trace->f, "\n]\n");
+  ret = ferror(_trace->f) | fclose(_trace->f);
+
+  g_mutex_clear(&_trace->lock);
+  g_free(_trace);
+  _trace = NULL;
+
+  if (ret)
+    fprintf(stderr, "Error writing trace file.\n");
+
+  return ret;
+}
@@ -28,59 +28,392 @@
 #include "urlget.h"
 #include "progress.h"
 
-int urlget_file(const char *url, FILE *f, int debug)
+int urlget_file(const char *url, FILE *f, int debug, transfer_info *info)
 {
-  return urlget_buffer(url, (void *)f, NULL, 0, debug, NULL);
+  return urlget_buffer(url, (void *)f, NULL, NULL, debug, NULL, info);
 }
 
+static void _get_transfer_info(CURL *easyhandle, transfer_info *info)
+{
+  memset(info, 0, sizeof(transfer_info));
+
+  curl_easy_getinfo(easyhandle, CURLINFO_NAMELOOKUP_TIME, &info->name_lookup_time);
+  curl_easy_getinfo(easyhandle, CURLINFO_CONNECT_TIME, &info->connect_time);
+  curl_easy_getinfo(easyhandle, CURLINFO_APPCONNECT_TIME, &info->app_connect_time);
+  curl_easy_getinfo(easyhandle, CURLINFO_STARTTRANSFER_TIME, &info->start_transfer_time);
+  curl_easy_getinfo(easyhandle, CURLINFO_TOTAL_TIME, &info->total_time);
+#if LIBCURL_VERSION_NUM >= 0x073700
+  {
+    curl_off_t speed = 0, bytes = 0;
+
+    curl_easy_getinfo(easyhandle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    curl_easy_getinfo(easyhandle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    info->download_speed = (double)speed;
+    info->bytes = (double)bytes;
+  }
+#else
+  curl_easy_getinfo(easyhandle, CURLINFO_SPEED_DOWNLOAD, &info->download_speed);
+  curl_easy_getinfo(easyhandle, CURLINFO_SIZE_DOWNLOAD, &info->bytes);
+#endif
+  curl_easy_getinfo(easyhandle, CURLINFO_REDIRECT_COUNT, &info->redirect_count);
+  curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &info->response_code);
+#if LIBCURL_VERSION_NUM >= 0x073200
+  curl_easy_getinfo(easyhandle, CURLINFO_HTTP_VERSION, &info->http_version);
+#endif
+}
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int _progress_cb(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                        curl_off_t ultotal, curl_off_t ulnow)
+#else
+static int _progress_cb(void *clientp, double dltotal, double dlnow,
+                        double ultotal, double ulnow)
+#endif
+{
+  progress_bar_update((progress_bar *)clientp, (gint64)dltotal, (gint64)dlnow);
+
+  return 0;
+}
+
+static gchar *_user_agent(void)
+{
+  return g_strdup_printf("%s (%s rss enclosure downloader)", PACKAGE_STRING, PACKAGE);
+}
+
+/* Creates a handle with the options common to all transfers. */
+static CURL *_new_handle(const char *url, char *errbuf, const gchar *user_agent, int debug)
+{
+  CURL *easyhandle;
+
+  easyhandle = curl_easy_init();
+
+  if (!easyhandle)
+    return NULL;
+
+  curl_easy_setopt(easyhandle, CURLOPT_URL, url);
+  curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, errbuf);
+  curl_easy_setopt(easyhandle, CURLOPT_FOLLOWLOCATION, 1);
+  curl_easy_setopt(easyhandle, CURLOPT_USERAGENT, user_agent);
+  curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, debug);
+
+  return easyhandle;
+}
+
+/* Copies the value of a header line into buffer if the line is the
+   named header. */
+static gboolean _header_value(const char *line, size_t length, const char *name,
+                              char *buffer, size_t size)
+{
+  size_t name_length = strlen(name);
+
+  if (length <= name_length || line[name_length] != ':' ||
+      g_ascii_strncasecmp(line, name, name_length))
+    return FALSE;
+
+  line += name_length + 1;
+  length -= name_length + 1;
+
+  while (length && g_ascii_isspace(*line)) {
+    line++;
+    length--;
+  }
+
+  while (length && g_ascii_isspace(line[length - 1]))
+    length--;
+
+  g_strlcpy(buffer, line, MIN(size, length + 1));
+
+  return TRUE;
+}
+
+/* Picks out the status and validators of each response. Redirects are
+   followed, so only those of the last response are kept. */
+static size_t _header_cb(char *buffer, size_t size, size_t nmemb, void *user_data)
+{
+  urlget_range *range = (urlget_range *)user_data;
+  size_t length = size * nmemb;
+  gchar *line;
+
+  if (length > 5 && !strncmp(buffer, "HTTP/", 5)) {
+    line = g_strndup(buffer, length);
+    range->response_code = 0;
+    sscanf(line, "HTTP/%*s %ld", &range->response_code);
+    range->partial = range->response_code == 206;
+    range->etag[0] = '\0';
+    range->last_modified[0] = '\0';
+    g_free(line);
+  } else if (!_header_value(buffer, length, "ETag", range->etag, sizeof(range->etag)))
+    _header_value(buffer, length, "Last-Modified", range->last_modified,
+                  sizeof(range->last_modified));
+
+  return length;
+}
+
+/* Retrieves a URL. If info is not NULL, it is filled in with the timing
+   and size of the transfer, whether or not it succeeded. */
 int urlget_buffer(const char *url, void *user_data,
                   size_t (*write_buffer)(void *buffer, size_t size, size_t nmemb, void *user_data),
-                  long resume_from, int debug, progress_bar *pb)
+                  urlget_range *range, int debug, progress_bar *pb, transfer_info *info)
 {
   CURL *easyhandle;
   CURLcode success;
-  char errbuf[CURL_ERROR_SIZE];
+  char errbuf[CURL_ERROR_SIZE] = "";
   int ret = 0;
-  gchar *user_agent;
-
-  /* Construct user agent string. */
-  user_agent = g_strdup_printf("%s (%s rss enclosure downloader)", PACKAGE_STRING, PACKAGE);
+  gchar *user_agent, *byte_range = NULL, *if_range = NULL;
+  struct curl_slist *headers = NULL;
 
   /* Initialise curl. */
-  easyhandle = curl_easy_init();
+  user_agent = _user_agent();
+  easyhandle = _new_handle(url, errbuf, user_agent, debug);
 
   if (easyhandle) {
-    curl_easy_setopt(easyhandle, CURLOPT_URL, url);
-    curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, errbuf);
     curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, write_buffer);
     curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, user_data);
-    curl_easy_setopt(easyhandle, CURLOPT_FOLLOWLOCATION, 1);
-    curl_easy_setopt(easyhandle, CURLOPT_USERAGENT, user_agent);
 
     if (pb) {
       curl_easy_setopt(easyhandle, CURLOPT_NOPROGRESS, 0);
-      curl_easy_setopt(easyhandle, CURLOPT_PROGRESSFUNCTION, progress_bar_cb);
+#if LIBCURL_VERSION_NUM >= 0x072000
+      curl_easy_setopt(easyhandle, CURLOPT_XFERINFOFUNCTION, _progress_cb);
+      curl_easy_setopt(easyhandle, CURLOPT_XFERINFODATA, pb);
+#else
+      curl_easy_setopt(easyhandle, CURLOPT_PROGRESSFUNCTION, _progress_cb);
       curl_easy_setopt(easyhandle, CURLOPT_PROGRESSDATA, pb);
+#endif
     } else
       curl_easy_setopt(easyhandle, CURLOPT_NOPROGRESS, 1);
 
-    if (resume_from)
-      curl_easy_setopt(easyhandle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)resume_from);
+    if (range) {
+      range->partial = 0;
+      range->response_code = 0;
+      range->etag[0] = '\0';
+      range->last_modified[0] = '\0';
 
-    curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, debug);
+      curl_easy_setopt(easyhandle, CURLOPT_HEADERFUNCTION, _header_cb);
+      curl_easy_setopt(easyhandle, CURLOPT_HEADERDATA, range);
+
+      /* Unlike CURLOPT_RESUME_FROM_LARGE, a plain range lets the server
+         answer with the whole resource when If-Range does not match. */
+      if (range->offset > 0) {
+        byte_range = g_strdup_printf("%" G_GINT64_FORMAT "-", range->offset);
+        curl_easy_setopt(easyhandle, CURLOPT_RANGE, byte_range);
+
+        if (range->if_range) {
+          if_range = g_strdup_printf("If-Range: %s", range->if_range);
+          headers = curl_slist_append(headers, if_range);
+          curl_easy_setopt(easyhandle, CURLOPT_HTTPHEADER, headers);
+        }
+      }
+    }
 
     success = curl_easy_perform(easyhandle);
 
+    if (info) {
+      _get_transfer_info(easyhandle, info);
+
+      if (success)
+        g_strlcpy(info->error, *errbuf ? errbuf : curl_easy_strerror(success),
+                  sizeof(info->error));
+    }
+
     curl_easy_cleanup(easyhandle);
+    curl_slist_free_all(headers);
+    g_free(if_range);
+    g_free(byte_range);
 
     if (success) {
       fprintf(stderr, "Error retrieving %s: %s\n", url, errbuf);
       ret = 1;
     }
-  } else
+  } else {
+    if (info) {
+      memset(info, 0, sizeof(transfer_info));
+      g_strlcpy(info->error, "could not initialise transfer", sizeof(info->error));
+    }
+
     ret = 1;
+  }
 
   g_free(user_agent);
 
   return ret;
 }
+
+/* Counts and throws away the data of a probe. A server that ignores the
+   range is cut off once it has sent enough. */
+static size_t _discard_cb(void *buffer, size_t size, size_t nmemb, void *user_data)
+{
+  urlget_request *r = (urlget_request *)user_data;
+
+  r->length = MAX(r->length, 0) + (gint64)(size * nmemb);
+
+  return r->length > r->probe ? 0 : size * nmemb;
+}
+
+/* Starts a transfer in a batch. Returns FALSE if it could not be
+   started. */
+static gboolean _batch_add(CURLM *multi, urlget_request *r, char *errbuf,
+                           const gchar *user_agent, int debug)
+{
+  CURL *easyhandle;
+  gchar *byte_range;
+
+  memset(&r->info, 0, sizeof(transfer_info));
+  r->length = -1;
+  r->failed = 0;
+
+  easyhandle = _new_handle(r->url, errbuf, user_agent, debug);
+
+  if (!easyhandle) {
+    g_strlcpy(r->info.error, "could not initialise transfer", sizeof(r->info.error));
+    r->failed = 1;
+    return FALSE;
+  }
+
+  curl_easy_setopt(easyhandle, CURLOPT_PRIVATE, (char *)r);
+  curl_easy_setopt(easyhandle, CURLOPT_NOPROGRESS, 1);
+
+  if (r->f)
+    curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, r->f);
+  else if (r->probe > 0) {
+    byte_range = g_strdup_printf("0-%" G_GINT64_FORMAT, r->probe - 1);
+    curl_easy_setopt(easyhandle, CURLOPT_RANGE, byte_range);
+    curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, _discard_cb);
+    curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, r);
+    curl_easy_setopt(easyhandle, CURLOPT_FAILONERROR, 1);
+    g_free(byte_range);
+  } else {
+    /* A size taken from an error page would be meaningless. */
+    curl_easy_setopt(easyhandle, CURLOPT_NOBODY, 1);
+    curl_easy_setopt(easyhandle, CURLOPT_FAILONERROR, 1);
+  }
+
+  curl_multi_add_handle(multi, easyhandle);
+
+  return TRUE;
+}
+
+static void _batch_finish(CURLM *multi, CURL *easyhandle, CURLcode result, char *errbuf)
+{
+  urlget_request *r;
+
+  curl_easy_getinfo(easyhandle, CURLINFO_PRIVATE, (char **)&r);
+  _get_transfer_info(easyhandle, &r->info);
+
+  if (result == CURLE_WRITE_ERROR && r->probe > 0 && r->length > r->probe)
+    result = CURLE_OK;
+
+  if (result) {
+    g_strlcpy(r->info.error, *errbuf ? errbuf : curl_easy_strerror(result),
+              sizeof(r->info.error));
+    fprintf(stderr, "Error retrieving %s: %s\n", r->url, r->info.error);
+    r->failed = 1;
+  } else if (!r->f && r->probe <= 0) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t length = -1;
+
+    curl_easy_getinfo(easyhandle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    r->length = length;
+#else
+    double length = -1.0;
+
+    curl_easy_getinfo(easyhandle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+    r->length = (gint64)length;
+#endif
+  }
+
+  curl_multi_remove_handle(multi, easyhandle);
+  curl_easy_cleanup(easyhandle);
+}
+
+/* Waits for activity on any of the transfers in a batch. */
+static void _batch_wait(CURLM *multi)
+{
+#if LIBCURL_VERSION_NUM >= 0x071c00
+  curl_multi_wait(multi, NULL, 0, 1000, NULL);
+#else
+  fd_set read_fds, write_fds, error_fds;
+  struct timeval timeout = { 1, 0 };
+  long ms = -1;
+  int max_fd = -1;
+
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+  FD_ZERO(&error_fds);
+
+  curl_multi_timeout(multi, &ms);
+
+  if (ms >= 0 && ms < 1000) {
+    timeout.tv_sec = 0;
+    timeout.tv_usec = ms * 1000;
+  }
+
+  curl_multi_fdset(multi, &read_fds, &write_fds, &error_fds, &max_fd);
+
+  if (max_fd >= 0)
+    select(max_fd + 1, &read_fds, &write_fds, &error_fds, &timeout);
+  else
+    g_usleep(100 * 1000);
+#endif
+}
+
+/* Runs a batch of transfers with up to parallel of them at a time.
+   Returns the number of transfers that failed. */
+int urlget_batch(urlget_request *requests, int n, int parallel, int debug)
+{
+  CURLM *multi;
+  CURLMsg *msg;
+  char (*errbufs)[CURL_ERROR_SIZE];
+  gchar *user_agent;
+  urlget_request *r;
+  int i, next = 0, active = 0, running, queued, failures = 0;
+
+  multi = curl_multi_init();
+
+  if (!multi) {
+    for (i = 0; i < n; i++) {
+      memset(&requests[i].info, 0, sizeof(transfer_info));
+      g_strlcpy(requests[i].info.error, "could not initialise transfer",
+                sizeof(requests[i].info.error));
+      requests[i].length = -1;
+      requests[i].failed = 1;
+    }
+
+    return n;
+  }
+
+  errbufs = g_malloc0(n * CURL_ERROR_SIZE);
+  user_agent = _user_agent();
+
+  while (next < n || active > 0) {
+    while (next < n && active < parallel) {
+      if (_batch_add(multi, &requests[next], errbufs[next], user_agent, debug))
+        active++;
+
+      next++;
+    }
+
+    curl_multi_perform(multi, &running);
+
+    while ((msg = curl_multi_info_read(multi, &queued))) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&r);
+      _batch_finish(multi, msg->easy_handle, msg->data.result, errbufs[r - requests]);
+      active--;
+    }
+
+    if (active > 0)
+      _batch_wait(multi);
+  }
+
+  for (i = 0; i < n; i++)
+    if (requests[i].failed)
+      failures++;
+
+  g_free(user_agent);
+  g_free(errbufs);
+  curl_multi_cleanup(multi);
+
+  return failures;
+}
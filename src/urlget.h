@@ -22,9 +22,55 @@
 
 #include "progress.h"
 
-int urlget_file(const char *url, FILE *f, int debug);
+/* Timing and size of a completed transfer as reported by libcurl. Times
+   are in seconds from the start of the transfer. The error is empty if
+   the transfer succeeded. */
+typedef struct _transfer_info {
+  double name_lookup_time;
+  double connect_time;
+  double app_connect_time;
+  double start_transfer_time;
+  double total_time;
+  double download_speed;
+  double bytes;
+  long redirect_count;
+  long http_version;
+  long response_code;
+  char error[256];
+} transfer_info;
+
+/* A transfer in a batch. The body is written to f, or if f is NULL, only
+   the headers are requested and length is set to the size of the
+   resource, or -1 if the server does not give it. If probe is set
+   instead, the first probe bytes of the resource are fetched and thrown
+   away, to time the server, and length is set to the bytes received. */
+typedef struct _urlget_request {
+  const char *url;
+  FILE *f;
+  gint64 probe;
+  gint64 length;
+  int failed;
+  transfer_info info;
+} urlget_request;
+
+/* Asks for a resource from offset onwards. If if_range is set, the rest
+   is only sent if the resource still matches that ETag or Last-Modified
+   date, and the whole resource is sent otherwise. Filled in with whether
+   the server sent only the rest, and with the validators and status of
+   the final response. */
+typedef struct _urlget_range {
+  gint64 offset;
+  const char *if_range;
+  int partial;
+  long response_code;
+  char etag[256];
+  char last_modified[64];
+} urlget_range;
+
+int urlget_file(const char *url, FILE *f, int debug, transfer_info *info);
 int urlget_buffer(const char *url, void *user_data,
                   size_t (*write_buffer)(void *buffer, size_t size, size_t nmemb, void *user_data),
-                  long resume_from, int debug, progress_bar *pb);
+                  urlget_range *range, int debug, progress_bar *pb, transfer_info *info);
+int urlget_batch(urlget_request *requests, int n, int parallel, int debug);
 
 #endif /* URLGET_H */
@@ -20,40 +20,130 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
 #include "utils.h"
 
-int write_by_temporary_file(const gchar *filename,
-                            int(*writer)(FILE *f, gpointer user_data, int debug),
-                            gpointer user_data, gchar **used_filename, int debug)
+struct _commit_group {
+  GHashTable *pending;
+};
+
+static int _sync_file(int fd)
+{
+#ifdef HAVE_FDATASYNC
+  return fdatasync(fd);
+#else
+  return fsync(fd);
+#endif /* HAVE_FDATASYNC */
+}
+
+/* Flushes buffered output on a stream and its data to disk. */
+int sync_stream(FILE *f)
+{
+  if (fflush(f) == EOF)
+    return -1;
+
+  return _sync_file(fileno(f));
+}
+
+/* Flushes a directory to disk so that renames within it are durable. */
+static int _sync_directory(const gchar *dirname)
+{
+  int fd, ret;
+
+  fd = open(dirname, O_RDONLY);
+
+  if (fd < 0) {
+    fprintf(stderr, "Error opening directory %s: %s.\n", dirname, strerror(errno));
+    return -1;
+  }
+
+  ret = fsync(fd);
+
+  if (ret < 0)
+    fprintf(stderr, "Error synchronising directory %s: %s.\n", dirname, strerror(errno));
+
+  close(fd);
+
+  return ret;
+}
+
+/* Gives a temporary file the mode of the file it is to replace, or the
+   mode a new file would have been created with if there is none, rather
+   than the private mode of a temporary file. */
+static int _set_replacement_mode(int fd, const gchar *filename)
+{
+  struct stat st;
+  mode_t mode, mask;
+
+  if (g_stat(filename, &st) == 0)
+    mode = st.st_mode & 07777;
+  else {
+    mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  if (fchmod(fd, mode) < 0) {
+    fprintf(stderr, "Error setting mode of temporary file for %s: %s.\n",
+            filename, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Writes to a new temporary file. The name of the temporary file is
+   returned in tmp_filename_used, or NULL if the file could not be
+   created or has been removed again. If sync is set, the contents of the
+   file are flushed to disk before it is closed. */
+static int _write_temporary_file(const gchar *filename,
+                                 int(*writer)(FILE *f, gpointer user_data, int debug),
+                                 gpointer user_data, gchar **tmp_filename_used,
+                                 int sync, int debug)
 {
   int retval;
   FILE *f;
   gint fd;
-  gchar *tmp_filename_used;
 
   if (filename) {
-    tmp_filename_used = g_strconcat(filename, ".XXXXXX", NULL);
+    *tmp_filename_used = g_strconcat(filename, ".XXXXXX", NULL);
 
-    fd = g_mkstemp(tmp_filename_used);
+    fd = g_mkstemp(*tmp_filename_used);
 
     if (fd < 0) {
       perror("Error opening temporary file");
-      g_free(tmp_filename_used);
+      g_free(*tmp_filename_used);
+      *tmp_filename_used = NULL;
+      return -1;
+    }
+
+    if (_set_replacement_mode(fd, filename)) {
+      close(fd);
+      unlink(*tmp_filename_used);
+      g_free(*tmp_filename_used);
+      *tmp_filename_used = NULL;
       return -1;
     }
   } else {
     GError *error = NULL;
 
-    fd = g_file_open_tmp(NULL, &tmp_filename_used, &error);
+    fd = g_file_open_tmp(NULL, tmp_filename_used, &error);
 
     if (fd < 0) {
       g_fprintf(stderr, "Error opening temporary file: %s\n", error->message);
+      g_error_free(error);
+      *tmp_filename_used = NULL;
       return -1;
     }
   }
@@ -64,31 +154,71 @@ int write_by_temporary_file(const gchar *filename,
     perror("Error opening temporary file stream");
 
     close(fd);
-    g_free(tmp_filename_used);
+    unlink(*tmp_filename_used);
+    g_free(*tmp_filename_used);
+    *tmp_filename_used = NULL;
     return -1;
   }
 
   retval = writer(f, user_data, debug);
 
+  if (sync && retval == 0 && (fflush(f) || _sync_file(fileno(f)))) {
+    perror("Error synchronising temporary file");
+    retval = -1;
+  }
+
   fclose(f);
 
   if (errno == ENOSPC) {
     fprintf(stderr, "No space left on device.\n");
-    unlink(tmp_filename_used);
-    g_free(tmp_filename_used);
+    unlink(*tmp_filename_used);
+    g_free(*tmp_filename_used);
+    *tmp_filename_used = NULL;
     return -1;
   }
 
-  if (retval == 0 && filename) {
-    if (g_rename(tmp_filename_used, filename) < 0) {
-      fprintf(stderr, "Error renaming temporary file %s to %s: %s.\n",
-              tmp_filename_used, filename, strerror(errno));
+  return retval;
+}
+
+static int _rename_temporary_file(const gchar *tmp_filename, const gchar *filename)
+{
+  if (g_rename(tmp_filename, filename) < 0) {
+    fprintf(stderr, "Error renaming temporary file %s to %s: %s.\n",
+            tmp_filename, filename, strerror(errno));
+
+    unlink(tmp_filename);
+    return -1;
+  }
 
-      unlink(tmp_filename_used);
+  return 0;
+}
+
+int write_by_temporary_file(const gchar *filename,
+                            int(*writer)(FILE *f, gpointer user_data, int debug),
+                            gpointer user_data, gchar **used_filename, int debug)
+{
+  int retval;
+  gchar *tmp_filename_used;
+  gchar *dirname;
+
+  /* Anonymous temporary files are only scratch space, so there is no
+     point in flushing them to disk. */
+  retval = _write_temporary_file(filename, writer, user_data, &tmp_filename_used,
+                                 filename != NULL, debug);
+
+  if (!tmp_filename_used)
+    return retval;
+
+  if (retval == 0 && filename) {
+    if (_rename_temporary_file(tmp_filename_used, filename) < 0) {
       g_free(tmp_filename_used);
       return -1;
     }
 
+    dirname = g_path_get_dirname(filename);
+    _sync_directory(dirname);
+    g_free(dirname);
+
     if (used_filename)
       *used_filename = g_strdup(filename);
   } else {
@@ -101,17 +231,333 @@ int write_by_temporary_file(const gchar *filename,
   return retval;
 }
 
+commit_group *commit_group_new(void)
+{
+  commit_group *g = g_malloc(sizeof(struct _commit_group));
+
+  /* Maps file names to the temporary files that will replace them. */
+  g->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  return g;
+}
+
+int commit_group_write(commit_group *g, const gchar *filename,
+                       int(*writer)(FILE *f, gpointer user_data, int debug),
+                       gpointer user_data, int debug)
+{
+  int retval;
+  gchar *tmp_filename_used;
+  const gchar *superseded;
+
+  g_assert(filename);
+
+  retval = _write_temporary_file(filename, writer, user_data, &tmp_filename_used,
+                                 FALSE, debug);
+
+  if (!tmp_filename_used)
+    return retval;
+
+  if (retval) {
+    unlink(tmp_filename_used);
+    g_free(tmp_filename_used);
+    return retval;
+  }
+
+  /* An earlier version of the file that has not yet been committed is
+     superseded by this one. */
+  superseded = g_hash_table_lookup(g->pending, filename);
+
+  if (superseded)
+    unlink(superseded);
+
+  g_hash_table_replace(g->pending, g_strdup(filename), tmp_filename_used);
+
+  return 0;
+}
+
+int commit_group_commit(commit_group *g)
+{
+  GHashTableIter iter;
+  GHashTable *directories;
+  gpointer key, value;
+  int fd, ret = 0;
+
+  /* Flush the contents of all files before any of them replaces the file
+     it supersedes. */
+  g_hash_table_iter_init(&iter, g->pending);
+
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    fd = open((gchar *)value, O_RDONLY);
+
+    if (fd < 0 || _sync_file(fd) < 0) {
+      fprintf(stderr, "Error synchronising temporary file %s: %s.\n",
+              (gchar *)value, strerror(errno));
+
+      if (fd >= 0)
+        close(fd);
+
+      unlink((gchar *)value);
+      g_hash_table_iter_remove(&iter);
+      ret = -1;
+    } else
+      close(fd);
+  }
+
+  /* Rename the files into place, then flush each directory involved once. */
+  directories = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  g_hash_table_iter_init(&iter, g->pending);
+
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    if (_rename_temporary_file((gchar *)value, (gchar *)key) < 0)
+      ret = -1;
+    else
+      g_hash_table_replace(directories, g_path_get_dirname((gchar *)key), NULL);
+  }
+
+  g_hash_table_remove_all(g->pending);
+
+  g_hash_table_iter_init(&iter, directories);
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    if (_sync_directory((gchar *)key) < 0)
+      ret = -1;
+
+  g_hash_table_destroy(directories);
+
+  return ret;
+}
+
+static void _discard_pending_file(gpointer key, gpointer value, gpointer user_data)
+{
+  unlink((gchar *)value);
+}
+
+void commit_group_free(commit_group *g)
+{
+  /* Anything not yet committed is discarded. */
+  g_hash_table_foreach(g->pending, _discard_pending_file, NULL);
+  g_hash_table_destroy(g->pending);
+  g_free(g);
+}
+
 #define RFC822_TIME_BUFFER_LEN 64
 
 gchar *get_rfc822_time(void)
 {
-  char rfc822_time_buffer[RFC822_TIME_BUFFER_LEN];
-  time_t now;
+  return format_rfc822_time(time(NULL));
+}
 
-  now = time(NULL);
+/* Formats a time as get_rfc822_time() does. */
+gchar *format_rfc822_time(time_t t)
+{
+  char rfc822_time_buffer[RFC822_TIME_BUFFER_LEN];
+  struct tm tm;
 
-  if (strftime(rfc822_time_buffer, RFC822_TIME_BUFFER_LEN, "%a, %d-%b-%Y %X GMT", gmtime(&now)))
+  if (strftime(rfc822_time_buffer, RFC822_TIME_BUFFER_LEN, "%a, %d-%b-%Y %X GMT",
+               gmtime_r(&t, &tm)))
     return g_strdup(rfc822_time_buffer);
   else
     return NULL;
 }
+
+/* Parses a time stamp produced by get_rfc822_time() or
+   format_rfc822_time(). Returns -1 if the time stamp cannot be parsed. */
+time_t parse_rfc822_time(const gchar *s)
+{
+  struct tm tm;
+  const char *end;
+
+  memset(&tm, 0, sizeof(struct tm));
+
+  end = strptime(s, "%a, %d-%b-%Y %H:%M:%S GMT", &tm);
+
+  if (!end || *end)
+    return (time_t)-1;
+
+  return timegm(&tm);
+}
+
+/* Parses a date in the RFC 822 format used for pubDate in RSS feeds, for
+   example "Tue, 10 Jun 2003 04:00:00 GMT". The day of the week and the
+   seconds are optional, two-digit years are accepted, and the time zone
+   may be a numeric offset or one of the named zones in RFC 822. A date
+   without a time zone is taken to be in UTC. Returns -1 if the date
+   cannot be parsed. */
+time_t parse_pub_date(const gchar *s)
+{
+  static const char *months[] = {
+    "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"
+  };
+  static const struct {
+    const char *name;
+    int offset;
+  } zones[] = {
+    { "GMT", 0 }, { "UT", 0 }, { "UTC", 0 }, { "Z", 0 },
+    { "EST", -5 * 60 }, { "EDT", -4 * 60 }, { "CST", -6 * 60 }, { "CDT", -5 * 60 },
+    { "MST", -7 * 60 }, { "MDT", -6 * 60 }, { "PST", -8 * 60 }, { "PDT", -7 * 60 }
+  };
+  struct tm tm;
+  char month[4], zone[8];
+  int day, year, hour, minute, second = 0, offset = 0, n = 0, i, mon = -1;
+  const char *p = s;
+
+  while (g_ascii_isspace(*p))
+    p++;
+
+  /* Skip the day of the week. */
+  if (g_ascii_isalpha(*p)) {
+    p = strchr(p, ',');
+
+    if (!p)
+      return (time_t)-1;
+
+    p++;
+  }
+
+  if (sscanf(p, "%d %3s %d %d:%d%n", &day, month, &year, &hour, &minute, &n) != 5)
+    return (time_t)-1;
+
+  p += n;
+
+  if (*p == ':') {
+    if (sscanf(p, ":%d%n", &second, &n) != 1)
+      return (time_t)-1;
+
+    p += n;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(months); i++)
+    if (!g_ascii_strcasecmp(month, months[i]))
+      mon = i;
+
+  if (mon < 0)
+    return (time_t)-1;
+
+  if (year < 50)
+    year += 2000;
+  else if (year < 100)
+    year += 1900;
+
+  while (g_ascii_isspace(*p))
+    p++;
+
+  if (*p == '+' || *p == '-') {
+    if (sscanf(p + 1, "%4d", &n) != 1)
+      return (time_t)-1;
+
+    offset = (n / 100 * 60 + n % 100) * (*p == '-' ? -1 : 1);
+  } else if (sscanf(p, "%7s", zone) == 1) {
+    for (i = 0; i < G_N_ELEMENTS(zones); i++)
+      if (!g_ascii_strcasecmp(zone, zones[i].name))
+        offset = zones[i].offset;
+  }
+
+  memset(&tm, 0, sizeof(struct tm));
+  tm.tm_year = year - 1900;
+  tm.tm_mon = mon;
+  tm.tm_mday = day;
+  tm.tm_hour = hour;
+  tm.tm_min = minute;
+  tm.tm_sec = second;
+
+  return timegm(&tm) - offset * 60;
+}
+
+/* Prints a string as a JSON string literal. */
+void print_json_string(FILE *f, const gchar *s)
+{
+  fputc('"', f);
+
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((guchar)*s < 0x20)
+      fprintf(f, "\\u%04x", (guchar)*s);
+    else
+      fputc(*s, f);
+  }
+
+  fputc('"', f);
+}
+
+/* Appends a string to a buffer as a JSON string literal. */
+void append_json_string(GString *s, const gchar *value)
+{
+  g_string_append_c(s, '"');
+
+  for (; *value; value++) {
+    if (*value == '"' || *value == '\\')
+      g_string_append_printf(s, "\\%c", *value);
+    else if ((guchar)*value < 0x20)
+      g_string_append_printf(s, "\\u%04x", (guchar)*value);
+    else
+      g_string_append_c(s, *value);
+  }
+
+  g_string_append_c(s, '"');
+}
+
+/* Parses a size in bytes, optionally followed by k, M, G or T for
+   multiples of 1024. Returns -1 if the size is not valid. */
+int parse_size(const gchar *s, gint64 *result)
+{
+  gchar *endptr;
+  gint64 n;
+  int shift = 0;
+
+  n = g_ascii_strtoll(s, &endptr, 10);
+
+  if (endptr == s || n < 0)
+    return -1;
+
+  switch (*endptr) {
+  case '\0':
+    break;
+
+  case 'k':
+  case 'K':
+    shift = 10;
+    break;
+
+  case 'm':
+  case 'M':
+    shift = 20;
+    break;
+
+  case 'g':
+  case 'G':
+    shift = 30;
+    break;
+
+  case 't':
+  case 'T':
+    shift = 40;
+    break;
+
+  default:
+    return -1;
+  }
+
+  if (*endptr && *(endptr + 1))
+    return -1;
+
+  if (n > (G_MAXINT64 >> shift))
+    return -1;
+
+  *result = n << shift;
+
+  return 0;
+}
+
+/* Returns the number of bytes available to unprivileged users on the
+   file system that holds a path, or -1 if it cannot be found. */
+gint64 free_space(const gchar *path)
+{
+  struct statvfs buf;
+
+  if (statvfs(path, &buf) < 0)
+    return -1;
+
+  return (gint64)buf.f_bavail * (gint64)buf.f_frsize;
+}
@@ -21,12 +21,29 @@
 #define UTILS_H
 
 #include <stdio.h>
+#include <time.h>
 #include <glib.h>
 
+typedef struct _commit_group commit_group;
+
 int write_by_temporary_file(const gchar *filename,
                             int(*writer)(FILE *f, gpointer user_data, int debug),
                             gpointer user_data, gchar **used_filename,
                             int debug);
+commit_group *commit_group_new(void);
+int commit_group_write(commit_group *g, const gchar *filename,
+                       int(*writer)(FILE *f, gpointer user_data, int debug),
+                       gpointer user_data, int debug);
+int commit_group_commit(commit_group *g);
+void commit_group_free(commit_group *g);
+int sync_stream(FILE *f);
 gchar *get_rfc822_time(void);
+gchar *format_rfc822_time(time_t t);
+time_t parse_rfc822_time(const gchar *s);
+time_t parse_pub_date(const gchar *s);
+void print_json_string(FILE *f, const gchar *s);
+void append_json_string(GString *s, const gchar *value);
+int parse_size(const gchar *s, gint64 *result);
+gint64 free_space(const gchar *path);
 
 #endif /* UTILS_H */